@@ -25,6 +25,9 @@ minetest.registered_crafts = {}
 minetest.registered_fuels = {}
 minetest.registered_smeltables = {}
 minetest.registered_clones = {}
+-- Node name <-> content id, for use with the *_raw node access functions
+minetest.registered_content_ids = {}
+minetest.registered_content_names = {}
 
 -- For tables that are indexed by item name:
 -- If table[X] does not exist, default to table[minetest.registered_aliases[X]]
@@ -39,6 +42,16 @@ set_alias_metatable(minetest.registered_items)
 set_alias_metatable(minetest.registered_nodes)
 set_alias_metatable(minetest.registered_craftitems)
 set_alias_metatable(minetest.registered_tools)
+set_alias_metatable(minetest.registered_content_ids)
+
+-- The engine defines these nodes itself; they are never registered
+for _, name in ipairs({"air", "ignore"}) do
+	local id = minetest.get_content_id(name)
+	minetest.registered_content_ids[name] = id
+	minetest.registered_content_names[id] = name
+end
+assert(minetest.registered_content_names[minetest.registered_content_ids.air] == "air")
+assert(minetest.get_name_from_content_id(minetest.registered_content_ids.ignore) == "ignore")
 
 -- These item names may not be used because they would interfere
 -- with legacy itemstrings
@@ -150,7 +163,11 @@ function minetest.register_item(name, itemdef)
 	--minetest.log("Registering item: " .. itemdef.name)
 	minetest.registered_items[itemdef.name] = itemdef
 	minetest.registered_aliases[itemdef.name] = nil
-	register_item_raw(itemdef)
+	local id = register_item_raw(itemdef)
+	if id then
+		minetest.registered_content_ids[itemdef.name] = id
+		minetest.registered_content_names[id] = itemdef.name
+	end
 end
 
 function minetest.register_node(name, nodedef)
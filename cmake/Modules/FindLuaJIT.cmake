@@ -0,0 +1,17 @@
+# Look for LuaJIT, used instead of the bundled Lua if ENABLE_LUAJIT is set
+
+FIND_PATH(LUAJIT_INCLUDE_DIR luajit.h
+	PATH_SUFFIXES luajit-2.0 luajit2.0 luajit)
+
+FIND_LIBRARY(LUAJIT_LIBRARY NAMES luajit-5.1 luajit)
+
+IF(LUAJIT_LIBRARY AND LUAJIT_INCLUDE_DIR)
+	SET(LUAJIT_FOUND TRUE)
+ENDIF(LUAJIT_LIBRARY AND LUAJIT_INCLUDE_DIR)
+
+IF(LUAJIT_FOUND)
+	MESSAGE(STATUS "Found LuaJIT header file in ${LUAJIT_INCLUDE_DIR}")
+	MESSAGE(STATUS "Found LuaJIT library ${LUAJIT_LIBRARY}")
+ELSE(LUAJIT_FOUND)
+	MESSAGE(STATUS "LuaJIT not found")
+ENDIF(LUAJIT_FOUND)
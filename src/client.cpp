@@ -42,6 +42,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "sound.h"
 #include "utility_string.h"
 #include "hex.h"
+#include "shader.h"
 
 static std::string getMediaCacheDir()
 {
@@ -146,19 +147,153 @@ QueuedMeshUpdate * MeshUpdateQueue::pop()
 {
 	JMutexAutoLock lock(m_mutex);
 
-	bool must_be_urgent = !m_urgents.empty();
+	// Urgent blocks first; if all of them are being processed already,
+	// take any other block
+	for(int pass=0; pass<2; pass++)
+	{
+		bool must_be_urgent = (pass == 0);
+		if(must_be_urgent && m_urgents.empty())
+			continue;
+		for(std::vector<QueuedMeshUpdate*>::iterator
+				i = m_queue.begin();
+				i != m_queue.end(); i++)
+		{
+			QueuedMeshUpdate *q = *i;
+			if(must_be_urgent && m_urgents.count(q->p) == 0)
+				continue;
+			if(m_inflight.count(q->p) != 0)
+				continue;
+			m_queue.erase(i);
+			m_urgents.erase(q->p);
+			m_inflight[q->p] = q->data->m_lod;
+			return q;
+		}
+	}
+	return NULL;
+}
+
+void MeshUpdateQueue::done(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+	m_inflight.erase(p);
+}
+
+bool MeshUpdateQueue::isQueued(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+	if(m_inflight.count(p) != 0)
+		return true;
 	for(std::vector<QueuedMeshUpdate*>::iterator
 			i = m_queue.begin();
 			i != m_queue.end(); i++)
 	{
-		QueuedMeshUpdate *q = *i;
-		if(must_be_urgent && m_urgents.count(q->p) == 0)
-			continue;
-		m_queue.erase(i);
-		m_urgents.erase(q->p);
-		return q;
+		if((*i)->p == p)
+			return true;
 	}
-	return NULL;
+	return false;
+}
+
+u16 MeshUpdateQueue::getQueuedLod(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+	// A queued update is newer than the one being processed
+	for(std::vector<QueuedMeshUpdate*>::iterator
+			i = m_queue.begin();
+			i != m_queue.end(); i++)
+	{
+		if((*i)->p == p)
+			return (*i)->data->m_lod;
+	}
+	std::map<v3s16, u16>::iterator n = m_inflight.find(p);
+	if(n != m_inflight.end())
+		return n->second;
+	return 0;
+}
+
+/*
+	MeshCache
+*/
+
+MeshCache::MeshCache():
+	m_memory(0),
+	m_max_memory(0)
+{
+}
+
+MeshCache::~MeshCache()
+{
+	clear();
+}
+
+void MeshCache::setMaxMemory(u32 max_memory)
+{
+	m_max_memory = max_memory;
+	while(m_memory > m_max_memory && !m_lru.empty())
+		remove(m_entries.find(m_lru.back()));
+}
+
+void MeshCache::insert(u64 hash, MapBlockMesh *mesh, u32 face_connectivity)
+{
+	if(!isEnabled())
+		return;
+
+	std::map<u64, Entry>::iterator i = m_entries.find(hash);
+	if(i != m_entries.end())
+		remove(i);
+
+	Entry e;
+	e.mesh = NULL;
+	e.memory = sizeof(Entry) + sizeof(u64) * 2;
+	if(mesh != NULL)
+	{
+		e.mesh = new MapBlockMesh(*mesh);
+		e.memory += e.mesh->getMemoryUsage();
+	}
+	e.face_connectivity = face_connectivity;
+	m_lru.push_front(hash);
+	e.lru = m_lru.begin();
+	m_entries[hash] = e;
+	m_memory += e.memory;
+
+	while(m_memory > m_max_memory && !m_lru.empty())
+		remove(m_entries.find(m_lru.back()));
+}
+
+bool MeshCache::get(u64 hash, MapBlockMesh **mesh, u32 *face_connectivity)
+{
+	std::map<u64, Entry>::iterator i = m_entries.find(hash);
+	static ProfilerHandle hit_rate_handle =
+			g_profiler->getHandle("Meshcache: hit rate (%)");
+	g_profiler->avg(hit_rate_handle, i != m_entries.end() ? 100 : 0);
+	if(i == m_entries.end())
+		return false;
+
+	Entry &e = i->second;
+	m_lru.erase(e.lru);
+	m_lru.push_front(hash);
+	e.lru = m_lru.begin();
+
+	*mesh = NULL;
+	if(e.mesh != NULL)
+		*mesh = new MapBlockMesh(*e.mesh);
+	*face_connectivity = e.face_connectivity;
+	return true;
+}
+
+void MeshCache::clear()
+{
+	while(!m_entries.empty())
+		remove(m_entries.begin());
+}
+
+void MeshCache::remove(std::map<u64, Entry>::iterator i)
+{
+	assert(i != m_entries.end());
+	Entry &e = i->second;
+	delete e.mesh;
+	m_memory -= e.memory;
+	m_lru.erase(e.lru);
+	m_entries.erase(i);
 }
 
 /*
@@ -186,7 +321,7 @@ void * MeshUpdateThread::Thread()
 			continue;
 		}*/
 
-		QueuedMeshUpdate *q = m_queue_in.pop();
+		QueuedMeshUpdate *q = m_queue_in->pop();
 		if(q == NULL)
 		{
 			sleep_ms(3);
@@ -205,13 +340,18 @@ void * MeshUpdateThread::Thread()
 		MeshUpdateResult r;
 		r.p = q->p;
 		r.mesh = mesh_new;
+		r.face_connectivity = getFaceConnectivity(q->data);
 		r.ack_block_to_server = q->ack_block_to_server;
+		r.cache_hash = q->data->m_cache_hash;
 
 		/*infostream<<"MeshUpdateThread: Processed "
 				<<"("<<q->p.X<<","<<q->p.Y<<","<<q->p.Z<<")"
 				<<std::endl;*/
 
-		m_queue_out.push_back(r);
+		m_queue_out->push_back(r);
+
+		// Only now may a newer update of the same block be started
+		m_queue_in->done(q->p);
 
 		delete q;
 	}
@@ -221,6 +361,61 @@ void * MeshUpdateThread::Thread()
 	return NULL;
 }
 
+/*
+	MeshUpdateManager
+*/
+
+MeshUpdateManager::MeshUpdateManager()
+{
+}
+
+MeshUpdateManager::~MeshUpdateManager()
+{
+	stop();
+}
+
+void MeshUpdateManager::start(u32 num_threads)
+{
+	if(num_threads == 0)
+	{
+		num_threads = porting::getNumberOfProcessors();
+		if(num_threads > 1)
+			num_threads--;
+	}
+	infostream<<"Starting "<<num_threads<<" mesh update threads"
+			<<std::endl;
+	for(u32 i=0; i<num_threads; i++)
+	{
+		MeshUpdateThread *thread = new MeshUpdateThread(
+				&m_queue_in, &m_queue_out);
+		thread->Start();
+		m_threads.push_back(thread);
+	}
+}
+
+void MeshUpdateManager::stop()
+{
+	for(u32 i=0; i<m_threads.size(); i++)
+		m_threads[i]->setRun(false);
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		while(m_threads[i]->IsRunning())
+			sleep_ms(10);
+		delete m_threads[i];
+	}
+	m_threads.clear();
+}
+
+bool MeshUpdateManager::isRunning()
+{
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		if(m_threads[i]->IsRunning())
+			return true;
+	}
+	return false;
+}
+
 Client::Client(
 		IrrlichtDevice *device,
 		const char *playername,
@@ -237,7 +432,6 @@ Client::Client(
 	m_nodedef(nodedef),
 	m_sound(sound),
 	m_event(event),
-	m_mesh_update_thread(this),
 	m_env(
 		new ClientMap(this, this, control,
 			device->getSceneManager()->getRootSceneNode(),
@@ -247,6 +441,7 @@ Client::Client(
 	),
 	m_con(PROTOCOL_ID, 512, CONNECTION_TIMEOUT, this),
 	m_device(device),
+	m_daynight_shader(NULL),
 	m_server_ser_ver(SER_FMT_VER_INVALID),
 	m_playeritem(0),
 	m_inventory_updated(false),
@@ -275,6 +470,11 @@ Client::Client(
 	m_playerpos_send_timer = 0.0;
 	m_ignore_damage_timer = 0.0;
 
+	m_daynight_shader = new DayNightShader(device);
+
+	m_mesh_cache.setMaxMemory(
+			(u32)g_settings->getU16("mesh_cache_size") * 1024 * 1024);
+
 	// Build main texture atlas, now that the GameDef exists (that is, us)
 	if(g_settings->getBool("enable_texture_atlas"))
 		m_tsrc->buildMainAtlas(this);
@@ -300,11 +500,12 @@ Client::~Client()
 		m_con.Disconnect();
 	}
 
-	m_mesh_update_thread.setRun(false);
-	while(m_mesh_update_thread.IsRunning())
-		sleep_ms(100);
+	m_mesh_update_manager.stop();
 
 	delete m_inventory_from_server;
+
+	// The shader materials of the video driver may still refer to it
+	m_daynight_shader->drop();
 }
 
 void Client::connect(Address address)
@@ -530,6 +731,19 @@ void Client::step(float dtime)
 		m_env.getMap().timerUpdate(map_timer_and_unload_dtime,
 				g_settings->getFloat("client_unload_unused_data_timeout"),
 				&deleted_blocks);
+		for(core::list<v3s16>::Iterator i = deleted_blocks.begin();
+				i != deleted_blocks.end(); i++)
+			m_env.getClientMap().blockMeshChanged(*i);
+
+		// Compress the blocks that are out of sight
+		{
+			ScopeProfiler sp(g_profiler, "Client: compress blocks");
+			Player *player = m_env.getLocalPlayer();
+			assert(player != NULL);
+			v3s16 player_block = getNodeBlockPos(
+					floatToInt(player->getPosition(), BS));
+			m_env.getClientMap().compressBlocks(player_block);
+		}
 				
 		/*if(deleted_blocks.size() > 0)
 			infostream<<"Client: Unloaded "<<deleted_blocks.size()
@@ -664,14 +878,17 @@ void Client::step(float dtime)
 		// 0ms
 		
 		/*infostream<<"Mesh update result queue size is "
-				<<m_mesh_update_thread.m_queue_out.size()
+				<<m_mesh_update_manager.m_queue_out.size()
 				<<std::endl;*/
 		
+		g_profiler->avg("Meshcache: memory (KiB)",
+				m_mesh_cache.getMemory() / 1024);
+
 		int num_processed_meshes = 0;
-		while(m_mesh_update_thread.m_queue_out.size() > 0)
+		while(m_mesh_update_manager.m_queue_out.size() > 0)
 		{
 			num_processed_meshes++;
-			MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_front();
+			MeshUpdateResult r = m_mesh_update_manager.m_queue_out.pop_front();
 			MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(r.p);
 			if(block)
 			{
@@ -687,6 +904,16 @@ void Client::step(float dtime)
 
 				// Replace with the new mesh
 				block->mesh = r.mesh;
+				if(r.cache_hash != 0)
+					m_mesh_cache.insert(r.cache_hash, r.mesh,
+							r.face_connectivity);
+				m_env.getClientMap().blockMeshChanged(r.p);
+
+				if(block->face_connectivity != r.face_connectivity)
+				{
+					block->face_connectivity = r.face_connectivity;
+					m_env.getClientMap().faceConnectivityChanged();
+				}
 			}
 			if(r.ack_block_to_server)
 			{
@@ -883,7 +1110,9 @@ void Client::ReceiveAll()
 		
 		try{
 			Receive();
-			g_profiler->graphAdd("client_received_packets", 1);
+			static ProfilerHandle packets_handle =
+					g_profiler->getHandle("client_received_packets");
+			g_profiler->graphAdd(packets_handle, 1);
 		}
 		catch(con::NoIncomingDataException &e)
 		{
@@ -1378,6 +1607,33 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		u8 oxygen = readU8(is);
 		player->oxygen = oxygen;
 	}
+	else if(command == TOCLIENT_PLAYER_STATE)
+	{
+		std::string datastring((char*)&data[2], datasize-2);
+		std::istringstream is(datastring, std::ios_base::binary);
+		Player *player = m_env.getLocalPlayer();
+		assert(player != NULL);
+		u8 fields = readU8(is);
+		if(fields & PLAYER_STATE_HP)
+		{
+			u8 oldhp = player->hp;
+			u8 hp = readU8(is);
+			player->hp = hp;
+
+			if(hp < oldhp)
+			{
+				// Add to ClientEvent queue
+				ClientEvent event;
+				event.type = CE_PLAYER_DAMAGE;
+				event.player_damage.amount = oldhp - hp;
+				m_client_event_queue.push_back(event);
+			}
+		}
+		if(fields & PLAYER_STATE_HUNGER)
+			player->hunger = readU8(is);
+		if(fields & PLAYER_STATE_OXYGEN)
+			player->oxygen = readU8(is);
+	}
 	else if(command == TOCLIENT_KICK)
 	{
 		ClientEvent event;
@@ -1446,7 +1702,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		int num_files = readU16(is);
 		
@@ -1529,7 +1785,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		/*
 			u16 command
@@ -1608,7 +1864,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		// Decompress node definitions
 		std::string datastring((char*)&data[2], datasize-2);
@@ -1633,7 +1889,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		// Decompress item definitions
 		std::string datastring((char*)&data[2], datasize-2);
@@ -2207,6 +2463,54 @@ void Client::setCrack(int level, v3s16 pos)
 	}
 }
 
+DayNightShader* Client::getDayNightShader()
+{
+	if(!m_daynight_shader->isEnabled())
+		return NULL;
+	return m_daynight_shader;
+}
+
+static u16 lodAtDistance(f32 d, s32 lod_distance)
+{
+	if(d < lod_distance)
+		return 1;
+	if(d < lod_distance * 2)
+		return 2;
+	if(d < lod_distance * 4)
+		return 4;
+	return 8;
+}
+
+// Fraction of a distance threshold by which a block has to cross it
+// before its level of detail changes
+#define LOD_HYSTERESIS 0.1
+
+u16 Client::getMeshLod(v3s16 blockpos, u16 current_lod)
+{
+	// Distance in nodes at which the level of detail starts halving
+	s32 lod_distance = g_settings->getS32("lod_distance");
+	if(lod_distance <= 0)
+		return 1;
+	Player *player = m_env.getLocalPlayer();
+	assert(player != NULL);
+	v3f block_center = intToFloat(blockpos * MAP_BLOCKSIZE, BS)
+			+ v3f(1,1,1) * (MAP_BLOCKSIZE-1) * BS / 2;
+	f32 d = block_center.getDistanceFrom(player->getPosition()) / BS;
+	u16 lod = lodAtDistance(d, lod_distance);
+	if(current_lod != 0 && current_lod != lod
+			&& current_lod >= lodAtDistance(d * (1.0 - LOD_HYSTERESIS),
+					lod_distance)
+			&& current_lod <= lodAtDistance(d * (1.0 + LOD_HYSTERESIS),
+					lod_distance))
+		return current_lod;
+	return lod;
+}
+
+u16 Client::getQueuedMeshLod(v3s16 blockpos)
+{
+	return m_mesh_update_manager.m_queue_in.getQueuedLod(blockpos);
+}
+
 u16 Client::getHP()
 {
 	Player *player = m_env.getLocalPlayer();
@@ -2296,16 +2600,40 @@ void Client::addUpdateMeshTask(v3s16 p, bool ack_to_server, bool urgent)
 		data->fill(b);
 		data->setCrack(m_crack_level, m_crack_pos);
 		data->setSmoothLighting(g_settings->getBool("smooth_lighting"));
+		data->setGreedyMeshing(g_settings->getBool("greedy_meshing"));
+		data->setLod(getMeshLod(p, b->mesh ? b->mesh->getLod() : 0));
+		data->setDayNightShader(getDayNightShader());
+	}
+
+	/*
+		Look up the mesh cache. A mesh with a crack is always built,
+		and if an update of the block is pending already, the result
+		has to come after it.
+	*/
+	if(m_mesh_cache.isEnabled() && !data->hasCrack())
+	{
+		data->m_cache_hash = getMeshHash(data);
+		MeshUpdateResult r;
+		if(!m_mesh_update_manager.m_queue_in.isQueued(p)
+				&& m_mesh_cache.get(data->m_cache_hash,
+						&r.mesh, &r.face_connectivity))
+		{
+			r.p = p;
+			r.ack_block_to_server = ack_to_server;
+			m_mesh_update_manager.m_queue_out.push_back(r);
+			delete data;
+			return;
+		}
 	}
 
 	// Debug wait
-	//while(m_mesh_update_thread.m_queue_in.size() > 0) sleep_ms(10);
+	//while(m_mesh_update_manager.m_queue_in.size() > 0) sleep_ms(10);
 	
 	// Add task to queue
-	m_mesh_update_thread.m_queue_in.addBlock(p, data, ack_to_server, urgent);
+	m_mesh_update_manager.m_queue_in.addBlock(p, data, ack_to_server, urgent);
 
 	/*infostream<<"Mesh update input queue size is "
-			<<m_mesh_update_thread.m_queue_in.size()
+			<<m_mesh_update_manager.m_queue_in.size()
 			<<std::endl;*/
 }
 
@@ -2417,11 +2745,14 @@ void Client::afterContentReceived()
 	// Update node textures
 	m_nodedef->updateTextures(m_tsrc);
 
+	// Generate the textures that would be generated while drawing
+	m_tsrc->prebakeNodeTextures(this);
+
 	// Update item textures and meshes
 	m_itemdef->updateTexturesAndMeshes(this);
 
-	// Start mesh update thread after setting up content definitions
-	m_mesh_update_thread.Start();
+	// Start mesh update threads after setting up content definitions
+	m_mesh_update_manager.start(g_settings->getU16("mesh_generation_threads"));
 }
 
 float Client::getRTT(void)
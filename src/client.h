@@ -26,6 +26,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "jmutex.h"
 #include <ostream>
 #include <set>
+#include <list>
+#include <map>
 #include <vector>
 #include "clientobject.h"
 #include "utility.h" // For IntervalLimiter
@@ -45,6 +47,7 @@ class IWritableNodeDefManager;
 class ClientEnvironment;
 struct MapDrawControl;
 class MtEventManager;
+class DayNightShader;
 
 class ClientNotReadyException : public BaseException
 {
@@ -82,8 +85,20 @@ public:
 
 	// Returned pointer must be deleted
 	// Returns NULL if queue is empty
+	// Blocks that are being processed are not returned until done()
+	// has been called for them, so that their results stay in order.
 	QueuedMeshUpdate * pop();
 
+	// Called when the update of a popped block has been finished
+	void done(v3s16 p);
+
+	// Whether an update of the block is queued or being processed
+	bool isQueued(v3s16 p);
+
+	// Level of detail of the newest queued or processed update of the
+	// block, 0 if there is none
+	u16 getQueuedLod(v3s16 p);
+
 	u32 size()
 	{
 		JMutexAutoLock lock(m_mutex);
@@ -93,6 +108,8 @@ public:
 private:
 	std::vector<QueuedMeshUpdate*> m_queue;
 	std::set<v3s16> m_urgents;
+	// Blocks popped and not done yet, with the level of detail
+	std::map<v3s16, u16> m_inflight;
 	JMutex m_mutex;
 };
 
@@ -100,32 +117,114 @@ struct MeshUpdateResult
 {
 	v3s16 p;
 	MapBlockMesh *mesh;
+	u32 face_connectivity;
 	bool ack_block_to_server;
+	// If not 0, the mesh is added to the mesh cache with this key
+	u64 cache_hash;
 
 	MeshUpdateResult():
 		p(-1338,-1338,-1338),
 		mesh(NULL),
-		ack_block_to_server(false)
+		face_connectivity(0),
+		ack_block_to_server(false),
+		cache_hash(0)
 	{
 	}
 };
 
+/*
+	A least recently used cache of finished block meshes by
+	getMeshHash(), so that blocks that are received again unchanged
+	don't have to be meshed again. The cached meshes share their
+	geometry with the meshes of the blocks.
+
+	Only to be used from the main thread.
+*/
+class MeshCache
+{
+public:
+	MeshCache();
+	~MeshCache();
+
+	// 0 disables the cache
+	void setMaxMemory(u32 max_memory);
+	bool isEnabled()
+	{
+		return m_max_memory != 0;
+	}
+
+	// mesh is NULL for blocks that have nothing to draw
+	void insert(u64 hash, MapBlockMesh *mesh, u32 face_connectivity);
+	// On a hit, mesh is set to a new mesh sharing the cached geometry
+	bool get(u64 hash, MapBlockMesh **mesh, u32 *face_connectivity);
+	void clear();
+
+	u32 getMemory()
+	{
+		return m_memory;
+	}
+
+private:
+	struct Entry
+	{
+		MapBlockMesh *mesh;
+		u32 face_connectivity;
+		u32 memory;
+		std::list<u64>::iterator lru;
+	};
+	void remove(std::map<u64, Entry>::iterator i);
+
+	std::map<u64, Entry> m_entries;
+	// Most recently used first
+	std::list<u64> m_lru;
+	u32 m_memory;
+	u32 m_max_memory;
+};
+
 class MeshUpdateThread : public SimpleThread
 {
 public:
 
-	MeshUpdateThread(IGameDef *gamedef):
-		m_gamedef(gamedef)
+	MeshUpdateThread(MeshUpdateQueue *queue_in,
+			MutexedQueue<MeshUpdateResult> *queue_out):
+		m_queue_in(queue_in),
+		m_queue_out(queue_out)
 	{
 	}
 
 	void * Thread();
 
+private:
+	MeshUpdateQueue *m_queue_in;
+	MutexedQueue<MeshUpdateResult> *m_queue_out;
+};
+
+/*
+	A pool of MeshUpdateThreads working on a shared queue
+*/
+class MeshUpdateManager
+{
+public:
+	MeshUpdateManager();
+	~MeshUpdateManager();
+
+	// Starts the threads; num_threads = 0 uses one thread less than
+	// there are processors, but at least one
+	void start(u32 num_threads);
+	// Stops the threads and waits for them to exit
+	void stop();
+	bool isRunning();
+	u32 getThreadCount()
+	{
+		return m_threads.size();
+	}
+
 	MeshUpdateQueue m_queue_in;
 
 	MutexedQueue<MeshUpdateResult> m_queue_out;
 
-	IGameDef *m_gamedef;
+private:
+	std::vector<MeshUpdateThread*> m_threads;
 };
 
 enum ClientEventType
@@ -260,6 +359,16 @@ public:
 	int getCrackLevel();
 	void setCrack(int level, v3s16 pos);
 
+	// NULL if day/night lighting is done on the CPU
+	DayNightShader* getDayNightShader();
+
+	// Level of detail the mesh of a block should be built with.
+	// Near the distance thresholds current_lod is kept, so that a
+	// block at the boundary is not rebuilt back and forth.
+	u16 getMeshLod(v3s16 blockpos, u16 current_lod=0);
+	// Level of detail of a pending mesh update of a block, 0 if none
+	u16 getQueuedMeshLod(v3s16 blockpos);
+
 	u16 getHP();
 	u16 getHunger();
 	u16 getOxygen();
@@ -344,10 +453,12 @@ private:
 	ISoundManager *m_sound;
 	MtEventManager *m_event;
 
-	MeshUpdateThread m_mesh_update_thread;
+	MeshUpdateManager m_mesh_update_manager;
+	MeshCache m_mesh_cache;
 	ClientEnvironment m_env;
 	con::Connection m_con;
 	IrrlichtDevice *m_device;
+	DayNightShader *m_daynight_shader;
 	// Server serialization version
 	u8 m_server_ser_ver;
 	u16 m_playeritem;
@@ -35,6 +35,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 #include "profiler.h"
 #include "settings.h"
+#include "shader.h"
+#include <algorithm>
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -52,7 +54,21 @@ ClientMap::ClientMap(
 	m_control(control),
 	m_camera_position(0,0,0),
 	m_camera_direction(0,0,1),
-	m_camera_fov(PI)
+	m_camera_fov(PI),
+	m_visible_blocks_valid(false),
+	m_visible_blocks_camera(0,0,0),
+	m_visible_blocks_radius(0),
+	m_drawlist_valid(false),
+	m_drawlist_camera_block(0,0,0),
+	m_drawlist_range(0),
+	m_drawlist_occlusion_culling(false),
+	m_drawlist_blocks_in_range(0),
+	m_drawlist_blocks_without_mesh(0),
+	m_drawlist_blocks_occlusion_culled(0),
+	m_region_meshes_enabled(g_settings->getBool("enable_region_meshes")),
+	m_block_count(0),
+	m_compressed_block_count(0),
+	m_node_data_size(0)
 {
 	m_camera_mutex.Init();
 	assert(m_camera_mutex.IsInitialized());
@@ -70,6 +86,10 @@ ClientMap::~ClientMap()
 		mesh->drop();
 		mesh = NULL;
 	}*/
+
+	for(std::map<v3s16, ClientMapRegion*>::iterator
+			i = m_regions.begin(); i != m_regions.end(); i++)
+		delete i->second;
 }
 
 MapSector * ClientMap::emergeSector(v2s16 p2d)
@@ -133,33 +153,388 @@ void ClientMap::OnRegisterSceneNode()
 	ISceneNode::OnRegisterSceneNode();
 }
 
-static bool isOccluded(Map *map, v3s16 p0, v3s16 p1, float step, float stepfac,
-		float start_off, float end_off, u32 needed_count, INodeDefManager *nodemgr)
+struct VisibilityStep
 {
-	float d0 = (float)BS * p0.getDistanceFrom(p1);
-	v3s16 u0 = p1 - p0;
-	v3f uf = v3f(u0.X, u0.Y, u0.Z) * BS;
-	uf.normalize();
-	v3f p0f = v3f(p0.X, p0.Y, p0.Z) * BS;
-	u32 count = 0;
-	for(float s=start_off; s<d0+end_off; s+=step){
-		v3f pf = p0f + uf * s;
-		v3s16 p = floatToInt(pf, BS);
-		MapNode n = map->getNodeNoEx(p);
-		bool is_transparent = false;
-		const ContentFeatures &f = nodemgr->get(n);
-		if(f.solidness == 0)
-			is_transparent = (f.visual_solidness != 2);
+	v3s16 p;
+	// Face through which the block was entered; -1 for the camera block
+	s8 entry_face;
+	// Bits of the directions of g_6dirs travelled so far
+	u8 dirs;
+};
+
+void ClientMap::updateVisibleBlocks(v3s16 camera_block, s16 radius)
+{
+	m_visible_blocks_valid = true;
+	m_visible_blocks_camera = camera_block;
+	m_visible_blocks_radius = radius;
+
+	s32 d = 2 * radius + 1;
+	m_visible_blocks.assign(d * d * d, 0);
+	v3s16 p_min = camera_block - v3s16(1,1,1) * radius;
+
+	std::vector<VisibilityStep> queue;
+	VisibilityStep start = {camera_block, -1, 0};
+	queue.push_back(start);
+	m_visible_blocks[(radius * d + radius) * d + radius] = 1;
+
+	for(u32 head=0; head<queue.size(); head++)
+	{
+		VisibilityStep step = queue[head];
+		MapBlock *block = getBlockNoCreateNoEx(step.p);
+		u32 connectivity = block ? block->face_connectivity
+				: FACE_CONNECTIVITY_ALL;
+		for(u8 face=0; face<6; face++)
+		{
+			u8 opposite = (face + 3) % 6;
+			// Never turn back towards the camera
+			if(step.dirs & (1<<opposite))
+				continue;
+			if(step.entry_face >= 0 && (face == step.entry_face
+					|| !(connectivity & faceConnectivityBit(
+							step.entry_face, face))))
+				continue;
+			v3s16 p = step.p + g_6dirs[face];
+			v3s16 rel = p - p_min;
+			if(rel.X < 0 || rel.Y < 0 || rel.Z < 0
+					|| rel.X >= d || rel.Y >= d || rel.Z >= d)
+				continue;
+			u8 &visible = m_visible_blocks[(rel.Z * d + rel.Y) * d + rel.X];
+			if(visible)
+				continue;
+			visible = 1;
+			VisibilityStep next = {p, (s8)opposite,
+					(u8)(step.dirs | (1<<face))};
+			queue.push_back(next);
+		}
+	}
+}
+
+bool ClientMap::isBlockOccluded(v3s16 p)
+{
+	s16 radius = m_visible_blocks_radius;
+	s32 d = 2 * radius + 1;
+	v3s16 rel = p - m_visible_blocks_camera + v3s16(1,1,1) * radius;
+	if(rel.X < 0 || rel.Y < 0 || rel.Z < 0
+			|| rel.X >= d || rel.Y >= d || rel.Z >= d)
+		return false;
+	return m_visible_blocks[(rel.Z * d + rel.Y) * d + rel.X] == 0;
+}
+
+void ClientMap::blockMeshChanged(v3s16 p)
+{
+	m_drawlist_valid = false;
+
+	// The region is rebuilt when it is seen the next time
+	v3s16 region_pos = getContainerPos(p, CLIENTMAP_REGION_SIZE);
+	std::map<v3s16, ClientMapRegion*>::iterator i = m_regions.find(region_pos);
+	if(i != m_regions.end())
+	{
+		delete i->second;
+		m_regions.erase(i);
+	}
+}
+
+void ClientMap::compressBlocks(v3s16 center_block)
+{
+	// Leave some margin so that blocks at the edge of the view range,
+	// which are read when meshing their neighbors, stay uncompressed
+	s32 range_blocks = m_control.wanted_range / MAP_BLOCKSIZE + 2;
+
+	m_block_count = 0;
+	m_compressed_block_count = 0;
+	m_node_data_size = 0;
+
+	for(core::map<v2s16, MapSector*>::Iterator
+			si = m_sectors.getIterator();
+			si.atEnd() == false; si++)
+	{
+		MapSector *sector = si.getNode()->getValue();
+		core::list< MapBlock * > sectorblocks;
+		sector->getBlocks(sectorblocks);
+		for(core::list< MapBlock * >::Iterator i = sectorblocks.begin();
+				i != sectorblocks.end(); i++)
+		{
+			MapBlock *block = *i;
+			m_block_count++;
+
+			if(!block->isCompressed())
+			{
+				v3s16 d = block->getPos() - center_block;
+				s32 distance_sq = (s32)d.X*d.X + (s32)d.Y*d.Y + (s32)d.Z*d.Z;
+				bool out_of_range = (m_control.range_all == false
+						&& distance_sq > range_blocks * range_blocks);
+				if(block->mesh == NULL || out_of_range)
+					block->compressNodes();
+			}
+
+			if(block->isCompressed())
+				m_compressed_block_count++;
+			m_node_data_size += block->getNodeDataSize();
+		}
+	}
+}
+
+void ClientMap::updateRegion(video::IVideoDriver* driver, v3s16 region_pos,
+		ClientMapRegion *region)
+{
+	if(region->mesh)
+		region->mesh->drop();
+	region->mesh = new scene::SMesh();
+	region->members.clear();
+	region->dirty = false;
+
+	v3s16 p0 = region_pos * CLIENTMAP_REGION_SIZE;
+	for(s16 z=0; z<CLIENTMAP_REGION_SIZE; z++)
+	for(s16 y=0; y<CLIENTMAP_REGION_SIZE; y++)
+	for(s16 x=0; x<CLIENTMAP_REGION_SIZE; x++)
+	{
+		v3s16 p = p0 + v3s16(x,y,z);
+		MapBlock *block = getBlockNoCreateNoEx(p);
+		if(block == NULL || block->mesh == NULL
+				|| block->mesh->hasAnimation())
+			continue;
+
+		scene::SMesh *mesh = block->mesh->getMesh();
+		for(u32 i=0; i<mesh->getMeshBufferCount(); i++)
+		{
+			scene::IMeshBuffer *buf = mesh->getMeshBuffer(i);
+			const video::SMaterial &material = buf->getMaterial();
+			video::IMaterialRenderer* rnd =
+					driver->getMaterialRenderer(material.MaterialType);
+			if(rnd && rnd->isTransparent())
+				continue;
+
+			// Find a buffer of the same material with room for the
+			// vertices; indices are 16-bit
+			scene::SMeshBuffer *dest = NULL;
+			for(u32 j=0; j<region->mesh->getMeshBufferCount(); j++)
+			{
+				scene::SMeshBuffer *b = (scene::SMeshBuffer*)
+						region->mesh->getMeshBuffer(j);
+				if(b->Material == material && b->getVertexCount()
+						+ buf->getVertexCount() <= 65535)
+				{
+					dest = b;
+					break;
+				}
+			}
+			if(dest == NULL)
+			{
+				dest = new scene::SMeshBuffer();
+				dest->Material = material;
+				region->mesh->addMeshBuffer(dest);
+				dest->drop();
+			}
+			dest->append(buf->getVertices(), buf->getVertexCount(),
+					buf->getIndices(), buf->getIndexCount());
+			region->members.insert(p);
+		}
+	}
+}
+
+void ClientMap::selectRegions(video::IVideoDriver* driver)
+{
+	m_regions_drawn.clear();
+	m_drawlist_merged.assign(m_drawlist.size(), 0);
+
+	// Rebuilding a region copies the meshes of up to
+	// CLIENTMAP_REGION_SIZE^3 blocks, so only do a few per frame
+	u32 rebuild_budget = 2;
+	u32 rebuilt_count = 0;
+
+	// Visible member blocks of each region
+	std::map<ClientMapRegion*, u32> visible_members;
+	for(u32 i=0; i<m_drawlist.size(); i++)
+	{
+		if(!m_drawlist_visible[i])
+			continue;
+		v3s16 p = m_drawlist[i]->getPos();
+		v3s16 region_pos = getContainerPos(p, CLIENTMAP_REGION_SIZE);
+		ClientMapRegion *region = NULL;
+		std::map<v3s16, ClientMapRegion*>::iterator n =
+				m_regions.find(region_pos);
+		if(n != m_regions.end())
+		{
+			region = n->second;
+		}
 		else
-			is_transparent = (f.solidness != 2);
-		if(!is_transparent){
-			count++;
-			if(count >= needed_count)
-				return true;
+		{
+			region = new ClientMapRegion();
+			m_regions[region_pos] = region;
 		}
-		step *= stepfac;
+		if(region->dirty)
+		{
+			if(rebuilt_count >= rebuild_budget)
+				continue;
+			updateRegion(driver, region_pos, region);
+			rebuilt_count++;
+		}
+		if(region->members.count(p))
+			visible_members[region]++;
+	}
+	g_profiler->avg("CM: regions rebuilt", rebuilt_count);
+
+	for(std::map<ClientMapRegion*, u32>::iterator
+			i = visible_members.begin(); i != visible_members.end(); i++)
+	{
+		if(i->second == i->first->members.size())
+			m_regions_drawn.push_back(i->first);
+	}
+	std::set<ClientMapRegion*> drawn(m_regions_drawn.begin(),
+			m_regions_drawn.end());
+
+	for(u32 i=0; i<m_drawlist.size(); i++)
+	{
+		if(!m_drawlist_visible[i])
+			continue;
+		v3s16 p = m_drawlist[i]->getPos();
+		std::map<v3s16, ClientMapRegion*>::iterator n =
+				m_regions.find(getContainerPos(p, CLIENTMAP_REGION_SIZE));
+		if(n == m_regions.end() || drawn.count(n->second) == 0)
+			continue;
+		if(n->second->members.count(p))
+			m_drawlist_merged[i] = 1;
 	}
-	return false;
+}
+
+static bool drawListBufferMaterialLess(const DrawListBuffer &a,
+		const DrawListBuffer &b)
+{
+	const video::SMaterial &ma = a.buf->getMaterial();
+	const video::SMaterial &mb = b.buf->getMaterial();
+	if(ma.getTexture(0) != mb.getTexture(0))
+		return ma.getTexture(0) < mb.getTexture(0);
+	if(ma.MaterialType != mb.MaterialType)
+		return ma.MaterialType < mb.MaterialType;
+	return a.block_index < b.block_index;
+}
+
+void ClientMap::updateDrawList(video::IVideoDriver* driver,
+		v3s16 camera_block, s16 range_blocks, bool occlusion_culling)
+{
+	m_drawlist_valid = true;
+	m_drawlist_camera_block = camera_block;
+	m_drawlist_range = range_blocks;
+	m_drawlist_occlusion_culling = occlusion_culling;
+
+	m_drawlist.clear();
+	m_drawlist_solid.clear();
+	m_drawlist_transparent.clear();
+	m_drawlist_blocks_in_range = 0;
+	m_drawlist_blocks_without_mesh = 0;
+	m_drawlist_blocks_occlusion_culled = 0;
+
+	/*
+		Meshes that have a different level of detail than wanted at
+		their current distance are rebuilt. The list is updated again
+		when they are done, so only a few are queued at a time.
+	*/
+	u32 lod_updates_left = 10;
+
+	if(occlusion_culling)
+	{
+		// Limit the flood fill when drawing everything
+		s16 radius = MYMIN(range_blocks, 24);
+		if(!m_visible_blocks_valid
+				|| camera_block != m_visible_blocks_camera
+				|| radius != m_visible_blocks_radius)
+		{
+			ScopeProfiler sp(g_profiler, "CM: occlusion flood fill", SPT_AVG);
+			updateVisibleBlocks(camera_block, radius);
+		}
+	}
+
+	/*
+		Collect the blocks in range, nearest first
+	*/
+
+	std::vector<std::pair<s32, MapBlock*> > blocks;
+	for(core::map<v2s16, MapSector*>::Iterator
+			si = m_sectors.getIterator();
+			si.atEnd() == false; si++)
+	{
+		MapSector *sector = si.getNode()->getValue();
+		v2s16 sp = sector->getPos();
+		if(m_control.range_all == false)
+		{
+			if(sp.X < camera_block.X - range_blocks
+			|| sp.X > camera_block.X + range_blocks
+			|| sp.Y < camera_block.Z - range_blocks
+			|| sp.Y > camera_block.Z + range_blocks)
+				continue;
+		}
+
+		core::list< MapBlock * > sectorblocks;
+		sector->getBlocks(sectorblocks);
+		for(core::list< MapBlock * >::Iterator i = sectorblocks.begin();
+				i != sectorblocks.end(); i++)
+		{
+			MapBlock *block = *i;
+			v3s16 d = block->getPos() - camera_block;
+			s32 distance_sq = (s32)d.X*d.X + (s32)d.Y*d.Y + (s32)d.Z*d.Z;
+			if(m_control.range_all == false &&
+					distance_sq > (s32)range_blocks*range_blocks)
+				continue;
+
+			m_drawlist_blocks_in_range++;
+
+			if(block->mesh == NULL){
+				m_drawlist_blocks_without_mesh++;
+				continue;
+			}
+
+			if(occlusion_culling && isBlockOccluded(block->getPos())){
+				m_drawlist_blocks_occlusion_culled++;
+				continue;
+			}
+
+			if(lod_updates_left > 0){
+				u16 lod = m_client->getMeshLod(block->getPos(),
+						block->mesh->getLod());
+				// Skip blocks that have the rebuild pending already
+				if(lod != block->mesh->getLod()
+						&& m_client->getQueuedMeshLod(block->getPos()) != lod){
+					m_client->addUpdateMeshTask(block->getPos());
+					lod_updates_left--;
+				}
+			}
+
+			blocks.push_back(std::make_pair(distance_sq, block));
+		}
+	}
+	std::sort(blocks.begin(), blocks.end());
+
+	/*
+		Collect the mesh buffers; solid ones sorted by material to
+		reduce texture and state switches, transparent ones from far
+		to near
+	*/
+
+	for(u32 i=0; i<blocks.size(); i++)
+	{
+		MapBlock *block = blocks[i].second;
+		m_drawlist.push_back(block);
+
+		scene::SMesh *mesh = block->mesh->getMesh();
+		for(u32 j=0; j<mesh->getMeshBufferCount(); j++)
+		{
+			DrawListBuffer b;
+			b.block_index = i;
+			b.buf = mesh->getMeshBuffer(j);
+			const video::SMaterial& material = b.buf->getMaterial();
+			video::IMaterialRenderer* rnd =
+					driver->getMaterialRenderer(material.MaterialType);
+			if(rnd && rnd->isTransparent())
+				m_drawlist_transparent.push_back(b);
+			else
+				m_drawlist_solid.push_back(b);
+		}
+	}
+	std::sort(m_drawlist_solid.begin(), m_drawlist_solid.end(),
+			drawListBufferMaterialLess);
+	std::reverse(m_drawlist_transparent.begin(), m_drawlist_transparent.end());
+
+	m_drawlist_visible.assign(m_drawlist.size(), 0);
 }
 
 void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
@@ -177,14 +552,6 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 	else
 		prefix = "CM: transparent: ";
 
-	/*
-		This is called two times per frame, reset on the non-transparent one
-	*/
-	if(pass == scene::ESNRP_SOLID)
-	{
-		m_last_drawn_sectors.clear();
-	}
-
 	/*
 		Get time for measuring timeout.
 		
@@ -199,6 +566,9 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 	float animation_time = m_client->getAnimationTime();
 	int crack = m_client->getCrackLevel();
 	u32 daynight_ratio = m_client->getEnv().getDayNightRatio();
+	DayNightShader *daynight_shader = m_client->getDayNightShader();
+	if(daynight_shader)
+		daynight_shader->setDayNightRatio(daynight_ratio);
 
 	m_camera_mutex.Lock();
 	v3f camera_position = m_camera_position;
@@ -206,28 +576,8 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 	f32 camera_fov = m_camera_fov;
 	m_camera_mutex.Unlock();
 
-	/*
-		Get all blocks and draw all visible ones
-	*/
-
 	v3s16 cam_pos_nodes = floatToInt(camera_position, BS);
-	
-	v3s16 box_nodes_d = m_control.wanted_range * v3s16(1,1,1);
-
-	v3s16 p_nodes_min = cam_pos_nodes - box_nodes_d;
-	v3s16 p_nodes_max = cam_pos_nodes + box_nodes_d;
-
-	// Take a fair amount as we will be dropping more out later
-	// Umm... these additions are a bit strange but they are needed.
-	v3s16 p_blocks_min(
-			p_nodes_min.X / MAP_BLOCKSIZE - 3,
-			p_nodes_min.Y / MAP_BLOCKSIZE - 3,
-			p_nodes_min.Z / MAP_BLOCKSIZE - 3);
-	v3s16 p_blocks_max(
-			p_nodes_max.X / MAP_BLOCKSIZE + 1,
-			p_nodes_max.Y / MAP_BLOCKSIZE + 1,
-			p_nodes_max.Z / MAP_BLOCKSIZE + 1);
-	
+
 	u32 vertex_count = 0;
 	u32 meshbuffer_count = 0;
 	
@@ -235,12 +585,6 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 	u32 mesh_animate_count = 0;
 	u32 mesh_animate_count_far = 0;
 	
-	// Number of blocks in rendering range
-	u32 blocks_in_range = 0;
-	// Number of blocks occlusion culled
-	u32 blocks_occlusion_culled = 0;
-	// Number of blocks in rendering range but don't have a mesh
-	u32 blocks_in_range_without_mesh = 0;
 	// Blocks that had mesh that would have been drawn according to
 	// rendering range (if max blocks limit didn't kick in)
 	u32 blocks_would_have_drawn = 0;
@@ -248,57 +592,59 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 	u32 blocks_drawn = 0;
 	// Blocks which had a corresponding meshbuffer for this pass
 	u32 blocks_had_pass_meshbuf = 0;
-	// Blocks from which stuff was actually drawn
-	u32 blocks_without_stuff = 0;
 
 	/*
-		Collect a set of blocks for drawing
+		This is called two times per frame; the blocks to draw are
+		selected on the non-transparent pass
 	*/
-	
-	core::map<v3s16, MapBlock*> drawset;
-
+	if(pass == scene::ESNRP_SOLID)
 	{
-	ScopeProfiler sp(g_profiler, prefix+"collecting blocks for drawing", SPT_AVG);
+		ScopeProfiler sp(g_profiler, prefix+"collecting blocks for drawing", SPT_AVG);
 
-	for(core::map<v2s16, MapSector*>::Iterator
-			si = m_sectors.getIterator();
-			si.atEnd() == false; si++)
-	{
-		MapSector *sector = si.getNode()->getValue();
-		v2s16 sp = sector->getPos();
-		
-		if(m_control.range_all == false)
-		{
-			if(sp.X < p_blocks_min.X
-			|| sp.X > p_blocks_max.X
-			|| sp.Y < p_blocks_min.Z
-			|| sp.Y > p_blocks_max.Z)
-				continue;
+		m_last_drawn_sectors.clear();
+
+		// No occlusion culling when the player is flying and camera is
+		// inside ground
+		bool occlusion_culling_enabled = true;
+		LocalPlayer *lplayer = m_client->getEnv().getLocalPlayer();
+		if(lplayer->is_flying){
+			MapNode n = getNodeNoEx(cam_pos_nodes);
+			if(n.getContent() == CONTENT_IGNORE ||
+					nodemgr->get(n).solidness == 2)
+				occlusion_culling_enabled = false;
 		}
 
-		core::list< MapBlock * > sectorblocks;
-		sector->getBlocks(sectorblocks);
-		
 		/*
-			Loop through blocks in sector
+			Update the draw list if the camera has moved to another
+			block, the range has changed or blocks have changed. It
+			contains the blocks up to two blocks further than the range,
+			so that it stays valid while the camera moves in its block.
 		*/
+		v3s16 camera_block = getNodeBlockPos(cam_pos_nodes);
+		s16 range_blocks = (s16)ceil(m_control.wanted_range / MAP_BLOCKSIZE) + 2;
+		if(!m_drawlist_valid
+				|| camera_block != m_drawlist_camera_block
+				|| range_blocks != m_drawlist_range
+				|| occlusion_culling_enabled != m_drawlist_occlusion_culling)
+		{
+			ScopeProfiler sp(g_profiler, "CM: updating draw list", SPT_AVG);
+			updateDrawList(driver, camera_block, range_blocks,
+					occlusion_culling_enabled);
+		}
 
-		u32 sector_blocks_drawn = 0;
-		
-		core::list< MapBlock * >::Iterator i;
-		for(i=sectorblocks.begin(); i!=sectorblocks.end(); i++)
+		float range = 100000 * BS;
+		if(m_control.range_all == false)
+			range = m_control.wanted_range * BS;
+
+		for(u32 i=0; i<m_drawlist.size(); i++)
 		{
-			MapBlock *block = *i;
+			MapBlock *block = m_drawlist[i];
+			m_drawlist_visible[i] = 0;
 
 			/*
 				Compare block position to camera position, skip
 				if not seen on display
 			*/
-			
-			float range = 100000 * BS;
-			if(m_control.range_all == false)
-				range = m_control.wanted_range * BS;
-
 			float d = 0.0;
 			if(isBlockInSight(block->getPos(), camera_position,
 					camera_direction, camera_fov,
@@ -307,75 +653,6 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 				continue;
 			}
 
-			// This is ugly (spherical distance limit?)
-			/*if(m_control.range_all == false &&
-					d - 0.5*BS*MAP_BLOCKSIZE > range)
-				continue;*/
-
-			blocks_in_range++;
-			
-			/*
-				Ignore if mesh doesn't exist
-			*/
-			{
-				//JMutexAutoLock lock(block->mesh_mutex);
-
-				if(block->mesh == NULL){
-					blocks_in_range_without_mesh++;
-					continue;
-				}
-			}
-
-			/*
-				Occlusion culling
-			*/
-
-			// No occlusion culling when the player is flying and camera is
-			// inside ground
-			bool occlusion_culling_enabled = true;
-			LocalPlayer *lplayer = m_client->getEnv().getLocalPlayer();
-			if(lplayer->is_flying){
-				MapNode n = getNodeNoEx(cam_pos_nodes);
-				if(n.getContent() == CONTENT_IGNORE ||
-						nodemgr->get(n).solidness == 2)
-					occlusion_culling_enabled = false;
-			}
-
-			v3s16 cpn = block->getPos() * MAP_BLOCKSIZE;
-			cpn += v3s16(MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2);
-			float step = BS*1;
-			float stepfac = 1.1;
-			float startoff = BS*1;
-			float endoff = -BS*MAP_BLOCKSIZE*1.42*1.42;
-			v3s16 spn = cam_pos_nodes + v3s16(0,0,0);
-			s16 bs2 = MAP_BLOCKSIZE/2 + 1;
-			u32 needed_count = 1;
-			if(
-				occlusion_culling_enabled &&
-				isOccluded(this, spn, cpn + v3s16(0,0,0),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,-bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,-bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,-bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,-bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr)
-			)
-			{
-				blocks_occlusion_culled++;
-				continue;
-			}
-			
 			// This block is in range. Reset usage timer.
 			block->resetUsageTimer();
 
@@ -388,11 +665,9 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 
 			// Mesh animation
 			{
-				//JMutexAutoLock lock(block->mesh_mutex);
 				MapBlockMesh *mapBlockMesh = block->mesh;
 				// Pretty random but this should work somewhat nicely
 				bool faraway = d >= BS*50;
-				//bool faraway = d >= m_control.wanted_range * BS;
 				if(mapBlockMesh->isAnimationForced() ||
 						!faraway ||
 						mesh_animate_count_far < (m_control.range_all ? 200 : 50))
@@ -413,30 +688,39 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 				}
 			}
 
-			// Add to set
-			drawset[block->getPos()] = block;
-			
-			sector_blocks_drawn++;
+			m_drawlist_visible[i] = 1;
+			v3s16 bp = block->getPos();
+			m_last_drawn_sectors[v2s16(bp.X, bp.Z)] = true;
 			blocks_drawn++;
+		}
 
-		} // foreach sectorblocks
+		m_control.blocks_drawn = blocks_drawn;
+		m_control.blocks_would_have_drawn = blocks_would_have_drawn;
 
-		if(sector_blocks_drawn != 0)
-			m_last_drawn_sectors[sp] = true;
+		if(m_region_meshes_enabled)
+		{
+			selectRegions(driver);
+		}
+		else
+		{
+			m_regions_drawn.clear();
+			m_drawlist_merged.assign(m_drawlist.size(), 0);
+		}
 	}
-	} // ScopeProfiler
 	
 	/*
-		Draw the selected MapBlocks
+		Draw the mesh buffers of the selected MapBlocks
 	*/
 
 	{
 	ScopeProfiler sp(g_profiler, prefix+"drawing blocks", SPT_AVG);
 
+	const std::vector<DrawListBuffer> &buffers = is_transparent_pass ?
+			m_drawlist_transparent : m_drawlist_solid;
+	std::vector<u8> block_had_meshbuf(m_drawlist.size(), 0);
+
 	int timecheck_counter = 0;
-	for(core::map<v3s16, MapBlock*>::Iterator
-			i = drawset.getIterator();
-			i.atEnd() == false; i++)
+	for(u32 i=0; i<buffers.size(); i++)
 	{
 		{
 			timecheck_counter++;
@@ -453,78 +737,83 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 				}
 			}
 		}
-		
-		MapBlock *block = i.getNode()->getValue();
 
+		const DrawListBuffer &b = buffers[i];
+		if(!m_drawlist_visible[b.block_index])
+			continue;
+		// Drawn with the region mesh below
+		if(!is_transparent_pass && m_drawlist_merged[b.block_index])
+			continue;
+
+		scene::IMeshBuffer *buf = b.buf;
+		if(buf->getVertexCount() == 0)
+			errorstream<<"Block ["<<analyze_block(m_drawlist[b.block_index])
+					<<"] contains an empty meshbuf"<<std::endl;
 		/*
-			Draw the faces of the block
+			This *shouldn't* hurt too much because Irrlicht
+			doesn't change opengl textures if the old
+			material has the same texture.
 		*/
+		driver->setMaterial(buf->getMaterial());
+		driver->drawMeshBuffer(buf);
+		vertex_count += buf->getVertexCount();
+		meshbuffer_count++;
+		if(!block_had_meshbuf[b.block_index])
 		{
-			//JMutexAutoLock lock(block->mesh_mutex);
-
-			MapBlockMesh *mapBlockMesh = block->mesh;
-			assert(mapBlockMesh);
-
-			scene::SMesh *mesh = mapBlockMesh->getMesh();
-			assert(mesh);
+			block_had_meshbuf[b.block_index] = 1;
+			blocks_had_pass_meshbuf++;
+		}
+	}
 
-			u32 c = mesh->getMeshBufferCount();
-			bool stuff_actually_drawn = false;
-			for(u32 i=0; i<c; i++)
+	if(!is_transparent_pass)
+	{
+		for(u32 i=0; i<m_regions_drawn.size(); i++)
+		{
+			scene::SMesh *mesh = m_regions_drawn[i]->mesh;
+			for(u32 j=0; j<mesh->getMeshBufferCount(); j++)
 			{
-				scene::IMeshBuffer *buf = mesh->getMeshBuffer(i);
-				const video::SMaterial& material = buf->getMaterial();
-				video::IMaterialRenderer* rnd =
-						driver->getMaterialRenderer(material.MaterialType);
-				bool transparent = (rnd && rnd->isTransparent());
-				// Render transparent on transparent pass and likewise.
-				if(transparent == is_transparent_pass)
-				{
-					if(buf->getVertexCount() == 0)
-						errorstream<<"Block ["<<analyze_block(block)
-								<<"] contains an empty meshbuf"<<std::endl;
-					/*
-						This *shouldn't* hurt too much because Irrlicht
-						doesn't change opengl textures if the old
-						material has the same texture.
-					*/
-					driver->setMaterial(buf->getMaterial());
-					driver->drawMeshBuffer(buf);
-					vertex_count += buf->getVertexCount();
-					meshbuffer_count++;
-					stuff_actually_drawn = true;
-				}
+				scene::IMeshBuffer *buf = mesh->getMeshBuffer(j);
+				driver->setMaterial(buf->getMaterial());
+				driver->drawMeshBuffer(buf);
+				vertex_count += buf->getVertexCount();
+				meshbuffer_count++;
 			}
-			if(stuff_actually_drawn)
+		}
+		for(u32 i=0; i<m_drawlist.size(); i++)
+		{
+			if(m_drawlist_merged[i] && !block_had_meshbuf[i])
+			{
+				block_had_meshbuf[i] = 1;
 				blocks_had_pass_meshbuf++;
-			else
-				blocks_without_stuff++;
+			}
 		}
 	}
 	} // ScopeProfiler
 	
 	// Log only on solid pass because values are the same
 	if(pass == scene::ESNRP_SOLID){
-		g_profiler->avg("CM: blocks in range", blocks_in_range);
-		g_profiler->avg("CM: blocks occlusion culled", blocks_occlusion_culled);
-		if(blocks_in_range != 0)
+		g_profiler->avg("CM: blocks in range", m_drawlist_blocks_in_range);
+		g_profiler->avg("CM: blocks occlusion culled",
+				m_drawlist_blocks_occlusion_culled);
+		if(m_drawlist_blocks_in_range != 0)
 			g_profiler->avg("CM: blocks in range without mesh (frac)",
-					(float)blocks_in_range_without_mesh/blocks_in_range);
+					(float)m_drawlist_blocks_without_mesh
+					/ m_drawlist_blocks_in_range);
 		g_profiler->avg("CM: blocks drawn", blocks_drawn);
 		g_profiler->avg("CM: animated meshes", mesh_animate_count);
 		g_profiler->avg("CM: animated meshes (far)", mesh_animate_count_far);
+		g_profiler->avg("CM: draw list blocks", m_drawlist.size());
+		g_profiler->avg("CM: regions drawn", m_regions_drawn.size());
 	}
 	
 	g_profiler->avg(prefix+"vertices drawn", vertex_count);
 	if(blocks_had_pass_meshbuf != 0)
 		g_profiler->avg(prefix+"meshbuffers per block",
 				(float)meshbuffer_count / (float)blocks_had_pass_meshbuf);
-	if(blocks_drawn != 0)
+	if(m_control.blocks_drawn != 0)
 		g_profiler->avg(prefix+"empty blocks (frac)",
-				(float)blocks_without_stuff / blocks_drawn);
-
-	m_control.blocks_drawn = blocks_drawn;
-	m_control.blocks_would_have_drawn = blocks_would_have_drawn;
+				(float)(m_control.blocks_drawn - blocks_had_pass_meshbuf)
+				/ m_control.blocks_drawn);
 
 	/*infostream<<"renderMap(): is_transparent_pass="<<is_transparent_pass
 			<<", rendered "<<vertex_count<<" vertices."<<std::endl;*/
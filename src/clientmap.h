@@ -22,6 +22,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "common_irrlicht.h"
 #include "map.h"
+#include <vector>
+#include <set>
+#include <map>
 
 struct MapDrawControl
 {
@@ -51,6 +54,39 @@ struct MapDrawControl
 class Client;
 class ITextureSource;
 
+// A mesh buffer in the draw list of ClientMap
+struct DrawListBuffer
+{
+	// Index of the block in the draw list
+	u32 block_index;
+	scene::IMeshBuffer *buf;
+};
+
+// Size of the regions of ClientMap in blocks
+#define CLIENTMAP_REGION_SIZE 4
+
+/*
+	The solid mesh buffers of the blocks of a region, merged by material
+*/
+struct ClientMapRegion
+{
+	ClientMapRegion():
+		dirty(true),
+		mesh(NULL)
+	{}
+	~ClientMapRegion()
+	{
+		if(mesh)
+			mesh->drop();
+	}
+
+	// Set until mesh has been built
+	bool dirty;
+	// Blocks whose buffers are in mesh
+	std::set<v3s16> members;
+	scene::SMesh *mesh;
+};
+
 /*
 	ClientMap
 	
@@ -129,8 +165,79 @@ public:
 	{
 		return (m_last_drawn_sectors.find(p) != NULL);
 	}
+
+	// Called when the face connectivity of a block has changed
+	void faceConnectivityChanged()
+	{
+		m_visible_blocks_valid = false;
+	}
+
+	// Called when the mesh of a block has been replaced or the block
+	// has been removed
+	void blockMeshChanged(v3s16 p);
+
+	/*
+		Compresses the nodes of the blocks that have no mesh or are
+		farther than the view range from center_block, and updates
+		the memory statistics below. The nodes are decompressed when
+		they are needed for meshing or collisions.
+	*/
+	void compressBlocks(v3s16 center_block);
+
+	// Statistics of the last compressBlocks()
+	u32 getBlockCount()
+	{
+		return m_block_count;
+	}
+	u32 getCompressedBlockCount()
+	{
+		return m_compressed_block_count;
+	}
+	// Memory used by the nodes of all blocks, in bytes
+	u32 getNodeDataSize()
+	{
+		return m_node_data_size;
+	}
 	
 private:
+	/*
+		Occlusion culling
+
+		Blocks are visible if they can be reached from the block of the
+		camera by going through the faces of blocks that are connected
+		according to MapBlock::face_connectivity, without ever turning
+		back towards the camera. Blocks that don't exist are thought to
+		connect all their faces.
+	*/
+	void updateVisibleBlocks(v3s16 camera_block, s16 radius);
+	// Blocks outside the radius of the last update are never occluded
+	bool isBlockOccluded(v3s16 p);
+
+	/*
+		Draw list
+
+		The blocks with a mesh in range that aren't occlusion culled,
+		and their mesh buffers. Rebuilt only when the camera enters
+		another block, the range changes or blocks or meshes change;
+		each frame only checks which of them are in sight.
+	*/
+	void updateDrawList(video::IVideoDriver* driver, v3s16 camera_block,
+			s16 range_blocks, bool occlusion_culling);
+
+	/*
+		Region meshes
+
+		A region is drawn with its merged mesh in place of the solid
+		buffers of its blocks if all of its member blocks are drawn.
+		Animated meshes aren't merged, as animate() doesn't reach the
+		merged copies.
+	*/
+	void updateRegion(video::IVideoDriver* driver, v3s16 region_pos,
+			ClientMapRegion *region);
+	// Selects the regions to draw among the visible blocks of the
+	// draw list and rebuilds a few dirty ones
+	void selectRegions(video::IVideoDriver* driver);
+
 	Client *m_client;
 	
 	core::aabbox3d<f32> m_box;
@@ -143,6 +250,42 @@ private:
 	JMutex m_camera_mutex;
 	
 	core::map<v2s16, bool> m_last_drawn_sectors;
+
+	// Result of updateVisibleBlocks()
+	bool m_visible_blocks_valid;
+	v3s16 m_visible_blocks_camera;
+	s16 m_visible_blocks_radius;
+	std::vector<u8> m_visible_blocks;
+
+	// Result of updateDrawList()
+	bool m_drawlist_valid;
+	v3s16 m_drawlist_camera_block;
+	s16 m_drawlist_range;
+	bool m_drawlist_occlusion_culling;
+	// Nearest first
+	std::vector<MapBlock*> m_drawlist;
+	// Sorted by material
+	std::vector<DrawListBuffer> m_drawlist_solid;
+	// Sorted from far to near
+	std::vector<DrawListBuffer> m_drawlist_transparent;
+	// Whether each block of m_drawlist is drawn on the current frame
+	std::vector<u8> m_drawlist_visible;
+	u32 m_drawlist_blocks_in_range;
+	u32 m_drawlist_blocks_without_mesh;
+	u32 m_drawlist_blocks_occlusion_culled;
+
+	bool m_region_meshes_enabled;
+	std::map<v3s16, ClientMapRegion*> m_regions;
+	// Regions drawn on the current frame
+	std::vector<ClientMapRegion*> m_regions_drawn;
+	// Whether the solid buffers of each block of m_drawlist are drawn
+	// by its region on the current frame
+	std::vector<u8> m_drawlist_merged;
+
+	// Result of compressBlocks()
+	u32 m_block_count;
+	u32 m_compressed_block_count;
+	u32 m_node_data_size;
 };
 
 #endif
@@ -54,9 +54,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	PROTOCOL_VERSION 10:
 		TOCLIENT_PRIVILEGES
 		Version raised to force 'fly' and 'fast' privileges into effect.
+	PROTOCOL_VERSION 11:
+		Add TOCLIENT_PLAYER_STATE; replaces TOCLIENT_HP, TOCLIENT_HUNGER
+		and TOCLIENT_OXYGEN, which are still sent to older clients
 */
 
-#define PROTOCOL_VERSION 10
+#define PROTOCOL_VERSION 11
+// Oldest client protocol the server still fully supports; accepted even
+// with strict_protocol_version_checking
+#define SERVER_PROTOCOL_VERSION_MIN 10
 
 #define PROTOCOL_ID 0x4f457403
 
@@ -321,6 +327,22 @@ enum ToClientCommand
 	/*
 		u16 command
 	*/
+
+	TOCLIENT_PLAYER_STATE = 0x45,
+	/*
+		u16 command
+		u8 changed fields (PlayerStateField flags)
+		u8 hp, if PLAYER_STATE_HP is set
+		u8 hunger, if PLAYER_STATE_HUNGER is set
+		u8 oxygen, if PLAYER_STATE_OXYGEN is set
+	*/
+};
+
+enum PlayerStateField
+{
+	PLAYER_STATE_HP = 0x01,
+	PLAYER_STATE_HUNGER = 0x02,
+	PLAYER_STATE_OXYGEN = 0x04
 };
 
 enum ToServerCommand
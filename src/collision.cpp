@@ -22,179 +22,283 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "nodedef.h"
 #include "gamedef.h"
+#include <vector>
 
-collisionMoveResult collisionMoveSimple(Map *map, IGameDef *gamedef,
-		f32 pos_max_d, const core::aabbox3d<f32> &box_0,
-		f32 dtime, v3f &pos_f, v3f &speed_f)
+/*
+	Reads the walkable bits of the map block by block, without the
+	caches of the map, so that objects can be moved in many threads at
+	once as long as the map is not modified
+*/
+class CollisionNodeReader
 {
-	collisionMoveResult result;
+public:
+	CollisionNodeReader(Map *map):
+		m_map(map),
+		m_bits(NULL),
+		m_blockpos(0,0,0),
+		m_block_valid(false)
+	{}
 
-	// If there is no speed, there are no collisions
-	if(speed_f.getLength() == 0)
-		return result;
+	// Nodes of blocks that are not loaded are walkable, which blocks
+	// the object from walking over map borders
+	bool isWalkable(v3s16 p)
+	{
+		v3s16 blockpos = getNodeBlockPos(p);
+		if(!m_block_valid || blockpos != m_blockpos)
+		{
+			m_bits = m_map->getWalkableBits(blockpos);
+			m_blockpos = blockpos;
+			m_block_valid = true;
+		}
+		if(m_bits == NULL)
+			return true;
+		v3s16 relpos = p - blockpos*MAP_BLOCKSIZE;
+		u32 i = relpos.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+				+ relpos.Y*MAP_BLOCKSIZE + relpos.X;
+		return (m_bits[i>>3] >> (i&7)) & 1;
+	}
 
-	v3f oldpos_f = pos_f;
-	v3s16 oldpos_i = floatToInt(oldpos_f, BS);
+private:
+	Map *m_map;
+	const u8 *m_bits;
+	v3s16 m_blockpos;
+	bool m_block_valid;
+};
 
-	/*
-		Calculate new position
-	*/
-	pos_f += speed_f * dtime;
+// Distance within which boxes are touching rather than apart
+#define COLLISION_EPSILON (0.001*BS)
 
-	/*
-		Collision detection
-	*/
-	
-	// position in nodes
-	v3s16 pos_i = floatToInt(pos_f, BS);
-	
-	/*
-		Collision uncertainty radius
-		Make it a bit larger than the maximum distance of movement
-	*/
+static inline f32 getAxis(const v3f &v, u32 axis)
+{
+	return axis == 0 ? v.X : (axis == 1 ? v.Y : v.Z);
+}
+
+static inline void setAxis(v3f &v, u32 axis, f32 value)
+{
+	if(axis == 0)
+		v.X = value;
+	else if(axis == 1)
+		v.Y = value;
+	else
+		v.Z = value;
+}
+
+/*
+	Object touches ground if object's minimum Y is near node's maximum Y
+	and object's X-Z-area overlaps with the node's X-Z-area by more than
+	d.
+
+	Use 0.15*BS so that it is easier to get on a node.
+*/
+static bool touchesGround(const core::aabbox3d<f32> &box,
+		const core::aabbox3d<f32> &nodebox, f32 d)
+{
+	return fabs(nodebox.MaxEdge.Y-box.MinEdge.Y) < 0.15*BS
+			&& nodebox.MaxEdge.X-d > box.MinEdge.X
+			&& nodebox.MinEdge.X+d < box.MaxEdge.X
+			&& nodebox.MaxEdge.Z-d > box.MinEdge.Z
+			&& nodebox.MinEdge.Z+d < box.MaxEdge.Z;
+}
+
+// Adds the boxes of the walkable nodes touching or inside region
+static void getWalkableBoxes(CollisionNodeReader &reader,
+		const core::aabbox3d<f32> &region,
+		std::vector<core::aabbox3d<f32> > &boxes)
+{
+	const f32 e = COLLISION_EPSILON / BS;
+	s16 min_x = ceil(region.MinEdge.X / BS - 0.5 - e);
+	s16 min_y = ceil(region.MinEdge.Y / BS - 0.5 - e);
+	s16 min_z = ceil(region.MinEdge.Z / BS - 0.5 - e);
+	s16 max_x = floor(region.MaxEdge.X / BS + 0.5 + e);
+	s16 max_y = floor(region.MaxEdge.Y / BS + 0.5 + e);
+	s16 max_z = floor(region.MaxEdge.Z / BS + 0.5 + e);
+	for(s16 y = min_y; y <= max_y; y++)
+	for(s16 z = min_z; z <= max_z; z++)
+	for(s16 x = min_x; x <= max_x; x++)
+	{
+		v3s16 p(x,y,z);
+		if(reader.isWalkable(p))
+			boxes.push_back(getNodeBox(p, BS));
+	}
+}
+
+/*
+	Finds the time at which box moving at speed hits nodebox and the
+	axis along which it hits. Returns false if it never hits it, or if
+	it is already inside it, in which case it may move out freely.
+*/
+static bool sweepBox(const core::aabbox3d<f32> &box, const v3f &speed,
+		const core::aabbox3d<f32> &nodebox, f32 &time, u32 &axis)
+{
+	const f32 e = COLLISION_EPSILON;
+	// Time of entering and leaving the node box; -1 = already overlapping
+	f32 entry_time = -1;
+	f32 exit_time = 1e30;
+	for(u32 i=0; i<3; i++)
+	{
+		f32 v = getAxis(speed, i);
+		f32 objectmin = getAxis(box.MinEdge, i);
+		f32 objectmax = getAxis(box.MaxEdge, i);
+		f32 nodemin = getAxis(nodebox.MinEdge, i);
+		f32 nodemax = getAxis(nodebox.MaxEdge, i);
+		f32 entry = -1;
+		f32 exit = 1e30;
+		if(v > 0)
+		{
+			if(objectmax <= nodemin + e)
+				entry = MYMAX(nodemin - objectmax, 0) / v;
+			else if(objectmin >= nodemax - e)
+				return false;
+			exit = (nodemax - objectmin) / v;
+		}
+		else if(v < 0)
+		{
+			if(objectmin >= nodemax - e)
+				entry = MYMAX(objectmin - nodemax, 0) / -v;
+			else if(objectmax <= nodemin + e)
+				return false;
+			exit = (objectmax - nodemin) / -v;
+		}
+		else if(objectmax <= nodemin + e || objectmin >= nodemax - e)
+		{
+			return false;
+		}
+		if(entry > entry_time)
+		{
+			entry_time = entry;
+			axis = i;
+		}
+		exit_time = MYMIN(exit_time, exit);
+	}
+	if(entry_time < 0 || entry_time > exit_time)
+		return false;
+	time = entry_time;
+	return true;
+}
+
+/*
+	Moves the object for dtime, stopping it at the first node box it
+	hits. Its speed towards the node box is removed and it slides on for
+	the rest of dtime, until it can't move anymore.
+*/
+static collisionMoveResult collisionMoveSwept(Map *map, f32 pos_max_d,
+		const core::aabbox3d<f32> &box_0, f32 dtime, v3f &pos_f,
+		v3f &speed_f)
+{
+	collisionMoveResult result;
+	CollisionNodeReader reader(map);
+
+	// Margin of the X-Z-area overlap for touching ground
 	f32 d = pos_max_d * 1.1;
-	// A fairly large value in here makes moving smoother
-	//f32 d = 0.15*BS;
 
-	// This should always apply, otherwise there are glitches
-	assert(d > pos_max_d);
-	
-	/*
-		Calculate collision box
-	*/
 	core::aabbox3d<f32> box = box_0;
-	box.MaxEdge += pos_f;
 	box.MinEdge += pos_f;
-	core::aabbox3d<f32> oldbox = box_0;
-	oldbox.MaxEdge += oldpos_f;
-	oldbox.MinEdge += oldpos_f;
+	box.MaxEdge += pos_f;
 
 	/*
-		If the object lies on a walkable node, this is set to true.
-	*/
-	result.touching_ground = false;
-	
-	/*
-		Go through every node around the object
+		Objects resting on the ground only fall against the nodes right
+		under them; these are all that need to be looked at.
 	*/
-	s16 min_x = (box_0.MinEdge.X / BS) - 2;
-	s16 min_y = (box_0.MinEdge.Y / BS) - 2;
-	s16 min_z = (box_0.MinEdge.Z / BS) - 2;
-	s16 max_x = (box_0.MaxEdge.X / BS) + 1;
-	s16 max_y = (box_0.MaxEdge.Y / BS) + 1;
-	s16 max_z = (box_0.MaxEdge.Z / BS) + 1;
-	for(s16 y = oldpos_i.Y + min_y; y <= oldpos_i.Y + max_y; y++)
-	for(s16 z = oldpos_i.Z + min_z; z <= oldpos_i.Z + max_z; z++)
-	for(s16 x = oldpos_i.X + min_x; x <= oldpos_i.X + max_x; x++)
+	if(speed_f.X == 0 && speed_f.Z == 0 && speed_f.Y < 0)
 	{
-		try{
-			// Object collides into walkable nodes
-			MapNode n = map->getNode(v3s16(x,y,z));
-			if(gamedef->getNodeDefManager()->get(n).walkable == false)
-				continue;
-		}
-		catch(InvalidPositionException &e)
+		const f32 e = COLLISION_EPSILON;
+		// The node whose top is nearest to the bottom of the object
+		s16 y = floor(box.MinEdge.Y / BS);
+		if(fabs(((f32)y + 0.5) * BS - box.MinEdge.Y) <= e)
 		{
-			// Doing nothing here will block the object from
-			// walking over map borders
-		}
-
-		core::aabbox3d<f32> nodebox = getNodeBox(v3s16(x,y,z), BS);
-		
-		/*
-			See if the object is touching ground.
-
-			Object touches ground if object's minimum Y is near node's
-			maximum Y and object's X-Z-area overlaps with the node's
-			X-Z-area.
-
-			Use 0.15*BS so that it is easier to get on a node.
-		*/
-		if(
-				//fabs(nodebox.MaxEdge.Y-box.MinEdge.Y) < d
-				fabs(nodebox.MaxEdge.Y-box.MinEdge.Y) < 0.15*BS
-				&& nodebox.MaxEdge.X-d > box.MinEdge.X
-				&& nodebox.MinEdge.X+d < box.MaxEdge.X
-				&& nodebox.MaxEdge.Z-d > box.MinEdge.Z
-				&& nodebox.MinEdge.Z+d < box.MaxEdge.Z
-		){
-			result.touching_ground = true;
-		}
-		
-		// If object doesn't intersect with node, ignore node.
-		if(box.intersectsWithBox(nodebox) == false)
-			continue;
-		
-		/*
-			Go through every axis
-		*/
-		v3f dirs[3] = {
-			v3f(0,0,1), // back-front
-			v3f(0,1,0), // top-bottom
-			v3f(1,0,0), // right-left
-		};
-		for(u16 i=0; i<3; i++)
-		{
-			/*
-				Calculate values along the axis
-			*/
-			f32 nodemax = nodebox.MaxEdge.dotProduct(dirs[i]);
-			f32 nodemin = nodebox.MinEdge.dotProduct(dirs[i]);
-			f32 objectmax = box.MaxEdge.dotProduct(dirs[i]);
-			f32 objectmin = box.MinEdge.dotProduct(dirs[i]);
-			f32 objectmax_old = oldbox.MaxEdge.dotProduct(dirs[i]);
-			f32 objectmin_old = oldbox.MinEdge.dotProduct(dirs[i]);
-			
-			/*
-				Check collision for the axis.
-				Collision happens when object is going through a surface.
-			*/
-			bool negative_axis_collides =
-				(nodemax > objectmin && nodemax <= objectmin_old + d
-					&& speed_f.dotProduct(dirs[i]) < 0);
-			bool positive_axis_collides =
-				(nodemin < objectmax && nodemin >= objectmax_old - d
-					&& speed_f.dotProduct(dirs[i]) > 0);
-			bool main_axis_collides =
-					negative_axis_collides || positive_axis_collides;
-			
-			/*
-				Check overlap of object and node in other axes
-			*/
-			bool other_axes_overlap = true;
-			for(u16 j=0; j<3; j++)
+			bool standing = false;
+			s16 min_x = floor((box.MinEdge.X + e) / BS - 0.5) + 1;
+			s16 min_z = floor((box.MinEdge.Z + e) / BS - 0.5) + 1;
+			s16 max_x = ceil((box.MaxEdge.X - e) / BS + 0.5) - 1;
+			s16 max_z = ceil((box.MaxEdge.Z - e) / BS + 0.5) - 1;
+			for(s16 z = min_z; z <= max_z; z++)
+			for(s16 x = min_x; x <= max_x; x++)
 			{
-				if(j == i)
+				v3s16 p(x,y,z);
+				if(reader.isWalkable(p) == false)
 					continue;
-				f32 nodemax = nodebox.MaxEdge.dotProduct(dirs[j]);
-				f32 nodemin = nodebox.MinEdge.dotProduct(dirs[j]);
-				f32 objectmax = box.MaxEdge.dotProduct(dirs[j]);
-				f32 objectmin = box.MinEdge.dotProduct(dirs[j]);
-				if(!(nodemax - d > objectmin && nodemin + d < objectmax))
-				{
-					other_axes_overlap = false;
-					break;
-				}
+				standing = true;
+				if(touchesGround(box, getNodeBox(p, BS), d))
+					result.touching_ground = true;
 			}
-			
-			/*
-				If this is a collision, revert the pos_f in the main
-				direction.
-			*/
-			if(other_axes_overlap && main_axis_collides)
+			if(standing)
 			{
-				speed_f -= speed_f.dotProduct(dirs[i]) * dirs[i];
-				pos_f -= pos_f.dotProduct(dirs[i]) * dirs[i];
-				pos_f += oldpos_f.dotProduct(dirs[i]) * dirs[i];
+				speed_f.Y = 0;
 				result.collides = true;
+				return result;
 			}
-		
 		}
-	} // xyz
-	
+	}
+
+	/*
+		Get the node boxes along the way, and the ones a bit under the
+		object for telling whether it touches ground
+	*/
+	core::aabbox3d<f32> region = box;
+	region.addInternalBox(core::aabbox3d<f32>(
+			box.MinEdge + speed_f * dtime, box.MaxEdge + speed_f * dtime));
+	region.MinEdge.Y -= 0.15*BS;
+	std::vector<core::aabbox3d<f32> > boxes;
+	getWalkableBoxes(reader, region, boxes);
+
+	/*
+		Every collision removes the speed along one axis, so there are
+		at most three of them
+	*/
+	f32 dtime_left = dtime;
+	for(u32 loopcount=0; loopcount<3 && dtime_left > 0; loopcount++)
+	{
+		f32 nearest_time = dtime_left;
+		u32 nearest_axis = 0;
+		bool hit = false;
+		for(u32 i=0; i<boxes.size(); i++)
+		{
+			f32 time;
+			u32 axis;
+			if(sweepBox(box, speed_f, boxes[i], time, axis)
+					&& time < nearest_time)
+			{
+				nearest_time = time;
+				nearest_axis = axis;
+				hit = true;
+			}
+		}
+
+		v3f move = speed_f * nearest_time;
+		pos_f += move;
+		box.MinEdge += move;
+		box.MaxEdge += move;
+		dtime_left -= nearest_time;
+
+		if(hit == false)
+			break;
+		setAxis(speed_f, nearest_axis, 0);
+		result.collides = true;
+	}
+
+	for(u32 i=0; i<boxes.size(); i++)
+	{
+		if(touchesGround(box, boxes[i], d))
+		{
+			result.touching_ground = true;
+			break;
+		}
+	}
+
 	return result;
 }
 
+collisionMoveResult collisionMoveSimple(Map *map, IGameDef *gamedef,
+		f32 pos_max_d, const core::aabbox3d<f32> &box_0,
+		f32 dtime, v3f &pos_f, v3f &speed_f)
+{
+	// If there is no speed, there are no collisions
+	if(speed_f.getLength() == 0)
+		return collisionMoveResult();
+
+	return collisionMoveSwept(map, pos_max_d, box_0, dtime, pos_f, speed_f);
+}
+
 collisionMoveResult collisionMovePrecise(Map *map, IGameDef *gamedef,
 		f32 pos_max_d, const core::aabbox3d<f32> &box_0,
 		f32 dtime, v3f &pos_f, v3f &speed_f)
@@ -205,54 +309,32 @@ collisionMoveResult collisionMovePrecise(Map *map, IGameDef *gamedef,
 	if(speed_f.getLength() == 0)
 		return final_result;
 
-	// Maximum time increment (for collision detection etc)
-	// time = distance / speed
-	f32 dtime_max_increment = pos_max_d / speed_f.getLength();
-	
-	// Maximum time increment is 10ms or lower
-	if(dtime_max_increment > 0.01)
-		dtime_max_increment = 0.01;
-	
 	// Don't allow overly huge dtime
 	if(dtime > 2.0)
 		dtime = 2.0;
-	
-	f32 dtime_downcount = dtime;
-
-	u32 loopcount = 0;
-	do
-	{
-		loopcount++;
 
-		f32 dtime_part;
-		if(dtime_downcount > dtime_max_increment)
-		{
-			dtime_part = dtime_max_increment;
-			dtime_downcount -= dtime_part;
-		}
-		else
-		{
-			dtime_part = dtime_downcount;
-			/*
-				Setting this to 0 (no -=dtime_part) disables an infinite loop
-				when dtime_part is so small that dtime_downcount -= dtime_part
-				does nothing
-			*/
-			dtime_downcount = 0;
-		}
+	/*
+		Move at most 4 nodes at a time, so that the node boxes along the
+		way of a fast object don't have to be looked at all at once
+	*/
+	u32 parts = ceil(speed_f.getLength() * dtime / (4*BS));
+	if(parts < 1)
+		parts = 1;
+	f32 dtime_part = dtime / parts;
 
-		collisionMoveResult result = collisionMoveSimple(map, gamedef,
-				pos_max_d, box_0, dtime_part, pos_f, speed_f);
+	for(u32 i=0; i<parts; i++)
+	{
+		collisionMoveResult result = collisionMoveSwept(map, pos_max_d,
+				box_0, dtime_part, pos_f, speed_f);
 
 		if(result.touching_ground)
 			final_result.touching_ground = true;
 		if(result.collides)
 			final_result.collides = true;
+
+		if(speed_f.getLength() == 0)
+			break;
 	}
-	while(dtime_downcount > 0.001);
-		
 
 	return final_result;
 }
-
-
@@ -36,12 +36,18 @@ struct collisionMoveResult
 	{}
 };
 
-// Moves using a single iteration; speed should not exceed pos_max_d/dtime
+/*
+	Both of these move the object until it hits a walkable node, and
+	then slide it along the node for the rest of dtime. pos_max_d is
+	the largest distance the object moves in a step.
+*/
+
+// Moves in a single sweep; for short moves
 collisionMoveResult collisionMoveSimple(Map *map, IGameDef *gamedef,
 		f32 pos_max_d, const core::aabbox3d<f32> &box_0,
 		f32 dtime, v3f &pos_f, v3f &speed_f);
 
-// Moves using as many iterations as needed
+// Moves in sweeps of at most 4 nodes
 collisionMoveResult collisionMovePrecise(Map *map, IGameDef *gamedef,
 		f32 pos_max_d, const core::aabbox3d<f32> &box_0,
 		f32 dtime, v3f &pos_f, v3f &speed_f);
@@ -11,6 +11,7 @@
 #define BUILD_TYPE "unknown"
 #define USE_GETTEXT 0
 #define USE_SOUND 0
+#define USE_LUAJIT 0
 #define BUILD_INFO "non-cmake"
 
 #ifdef USE_CMAKE_CONFIG_H
@@ -25,6 +26,8 @@
 	#define USE_GETTEXT CMAKE_USE_GETTEXT
 	#undef USE_SOUND
 	#define USE_SOUND CMAKE_USE_SOUND
+	#undef USE_LUAJIT
+	#define USE_LUAJIT CMAKE_USE_LUAJIT
 	#undef BUILD_INFO
 	#define BUILD_INFO CMAKE_BUILD_INFO
 #endif
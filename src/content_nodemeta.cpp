@@ -125,6 +125,7 @@ public:
 	virtual Inventory* getInventory() {return m_inventory;}
 	virtual void inventoryModified();
 	virtual bool step(float dtime);
+	virtual float stepInterval() {return 2.0;}
 	virtual bool nodeRemovalDisabled();
 	virtual std::string getInventoryDrawSpecString();
 	
@@ -446,10 +447,10 @@ bool FurnaceNodeMetadata::step(float dtime)
 	assert(dst_list);
 
 	// Update at a fixed frequency
-	const float interval = 2.0;
+	const float interval = stepInterval();
 	m_step_accumulator += dtime;
 	bool changed = false;
-	while(m_step_accumulator > interval)
+	while(m_step_accumulator >= interval)
 	{
 		m_step_accumulator -= interval;
 		dtime = interval;
@@ -746,10 +747,6 @@ public:
 	{
 		m_inventory_modified = true;
 	}
-	bool step(float dtime)
-	{
-		return false;
-	}
 	bool nodeRemovalDisabled()
 	{
 		return m_removal_disabled;
@@ -177,17 +177,19 @@ public:
 		m_itemstring(itemstring),
 		m_itemstring_changed(false),
 		m_speed_f(0,0,0),
-		m_last_sent_position(0,0,0)
+		m_last_sent_position(0,0,0),
+		m_moved(false),
+		m_moved_position(0,0,0),
+		m_resting(false)
 	{
 		ServerActiveObject::registerType(getType(), create);
 	}
 
-	void step(float dtime, bool send_recommended)
+	void stepPhysics(float dtime)
 	{
-		ScopeProfiler sp2(g_profiler, "step avg", SPT_AVG);
-
 		assert(m_env);
 
+		m_moved = false;
 		const float interval = 0.2;
 		if(m_move_interval.step(dtime, interval)==false)
 			return;
@@ -207,13 +209,27 @@ public:
 		IGameDef *gamedef = m_env->getGameDef();
 		moveresult = collisionMoveSimple(&m_env->getMap(), gamedef,
 				pos_max_d, box, dtime, pos_f, m_speed_f);
-		
+		m_moved = true;
+		m_moved_position = pos_f;
+		m_resting = (pos_f == pos_f_old && m_speed_f == v3f(0,0,0));
+	}
+
+	void step(float dtime, bool send_recommended)
+	{
+		static ProfilerHandle step_handle = g_profiler->getHandle("step avg");
+		ScopeProfiler sp2(g_profiler, step_handle, SPT_AVG);
+
+		// Keep the position even if it isn't sent yet, so that an item
+		// that has come to rest stays where it is
+		if(m_moved)
+			setBasePosition(m_moved_position);
+
 		if(send_recommended == false)
 			return;
 
+		v3f pos_f = m_base_position;
 		if(pos_f.getDistanceFrom(m_last_sent_position) > 0.05*BS)
 		{
-			setBasePosition(pos_f);
 			m_last_sent_position = pos_f;
 
 			std::ostringstream os(std::ios::binary);
@@ -240,6 +256,11 @@ public:
 		}
 	}
 
+	bool isResting()
+	{
+		return m_resting && !m_itemstring_changed;
+	}
+
 	std::string getClientInitializationData()
 	{
 		std::ostringstream os(std::ios::binary);
@@ -310,6 +331,7 @@ public:
 			{
 				m_itemstring = leftover.getItemString();
 				m_itemstring_changed = true;
+				wake();
 			}
 		}
 		
@@ -323,6 +345,11 @@ private:
 	v3f m_speed_f;
 	v3f m_last_sent_position;
 	IntervalLimiter m_move_interval;
+	// Set by stepPhysics() if the item was moved in this step
+	bool m_moved;
+	v3f m_moved_position;
+	// Set by stepPhysics() if the item is lying on something
+	bool m_resting;
 };
 
 // Prototype (registers item for deserialization)
@@ -358,7 +385,9 @@ LuaEntitySAO::LuaEntitySAO(ServerEnvironment *env, v3f pos,
 	m_last_sent_velocity(0,0,0),
 	m_last_sent_position_timer(0),
 	m_last_sent_move_precision(0),
-	m_armor_groups_sent(false)
+	m_armor_groups_sent(false),
+	m_has_on_step(true),
+	m_resting(false)
 {
 	// Only register type if no environment supplied
 	if(env == NULL){
@@ -433,19 +462,8 @@ ServerActiveObject* LuaEntitySAO::create(ServerEnvironment *env, v3f pos,
 	return sao;
 }
 
-void LuaEntitySAO::step(float dtime, bool send_recommended)
+void LuaEntitySAO::stepPhysics(float dtime)
 {
-	if(!m_properties_sent)
-	{
-		m_properties_sent = true;
-		std::string str = getPropertyPacket();
-		// create message and add to list
-		ActiveObjectMessage aom(getId(), true, str);
-		m_messages_out.push_back(aom);
-	}
-
-	m_last_sent_position_timer += dtime;
-	
 	if(m_prop.physical){
 		core::aabbox3d<f32> box = m_prop.collisionbox;
 		box.MinEdge *= BS;
@@ -457,20 +475,41 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 		IGameDef *gamedef = m_env->getGameDef();
 		moveresult = collisionMovePrecise(&m_env->getMap(), gamedef,
 				pos_max_d, box, dtime, p_pos, p_velocity);
+		// Blocked from all sides it is going to, so it stays put
+		// until the nodes around it change
+		m_resting = (p_pos == getBasePosition() &&
+				p_velocity == v3f(0,0,0));
 		// Apply results
 		setBasePosition(p_pos);
 		m_velocity = p_velocity;
 
 		m_velocity += dtime * m_acceleration;
 	} else {
+		m_resting = (m_velocity == v3f(0,0,0) &&
+				m_acceleration == v3f(0,0,0));
 		m_base_position += dtime * m_velocity + 0.5 * dtime
 				* dtime * m_acceleration;
 		m_velocity += dtime * m_acceleration;
 	}
+}
 
+void LuaEntitySAO::step(float dtime, bool send_recommended)
+{
+	if(!m_properties_sent)
+	{
+		m_properties_sent = true;
+		std::string str = getPropertyPacket();
+		// create message and add to list
+		ActiveObjectMessage aom(getId(), true, str);
+		m_messages_out.push_back(aom);
+	}
+
+	m_last_sent_position_timer += dtime;
+
+	m_has_on_step = false;
 	if(m_registered){
 		lua_State *L = m_env->getLua();
-		scriptapi_luaentity_step(L, m_id, dtime);
+		m_has_on_step = scriptapi_luaentity_step(L, m_id, dtime);
 	}
 
 	if(send_recommended == false)
@@ -501,6 +540,22 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 	}
 }
 
+bool LuaEntitySAO::isResting()
+{
+	/*
+		An on_step could do anything at any time, so only entities
+		without one can sleep, and only once the clients have been told
+		where they are
+	*/
+	if(m_has_on_step || !m_resting)
+		return false;
+	if(!m_properties_sent || !m_armor_groups_sent)
+		return false;
+	return (m_base_position.getDistanceFrom(m_last_sent_position)
+				<= 0.01*BS &&
+			m_velocity.getDistanceFrom(m_last_sent_velocity) <= 0.1*BS);
+}
+
 std::string LuaEntitySAO::getClientInitializationData()
 {
 	std::ostringstream os(std::ios::binary);
@@ -547,6 +602,8 @@ int LuaEntitySAO::punch(v3f dir,
 		ServerActiveObject *puncher,
 		float time_from_last_punch)
 {
+	wake();
+
 	if(!m_registered){
 		// Delete unknown LuaEntities when punched
 		m_removed = true;
@@ -602,12 +659,14 @@ void LuaEntitySAO::rightClick(ServerActiveObject *clicker)
 
 void LuaEntitySAO::setPos(v3f pos)
 {
+	wake();
 	m_base_position = pos;
 	sendPosition(false, true);
 }
 
 void LuaEntitySAO::moveTo(v3f pos, bool continuous)
 {
+	wake();
 	m_base_position = pos;
 	if(!continuous)
 		sendPosition(true, true);
@@ -631,6 +690,7 @@ std::string LuaEntitySAO::getDescription()
 
 void LuaEntitySAO::setHP(s16 hp)
 {
+	wake();
 	if(hp < 0) hp = 0;
 	m_hp = hp;
 }
@@ -642,6 +702,7 @@ s16 LuaEntitySAO::getHP() const
 
 void LuaEntitySAO::setArmorGroups(const ItemGroupList &armor_groups)
 {
+	wake();
 	m_armor_groups = armor_groups;
 	m_armor_groups_sent = false;
 }
@@ -653,11 +714,13 @@ ObjectProperties* LuaEntitySAO::accessObjectProperties()
 
 void LuaEntitySAO::notifyObjectPropertiesModified()
 {
+	wake();
 	m_properties_sent = false;
 }
 
 void LuaEntitySAO::setVelocity(v3f velocity)
 {
+	wake();
 	m_velocity = velocity;
 }
 
@@ -668,6 +731,7 @@ v3f LuaEntitySAO::getVelocity()
 
 void LuaEntitySAO::setAcceleration(v3f acceleration)
 {
+	wake();
 	m_acceleration = acceleration;
 }
 
@@ -678,6 +742,7 @@ v3f LuaEntitySAO::getAcceleration()
 
 void LuaEntitySAO::setPitch(float pitch)
 {
+	wake();
 	m_pitch = pitch;
 }
 
@@ -688,6 +753,7 @@ float LuaEntitySAO::getPitch()
 
 void LuaEntitySAO::setYaw(float yaw)
 {
+	wake();
 	m_yaw = yaw;
 }
 
@@ -698,6 +764,7 @@ float LuaEntitySAO::getYaw()
 
 void LuaEntitySAO::setTextureMod(const std::string &mod)
 {
+	wake();
 	std::string str = gob_cmd_set_texture_mod(mod);
 	// create message and add to list
 	ActiveObjectMessage aom(getId(), true, str);
@@ -707,6 +774,7 @@ void LuaEntitySAO::setTextureMod(const std::string &mod)
 void LuaEntitySAO::setSprite(v2s16 p, int num_frames, float framelength,
 		bool select_horiz_by_yawpitch)
 {
+	wake();
 	std::string str = gob_cmd_set_sprite(
 		p,
 		num_frames,
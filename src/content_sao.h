@@ -46,7 +46,9 @@ public:
 	virtual void addedToEnvironment();
 	static ServerActiveObject* create(ServerEnvironment *env, v3f pos,
 			const std::string &data);
+	void stepPhysics(float dtime);
 	void step(float dtime, bool send_recommended);
+	bool isResting();
 	std::string getClientInitializationData();
 	std::string getStaticData();
 	int punch(v3f dir,
@@ -99,6 +101,11 @@ private:
 	float m_last_sent_position_timer;
 	float m_last_sent_move_precision;
 	bool m_armor_groups_sent;
+
+	// Whether the last step ran an on_step of the entity
+	bool m_has_on_step;
+	// Set by stepPhysics() if the entity didn't and won't move
+	bool m_resting;
 };
 
 /*
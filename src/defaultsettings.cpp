@@ -89,6 +89,12 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("new_style_water", "false");
 	settings->setDefault("new_style_leaves", "true");
 	settings->setDefault("smooth_lighting", "true");
+	settings->setDefault("greedy_meshing", "false");
+	settings->setDefault("lod_distance", "80");
+	settings->setDefault("enable_shaders", "true");
+	settings->setDefault("enable_region_meshes", "true");
+	settings->setDefault("mesh_generation_threads", "0");
+	settings->setDefault("mesh_cache_size", "32");
 	settings->setDefault("enable_texture_atlas", "true");
 	settings->setDefault("enable_3d_player", "true");
 	settings->setDefault("texture_path", "");
@@ -125,9 +131,12 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("enable_pvp", "true");
 
 	settings->setDefault("profiler_print_interval", "0");
+	settings->setDefault("profiler_slow_step_threshold", "100");
 	settings->setDefault("enable_mapgen_debug_info", "false");
 	settings->setDefault("active_object_send_range_blocks", "3");
 	settings->setDefault("active_block_range", "2");
+	settings->setDefault("object_physics_threads", "0");
+	settings->setDefault("active_block_step_budget", "20");
 	//settings->setDefault("max_simultaneous_block_sends_per_client", "1");
 	// This causes frametime jitter on client side, or does it?
 	settings->setDefault("max_simultaneous_block_sends_per_client", "4");
@@ -140,5 +149,15 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("server_map_save_interval", "5.3");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("dedicated_server_step", "0.05");
+
+	settings->setDefault("lua_callback_time_budget", "2000");
+	settings->setDefault("lua_step_time_budget", "0");
+	settings->setDefault("lua_budget_hook_instructions", "10000");
+	settings->setDefault("lua_budget_offense_limit", "3");
+	settings->setDefault("lua_budget_defer_time", "30");
+	settings->setDefault("lua_gc_pause", "200");
+	settings->setDefault("lua_gc_stepmul", "200");
+	settings->setDefault("lua_gc_step_time", "2");
+	settings->setDefault("lua_gc_step_size", "64");
 }
 
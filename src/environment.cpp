@@ -26,6 +26,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <list>
 #include <map>
+#include <algorithm>
+#include <iterator>
 #include "environment.h"
 #include "filesys.h"
 #include "porting.h"
@@ -43,6 +45,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodemetadata.h"
 #include "main.h" // For g_settings, g_profiler
 #include "gamedef.h"
+#include "serialization.h" // For compressZlib
+#include <cstdio> // For rename
 #ifndef SERVER
 #include "clientmap.h"
 #include "localplayer.h"
@@ -250,19 +254,97 @@ ABMWithState::ABMWithState(ActiveBlockModifier *abm_):
 	timer = myrand_range(minval, maxval);
 }
 
+float ABMWithState::step(float dtime_s)
+{
+	float trigger_interval = abm->getTriggerInterval();
+	if(trigger_interval < 0.001)
+		trigger_interval = 0.001;
+	timer += dtime_s;
+	if(timer < trigger_interval)
+		return 0;
+	// A long active block round can cover several intervals
+	float elapsed = floor(timer / trigger_interval) * trigger_interval;
+	timer -= elapsed;
+	return elapsed;
+}
+
 /*
 	ActiveBlockList
 */
 
-void fillRadiusBlock(v3s16 p0, s16 r, core::map<v3s16, bool> &list)
+static VoxelArea blockRadiusArea(v3s16 p0, s16 r)
+{
+	return VoxelArea(p0 - v3s16(r,r,r), p0 + v3s16(r,r,r));
+}
+
+/*
+	Splits the part of b that is not in a into boxes
+*/
+static void areaDifference(const VoxelArea &b, const VoxelArea &a,
+		std::vector<VoxelArea> &parts)
+{
+	if(a.MaxEdge.X < b.MinEdge.X || a.MinEdge.X > b.MaxEdge.X ||
+			a.MaxEdge.Y < b.MinEdge.Y || a.MinEdge.Y > b.MaxEdge.Y ||
+			a.MaxEdge.Z < b.MinEdge.Z || a.MinEdge.Z > b.MaxEdge.Z)
+	{
+		parts.push_back(b);
+		return;
+	}
+	// Cut off the slabs of b that stick out of a, one axis at a time
+	s16 v3s16::*axes[3] = {&v3s16::X, &v3s16::Y, &v3s16::Z};
+	VoxelArea rest = b;
+	for(u32 i=0; i<3; i++)
+	{
+		s16 v3s16::*c = axes[i];
+		if(rest.MinEdge.*c < a.MinEdge.*c)
+		{
+			VoxelArea part = rest;
+			part.MaxEdge.*c = a.MinEdge.*c - 1;
+			parts.push_back(part);
+			rest.MinEdge.*c = a.MinEdge.*c;
+		}
+		if(rest.MaxEdge.*c > a.MaxEdge.*c)
+		{
+			VoxelArea part = rest;
+			part.MinEdge.*c = a.MaxEdge.*c + 1;
+			parts.push_back(part);
+			rest.MaxEdge.*c = a.MaxEdge.*c;
+		}
+	}
+}
+
+void ActiveBlockList::changeRefs(const VoxelArea &area, s16 delta,
+		core::map<v3s16, bool> &blocks_removed,
+		core::map<v3s16, bool> &blocks_added)
 {
 	v3s16 p;
-	for(p.X=p0.X-r; p.X<=p0.X+r; p.X++)
-	for(p.Y=p0.Y-r; p.Y<=p0.Y+r; p.Y++)
-	for(p.Z=p0.Z-r; p.Z<=p0.Z+r; p.Z++)
+	for(p.X=area.MinEdge.X; p.X<=area.MaxEdge.X; p.X++)
+	for(p.Y=area.MinEdge.Y; p.Y<=area.MaxEdge.Y; p.Y++)
+	for(p.Z=area.MinEdge.Z; p.Z<=area.MaxEdge.Z; p.Z++)
 	{
-		// Set in list
-		list[p] = true;
+		if(delta > 0)
+		{
+			u16 &refs = m_refs[p];
+			if(refs == 0)
+			{
+				m_list.insert(p, true);
+				blocks_added.insert(p, true);
+			}
+			refs += delta;
+			continue;
+		}
+		std::map<v3s16, u16>::iterator n = m_refs.find(p);
+		assert(n != m_refs.end() && n->second >= -delta);
+		n->second += delta;
+		if(n->second != 0)
+			continue;
+		m_refs.erase(n);
+		if(m_list.find(p) != NULL)
+		{
+			m_list.remove(p);
+			blocks_removed.insert(p, true);
+		}
+		m_retry.erase(p);
 	}
 }
 
@@ -271,338 +353,260 @@ void ActiveBlockList::update(core::list<v3s16> &active_positions,
 		core::map<v3s16, bool> &blocks_removed,
 		core::map<v3s16, bool> &blocks_added)
 {
-	/*
-		Create the new list
-	*/
-	core::map<v3s16, bool> newlist;
+	std::multiset<v3s16> positions;
 	for(core::list<v3s16>::Iterator i = active_positions.begin();
 			i != active_positions.end(); i++)
+		positions.insert(*i);
+
+	/*
+		Find the positions that are gone and the ones that came. Those
+		that stayed in place don't change anything.
+	*/
+	std::vector<v3s16> gone;
+	std::vector<v3s16> came;
+	if(radius == m_radius)
+	{
+		std::set_difference(m_positions.begin(), m_positions.end(),
+				positions.begin(), positions.end(),
+				std::back_inserter(gone));
+		std::set_difference(positions.begin(), positions.end(),
+				m_positions.begin(), m_positions.end(),
+				std::back_inserter(came));
+	}
+	else
 	{
-		fillRadiusBlock(*i, radius, newlist);
+		gone.assign(m_positions.begin(), m_positions.end());
+		came.assign(positions.begin(), positions.end());
 	}
 
 	/*
-		Find out which blocks on the old list are not on the new list
+		Pair each new position with the nearest gone one, so that only
+		the difference of their areas has to be counted. Which ones get
+		paired doesn't change the result, only how many blocks are
+		touched.
 	*/
-	// Go through old list
-	for(core::map<v3s16, bool>::Iterator i = m_list.getIterator();
-			i.atEnd()==false; i++)
+	std::vector<bool> gone_paired(gone.size(), false);
+	std::vector<s32> came_pair(came.size(), -1);
+	if(radius == m_radius)
 	{
-		v3s16 p = i.getNode()->getKey();
-		// If not on new list, it's been removed
-		if(newlist.find(p) == NULL)
-			blocks_removed.insert(p, true);
+		for(u32 i=0; i<came.size(); i++)
+		{
+			s32 best = -1;
+			s16 best_d = 2*radius + 1;
+			for(u32 j=0; j<gone.size(); j++)
+			{
+				if(gone_paired[j])
+					continue;
+				v3s16 d = came[i] - gone[j];
+				s16 dist = MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z));
+				if(dist < best_d)
+				{
+					best = j;
+					best_d = dist;
+				}
+			}
+			if(best == -1)
+				continue;
+			came_pair[i] = best;
+			gone_paired[best] = true;
+		}
 	}
 
 	/*
-		Find out which blocks on the new list are not on the old list
+		Add before removing, so that a block that stays in range doesn't
+		drop to zero on the way
 	*/
-	// Go through new list
-	for(core::map<v3s16, bool>::Iterator i = newlist.getIterator();
-			i.atEnd()==false; i++)
+	for(u32 i=0; i<came.size(); i++)
 	{
-		v3s16 p = i.getNode()->getKey();
-		// If not on old list, it's been added
-		if(m_list.find(p) == NULL)
-			blocks_added.insert(p, true);
+		VoxelArea area = blockRadiusArea(came[i], radius);
+		std::vector<VoxelArea> parts;
+		if(came_pair[i] == -1)
+			parts.push_back(area);
+		else
+			areaDifference(area, blockRadiusArea(
+					gone[came_pair[i]], m_radius), parts);
+		for(u32 j=0; j<parts.size(); j++)
+			changeRefs(parts[j], 1, blocks_removed, blocks_added);
+	}
+	for(u32 i=0; i<came.size(); i++)
+	{
+		if(came_pair[i] == -1)
+			continue;
+		std::vector<VoxelArea> parts;
+		areaDifference(blockRadiusArea(gone[came_pair[i]], m_radius),
+				blockRadiusArea(came[i], radius), parts);
+		for(u32 j=0; j<parts.size(); j++)
+			changeRefs(parts[j], -1, blocks_removed, blocks_added);
+	}
+	for(u32 i=0; i<gone.size(); i++)
+	{
+		if(gone_paired[i])
+			continue;
+		changeRefs(blockRadiusArea(gone[i], m_radius), -1,
+				blocks_removed, blocks_added);
 	}
 
 	/*
-		Update m_list
+		Try again the blocks that are still in range but couldn't be
+		activated the last time
 	*/
-	m_list.clear();
-	for(core::map<v3s16, bool>::Iterator i = newlist.getIterator();
-			i.atEnd()==false; i++)
+	for(std::set<v3s16>::iterator i = m_retry.begin();
+			i != m_retry.end(); i++)
 	{
-		v3s16 p = i.getNode()->getKey();
-		m_list.insert(p, true);
+		m_list.insert(*i, true);
+		blocks_added.insert(*i, true);
 	}
+	m_retry.clear();
+
+	m_positions = positions;
+	m_radius = radius;
 }
 
 /*
-	ServerEnvironment
+	ObjectPhysicsManager
 */
 
-ServerEnvironment::ServerEnvironment(ServerMap *map, lua_State *L,
-		IGameDef *gamedef, IBackgroundBlockEmerger *emerger):
-	m_map(map),
-	m_lua(L),
-	m_gamedef(gamedef),
-	m_emerger(emerger),
-	m_random_spawn_timer(3),
-	m_send_recommended_timer(0),
-	m_game_time(0),
-	m_game_time_fraction_counter(0)
-{
-}
+// Number of objects handed out to a thread at once
+#define OBJECT_PHYSICS_CHUNK 64
 
-ServerEnvironment::~ServerEnvironment()
+void * ObjectPhysicsThread::Thread()
 {
-	// Clear active block list.
-	// This makes the next one delete all active objects.
-	m_active_blocks.clear();
-
-	// Convert all objects to static and delete the active objects
-	deactivateFarObjects(true);
+	ThreadStarted();
 
-	// Drop/delete map
-	m_map->drop();
+	log_register_thread("ObjectPhysicsThread");
 
-	// Delete ActiveBlockModifiers
-	for(core::list<ABMWithState>::Iterator
-			i = m_abms.begin(); i != m_abms.end(); i++){
-		delete i->abm;
-	}
-}
-
-void ServerEnvironment::serializePlayers(const std::string &savedir)
-{
-	std::string players_path = savedir + "/players";
-	fs::CreateDir(players_path);
+	DSTACK(__FUNCTION_NAME);
 
-	core::map<Player*, bool> saved_players;
+	BEGIN_DEBUG_EXCEPTION_HANDLER
 
-	std::vector<fs::DirListNode> player_files = fs::GetDirListing(players_path);
-	for(u32 i=0; i<player_files.size(); i++)
+	while(getRun())
 	{
-		if(player_files[i].dir)
-			continue;
-		
-		// Full path to this file
-		std::string path = players_path + "/" + player_files[i].name;
+		m_manager->waitForStep();
+		// stop() wakes up the threads to let them quit
+		if(!getRun())
+			break;
+		m_manager->work();
+		m_manager->stepDone();
+	}
 
-		//infostream<<"Checking player file "<<path<<std::endl;
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
 
-		// Load player to see what is its name
-		RemotePlayer testplayer(m_gamedef);
-		{
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
-			{
-				infostream<<"Failed to read "<<path<<std::endl;
-				continue;
-			}
-			testplayer.deSerialize(is);
-		}
+	return NULL;
+}
 
-		//infostream<<"Loaded test player with name "<<testplayer.getName()<<std::endl;
-		
-		// Search for the player
-		std::string playername = testplayer.getName();
-		Player *player = getPlayer(playername.c_str());
-		if(player == NULL)
-		{
-			infostream<<"Didn't find matching player, ignoring file "<<path<<std::endl;
-			continue;
-		}
+ObjectPhysicsManager::ObjectPhysicsManager():
+	m_thread_count(1),
+	m_objects(NULL),
+	m_dtime(0),
+	m_next(0)
+{
+	m_step_begin.Init();
+	m_step_done.Init();
+	m_mutex.Init();
+}
 
-		//infostream<<"Found matching player, overwriting."<<std::endl;
+ObjectPhysicsManager::~ObjectPhysicsManager()
+{
+	stop();
+}
 
-		// OK, found. Save player there.
-		{
-			// Open file and serialize
-			std::ofstream os(path.c_str(), std::ios_base::binary);
-			if(os.good() == false)
-			{
-				infostream<<"Failed to overwrite "<<path<<std::endl;
-				continue;
-			}
-			player->serialize(os);
-			saved_players.insert(player, true);
-		}
-	}
+void ObjectPhysicsManager::setThreadCount(u32 count)
+{
+	if(count == 0)
+		count = MYMIN(porting::getNumberOfProcessors(), 4);
+	if(count == 0)
+		count = 1;
+	if(count == m_thread_count)
+		return;
+	stop();
+	m_thread_count = count;
+}
 
-	for(core::list<Player*>::Iterator i = m_players.begin();
-			i != m_players.end(); i++)
+void ObjectPhysicsManager::step(float dtime,
+		std::vector<ServerActiveObject*> &objects)
+{
+	// Don't bother the other threads with only a few objects
+	if(m_thread_count <= 1 || objects.size() <= OBJECT_PHYSICS_CHUNK)
 	{
-		Player *player = *i;
-		if(saved_players.find(player) != NULL)
-		{
-			/*infostream<<"Player "<<player->getName()
-					<<" was already saved."<<std::endl;*/
-			continue;
-		}
-		std::string playername = player->getName();
-		// Don't save unnamed player
-		if(playername == "")
-		{
-			//infostream<<"Not saving unnamed player."<<std::endl;
-			continue;
-		}
-		/*
-			Find a sane filename
-		*/
-		if(string_allowed(playername, PLAYERNAME_ALLOWED_CHARS) == false)
-			playername = "player";
-		std::string path = players_path + "/" + playername;
-		bool found = false;
-		for(u32 i=0; i<1000; i++)
-		{
-			if(fs::PathExists(path) == false)
-			{
-				found = true;
-				break;
-			}
-			path = players_path + "/" + playername + itos(i);
-		}
-		if(found == false)
-		{
-			infostream<<"Didn't find free file for player"<<std::endl;
-			continue;
-		}
+		for(u32 i=0; i<objects.size(); i++)
+			objects[i]->stepPhysics(dtime);
+		return;
+	}
 
+	if(m_threads.empty())
+	{
+		infostream<<"Starting "<<(m_thread_count - 1)
+				<<" object physics threads"<<std::endl;
+		for(u32 i=1; i<m_thread_count; i++)
 		{
-			/*infostream<<"Saving player "<<player->getName()<<" to "
-					<<path<<std::endl;*/
-			// Open file and serialize
-			std::ofstream os(path.c_str(), std::ios_base::binary);
-			if(os.good() == false)
-			{
-				infostream<<"Failed to overwrite "<<path<<std::endl;
-				continue;
-			}
-			player->serialize(os);
-			saved_players.insert(player, true);
+			ObjectPhysicsThread *thread = new ObjectPhysicsThread(this);
+			thread->Start();
+			m_threads.push_back(thread);
 		}
 	}
 
-	//infostream<<"Saved "<<saved_players.size()<<" players."<<std::endl;
-}
-
-void ServerEnvironment::deSerializePlayers(const std::string &savedir)
-{
-	std::string players_path = savedir + "/players";
-
-	core::map<Player*, bool> saved_players;
-
-	std::vector<fs::DirListNode> player_files = fs::GetDirListing(players_path);
-	for(u32 i=0; i<player_files.size(); i++)
 	{
-		if(player_files[i].dir)
-			continue;
-		
-		// Full path to this file
-		std::string path = players_path + "/" + player_files[i].name;
+		JMutexAutoLock lock(m_mutex);
+		m_objects = &objects;
+		m_dtime = dtime;
+		m_next = 0;
+	}
 
-		//infostream<<"Checking player file "<<path<<std::endl;
+	for(u32 i=0; i<m_threads.size(); i++)
+		m_step_begin.Post();
 
-		// Load player to see what is its name
-		RemotePlayer testplayer(m_gamedef);
-		{
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
-			{
-				infostream<<"Failed to read "<<path<<std::endl;
-				continue;
-			}
-			testplayer.deSerialize(is);
-		}
+	work();
 
-		if(!string_allowed(testplayer.getName(), PLAYERNAME_ALLOWED_CHARS))
-		{
-			infostream<<"Not loading player with invalid name: "
-					<<testplayer.getName()<<std::endl;
-		}
+	// A thread is done when it has found no chunks left, so after all
+	// of them are, every chunk has been moved
+	for(u32 i=0; i<m_threads.size(); i++)
+		m_step_done.Wait();
 
-		/*infostream<<"Loaded test player with name "<<testplayer.getName()
-				<<std::endl;*/
-		
-		// Search for the player
-		std::string playername = testplayer.getName();
-		Player *player = getPlayer(playername.c_str());
-		bool newplayer = false;
-		if(player == NULL)
-		{
-			//infostream<<"Is a new player"<<std::endl;
-			player = new RemotePlayer(m_gamedef);
-			newplayer = true;
-		}
+	JMutexAutoLock lock(m_mutex);
+	m_objects = NULL;
+}
 
-		// Load player
+void ObjectPhysicsManager::work()
+{
+	for(;;)
+	{
+		std::vector<ServerActiveObject*> *objects;
+		float dtime;
+		u32 start, end;
 		{
-			verbosestream<<"Reading player "<<testplayer.getName()<<" from "
-					<<path<<std::endl;
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
-			{
-				infostream<<"Failed to read "<<path<<std::endl;
-				continue;
-			}
-			player->deSerialize(is);
+			JMutexAutoLock lock(m_mutex);
+			if(m_objects == NULL || m_next >= m_objects->size())
+				return;
+			objects = m_objects;
+			dtime = m_dtime;
+			start = m_next;
+			end = MYMIN(start + OBJECT_PHYSICS_CHUNK, objects->size());
+			m_next = end;
 		}
 
-		if(newplayer)
-		{
-			addPlayer(player);
-		}
+		for(u32 i=start; i<end; i++)
+			(*objects)[i]->stepPhysics(dtime);
 	}
 }
 
-void ServerEnvironment::saveMeta(const std::string &savedir)
+void ObjectPhysicsManager::stop()
 {
-	std::string path = savedir + "/env_meta.txt";
-
-	// Open file and serialize
-	std::ofstream os(path.c_str(), std::ios_base::binary);
-	if(os.good() == false)
+	for(u32 i=0; i<m_threads.size(); i++)
+		m_threads[i]->setRun(false);
+	for(u32 i=0; i<m_threads.size(); i++)
+		m_step_begin.Post();
+	for(u32 i=0; i<m_threads.size(); i++)
 	{
-		infostream<<"ServerEnvironment::saveMeta(): Failed to open "
-				<<path<<std::endl;
-		throw SerializationError("Couldn't save env meta");
+		while(m_threads[i]->IsRunning())
+			sleep_ms(10);
+		delete m_threads[i];
 	}
-
-	Settings args;
-	args.setU64("game_time", m_game_time);
-	args.setU64("time_of_day", getTimeOfDay());
-	args.writeLines(os);
-	os<<"EnvArgsEnd\n";
+	m_threads.clear();
 }
 
-void ServerEnvironment::loadMeta(const std::string &savedir)
-{
-	std::string path = savedir + "/env_meta.txt";
-
-	// Open file and deserialize
-	std::ifstream is(path.c_str(), std::ios_base::binary);
-	if(is.good() == false)
-	{
-		infostream<<"ServerEnvironment::loadMeta(): Failed to open "
-				<<path<<std::endl;
-		throw SerializationError("Couldn't load env meta");
-	}
-
-	Settings args;
-	
-	for(;;)
-	{
-		if(is.eof())
-			throw SerializationError
-					("ServerEnvironment::loadMeta(): EnvArgsEnd not found");
-		std::string line;
-		std::getline(is, line);
-		std::string trimmedline = trim(line);
-		if(trimmedline == "EnvArgsEnd")
-			break;
-		args.parseConfigLine(line);
-	}
-	
-	try{
-		m_game_time = args.getU64("game_time");
-	}catch(SettingNotFoundException &e){
-		// Getting this is crucial, otherwise timestamps are useless
-		throw SerializationError("Couldn't load env meta game_time");
-	}
-
-	try{
-		m_time_of_day = args.getU64("time_of_day");
-	}catch(SettingNotFoundException &e){
-		// This is not as important
-		m_time_of_day = 9000;
-	}
-}
+/*
+	ABMHandler
+*/
 
 struct ActiveABM
 {
@@ -633,11 +637,9 @@ public:
 				trigger_interval = 0.001;
 			float actual_interval = dtime_s;
 			if(use_timers){
-				i->timer += dtime_s;
-				if(i->timer < trigger_interval)
+				actual_interval = i->step(dtime_s);
+				if(actual_interval == 0)
 					continue;
-				i->timer -= trigger_interval;
-				actual_interval = trigger_interval;
 			}
 			float intervals = actual_interval / trigger_interval;
 			if(intervals == 0)
@@ -687,76 +689,359 @@ public:
 		if(m_aabms.empty())
 			return;
 
-		ServerMap *map = &m_env->getServerMap();
+		ServerMap *map = &m_env->getServerMap();
+
+		v3s16 p0;
+		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
+		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+		{
+			MapNode n = block->getNodeNoEx(p0);
+			content_t c = n.getContent();
+			v3s16 p = p0 + block->getPosRelative();
+
+			std::map<content_t, std::list<ActiveABM> >::iterator j;
+			j = m_aabms.find(c);
+			if(j == m_aabms.end())
+				continue;
+
+			for(std::list<ActiveABM>::iterator
+					i = j->second.begin(); i != j->second.end(); i++)
+			{
+				if(myrand() % i->chance != 0)
+					continue;
+
+				// Check neighbors
+				if(!i->required_neighbors.empty())
+				{
+					v3s16 p1;
+					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
+					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
+					for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
+					{
+						if(p1 == p)
+							continue;
+						MapNode n = map->getNodeNoEx(p1);
+						content_t c = n.getContent();
+						std::set<content_t>::const_iterator k;
+						k = i->required_neighbors.find(c);
+						if(k != i->required_neighbors.end()){
+							goto neighbor_found;
+						}
+					}
+					// No required neighbor found
+					continue;
+				}
+neighbor_found:
+
+				// Find out how many objects the block contains
+				u32 active_object_count = block->m_static_objects.m_active.size();
+				// Find out how many objects this and all the neighbors contain
+				u32 active_object_count_wider = 0;
+				for(s16 x=-1; x<=1; x++)
+				for(s16 y=-1; y<=1; y++)
+				for(s16 z=-1; z<=1; z++)
+				{
+					MapBlock *block2 = map->getBlockNoCreateNoEx(
+							block->getPos() + v3s16(x,y,z));
+					if(block2==NULL)
+						continue;
+					active_object_count_wider +=
+							block2->m_static_objects.m_active.size()
+							+ block2->m_static_objects.m_stored.size();
+				}
+
+				// Call all the trigger variations
+				i->abm->trigger(m_env, p, n);
+				i->abm->trigger(m_env, p, n,
+						active_object_count, active_object_count_wider);
+			}
+		}
+	}
+};
+
+/*
+	ServerEnvironment
+*/
+
+// Time in which all the active blocks are stepped once
+#define ACTIVE_BLOCK_ROUND_INTERVAL 1.0
+// Interval of reporting the percentiles of the step times
+#define STEP_TIME_REPORT_INTERVAL 10.0
+
+ServerEnvironment::ServerEnvironment(ServerMap *map, lua_State *L,
+		IGameDef *gamedef, IBackgroundBlockEmerger *emerger):
+	m_map(map),
+	m_lua(L),
+	m_gamedef(gamedef),
+	m_emerger(emerger),
+	m_random_spawn_timer(3),
+	m_send_recommended_timer(0),
+	m_game_time(0),
+	m_game_time_fraction_counter(0),
+	m_active_block_round_next(0),
+	m_active_block_round_time(0),
+	m_abm_handler(NULL),
+	m_active_block_clock(0)
+{
+	m_object_physics.setThreadCount(
+			g_settings->getU16("object_physics_threads"));
+	m_map->addEventReceiver(this);
+}
+
+ServerEnvironment::~ServerEnvironment()
+{
+	// Clear active block list.
+	// This makes the next one delete all active objects.
+	m_active_blocks.clear();
+
+	// Convert all objects to static and delete the active objects
+	deactivateFarObjects(true);
+
+	m_map->removeEventReceiver(this);
+
+	// Drop/delete map
+	m_map->drop();
+
+	delete m_abm_handler;
+
+	// Delete ActiveBlockModifiers
+	for(core::list<ABMWithState>::Iterator
+			i = m_abms.begin(); i != m_abms.end(); i++){
+		delete i->abm;
+	}
+}
+
+void ServerEnvironment::savePlayers()
+{
+	bool saving = false;
+	u32 saved_count = 0;
+	for(core::list<Player*>::Iterator i = m_players.begin();
+			i != m_players.end(); i++)
+	{
+		Player *player = *i;
+		std::string playername = player->getName();
+		// Don't save unnamed player
+		if(playername == "")
+			continue;
+
+		std::ostringstream os(std::ios_base::binary);
+		player->serialize(os);
+		std::string data = os.str();
+
+		// Skip players that haven't changed
+		std::map<std::string, std::string>::iterator n =
+				m_saved_players.find(playername);
+		if(n != m_saved_players.end() && n->second == data)
+			continue;
+
+		if(!saving)
+		{
+			m_map->beginSave();
+			saving = true;
+		}
+		std::ostringstream compressed(std::ios_base::binary);
+		compressZlib(data, compressed);
+		// A player that failed to save is tried again the next time
+		if(!m_map->savePlayer(playername, compressed.str()))
+			continue;
+		m_saved_players[playername] = data;
+		saved_count++;
+	}
+	if(saving)
+		m_map->endSave();
+
+	g_profiler->avg("SEnv: saved players", saved_count);
+}
+
+RemotePlayer* ServerEnvironment::loadPlayer(const std::string &name)
+{
+	std::string compressed;
+	if(!m_map->loadPlayer(name, compressed))
+		return NULL;
+
+	RemotePlayer *player = new RemotePlayer(m_gamedef);
+	std::string data;
+	try{
+		std::istringstream is(compressed, std::ios_base::binary);
+		std::ostringstream os(std::ios_base::binary);
+		decompressZlib(is, os);
+		data = os.str();
+		std::istringstream is2(data, std::ios_base::binary);
+		player->deSerialize(is2);
+	}
+	catch(SerializationError &e)
+	{
+		errorstream<<"Failed to load player "<<name<<": "
+				<<e.what()<<std::endl;
+		delete player;
+		return NULL;
+	}
+	player->updateName(name.c_str());
+
+	verbosestream<<"Loaded player "<<name<<" from the database"<<std::endl;
+	addPlayer(player);
+	m_saved_players[name] = data;
+	return player;
+}
+
+void ServerEnvironment::migratePlayerFiles(const std::string &savedir)
+{
+	std::string players_path = savedir + DIR_DELIM + "players";
+	if(!fs::PathExists(players_path))
+		return;
+
+	infostream<<"Moving players from "<<players_path
+			<<" to the database"<<std::endl;
+
+	u32 count = 0;
+	u32 failed_count = 0;
+	m_map->beginSave();
+	std::vector<fs::DirListNode> player_files = fs::GetDirListing(players_path);
+	for(u32 i=0; i<player_files.size(); i++)
+	{
+		if(player_files[i].dir)
+			continue;
+		
+		// Full path to this file
+		std::string path = players_path + DIR_DELIM + player_files[i].name;
+
+		RemotePlayer player(m_gamedef);
+		{
+			// Open file and deserialize
+			std::ifstream is(path.c_str(), std::ios_base::binary);
+			if(is.good() == false)
+			{
+				infostream<<"Failed to read "<<path<<std::endl;
+				continue;
+			}
+			try{
+				player.deSerialize(is);
+			}
+			catch(SerializationError &e)
+			{
+				errorstream<<"Failed to read "<<path<<": "
+						<<e.what()<<std::endl;
+				continue;
+			}
+		}
+
+		std::string playername = player.getName();
+		if(!string_allowed(playername, PLAYERNAME_ALLOWED_CHARS))
+		{
+			infostream<<"Not moving player with invalid name: "
+					<<playername<<std::endl;
+			continue;
+		}
+
+		// Don't overwrite what has been saved since
+		std::string old_data;
+		if(m_map->loadPlayer(playername, old_data))
+		{
+			infostream<<"Player "<<playername<<" of "<<path
+					<<" is already in the database"<<std::endl;
+			continue;
+		}
+
+		std::ostringstream os(std::ios_base::binary);
+		player.serialize(os);
+		std::ostringstream compressed(std::ios_base::binary);
+		compressZlib(os.str(), compressed);
+		if(!m_map->savePlayer(playername, compressed.str()))
+		{
+			failed_count++;
+			continue;
+		}
+		count++;
+	}
+	m_map->endSave();
+
+	if(failed_count != 0)
+	{
+		errorstream<<"Failed to move "<<failed_count<<" players from "
+				<<players_path<<" to the database; they will be moved on "
+				<<"the next start"<<std::endl;
+		return;
+	}
+
+	// Keep the files, but out of the way of the next start. An earlier
+	// migration may have left its files there already.
+	std::string old_path = players_path + ".old";
+	for(u32 i=1; fs::PathExists(old_path); i++)
+		old_path = players_path + ".old." + itos(i);
+	if(rename(players_path.c_str(), old_path.c_str()) != 0)
+	{
+		errorstream<<"Failed to rename "<<players_path<<" to "
+				<<old_path<<"; it will be checked again on the next start"
+				<<std::endl;
+	}
+
+	actionstream<<"Moved "<<count<<" players from "<<players_path
+			<<" to the database"<<std::endl;
+}
+
+void ServerEnvironment::saveMeta(const std::string &savedir)
+{
+	std::string path = savedir + "/env_meta.txt";
 
-		v3s16 p0;
-		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
-		{
-			MapNode n = block->getNodeNoEx(p0);
-			content_t c = n.getContent();
-			v3s16 p = p0 + block->getPosRelative();
+	// Open file and serialize
+	std::ofstream os(path.c_str(), std::ios_base::binary);
+	if(os.good() == false)
+	{
+		infostream<<"ServerEnvironment::saveMeta(): Failed to open "
+				<<path<<std::endl;
+		throw SerializationError("Couldn't save env meta");
+	}
 
-			std::map<content_t, std::list<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
-				continue;
+	Settings args;
+	args.setU64("game_time", m_game_time);
+	args.setU64("time_of_day", getTimeOfDay());
+	args.writeLines(os);
+	os<<"EnvArgsEnd\n";
+}
 
-			for(std::list<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); i++)
-			{
-				if(myrand() % i->chance != 0)
-					continue;
+void ServerEnvironment::loadMeta(const std::string &savedir)
+{
+	std::string path = savedir + "/env_meta.txt";
 
-				// Check neighbors
-				if(!i->required_neighbors.empty())
-				{
-					v3s16 p1;
-					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
-					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
-					for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
-					{
-						if(p1 == p)
-							continue;
-						MapNode n = map->getNodeNoEx(p1);
-						content_t c = n.getContent();
-						std::set<content_t>::const_iterator k;
-						k = i->required_neighbors.find(c);
-						if(k != i->required_neighbors.end()){
-							goto neighbor_found;
-						}
-					}
-					// No required neighbor found
-					continue;
-				}
-neighbor_found:
+	// Open file and deserialize
+	std::ifstream is(path.c_str(), std::ios_base::binary);
+	if(is.good() == false)
+	{
+		infostream<<"ServerEnvironment::loadMeta(): Failed to open "
+				<<path<<std::endl;
+		throw SerializationError("Couldn't load env meta");
+	}
 
-				// Find out how many objects the block contains
-				u32 active_object_count = block->m_static_objects.m_active.size();
-				// Find out how many objects this and all the neighbors contain
-				u32 active_object_count_wider = 0;
-				for(s16 x=-1; x<=1; x++)
-				for(s16 y=-1; y<=1; y++)
-				for(s16 z=-1; z<=1; z++)
-				{
-					MapBlock *block2 = map->getBlockNoCreateNoEx(
-							block->getPos() + v3s16(x,y,z));
-					if(block2==NULL)
-						continue;
-					active_object_count_wider +=
-							block2->m_static_objects.m_active.size()
-							+ block2->m_static_objects.m_stored.size();
-				}
+	Settings args;
+	
+	for(;;)
+	{
+		if(is.eof())
+			throw SerializationError
+					("ServerEnvironment::loadMeta(): EnvArgsEnd not found");
+		std::string line;
+		std::getline(is, line);
+		std::string trimmedline = trim(line);
+		if(trimmedline == "EnvArgsEnd")
+			break;
+		args.parseConfigLine(line);
+	}
+	
+	try{
+		m_game_time = args.getU64("game_time");
+	}catch(SettingNotFoundException &e){
+		// Getting this is crucial, otherwise timestamps are useless
+		throw SerializationError("Couldn't load env meta game_time");
+	}
 
-				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
-						active_object_count, active_object_count_wider);
-			}
-		}
+	try{
+		m_time_of_day = args.getU64("time_of_day");
+	}catch(SettingNotFoundException &e){
+		// This is not as important
+		m_time_of_day = 9000;
 	}
-};
+}
 
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 {
@@ -779,9 +1064,57 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 	// Activate stored objects
 	activateObjects(block);
 
-	// Run node metadata
-	bool changed = block->m_node_metadata->step((float)dtime_s);
-	if(changed)
+	// Objects next to the block may have been resting on its absence
+	v3s16 np1 = block->getPosRelative();
+	wakeObjectsInArea(VoxelArea(np1,
+			np1 + v3s16(1,1,1)*MAP_BLOCKSIZE - v3s16(1,1,1)));
+
+	// Run node timers that expired while the block was inactive
+	stepNodeTimers(block, (float)dtime_s);
+
+	/* Handle ActiveBlockModifiers */
+	ABMHandler abmhandler(m_abms, dtime_s, this, false);
+	abmhandler.apply(block);
+}
+
+void ServerEnvironment::stepNodeTimers(MapBlock *block, float dtime)
+{
+	std::vector<std::pair<v3s16, NodeTimer> > expired;
+	block->m_node_timers.step(dtime, expired);
+	if(expired.empty())
+		return;
+
+	g_profiler->add("SEnv: node timers run (num)", expired.size());
+
+	bool metadata_changed = false;
+	v3s16 p0 = block->getPosRelative();
+	for(std::vector<std::pair<v3s16, NodeTimer> >::iterator
+			i = expired.begin(); i != expired.end(); i++)
+	{
+		v3s16 p_rel = i->first;
+		const NodeTimer &timer = i->second;
+		bool restart = false;
+
+		// Step C++ metadata like furnaces
+		NodeMetadata *meta = block->m_node_metadata->get(p_rel);
+		if(meta && meta->stepInterval() > 0 && meta->step(timer.elapsed))
+		{
+			metadata_changed = true;
+			restart = true;
+		}
+
+		// Call on_timer of the node
+		MapNode n = block->getNodeNoEx(p_rel);
+		if(scriptapi_node_on_timer(m_lua, p0 + p_rel, n, timer.elapsed))
+			restart = true;
+
+		// Restart, unless the callback set a new timer already
+		if(restart && !block->m_node_timers.get(p_rel).isStarted())
+			block->m_node_timers.set(p_rel,
+					NodeTimer(timer.timeout, 0));
+	}
+
+	if(metadata_changed)
 	{
 		MapEditEvent event;
 		event.type = MEET_BLOCK_NODE_METADATA_CHANGED;
@@ -789,12 +1122,13 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 		m_map->dispatchEvent(&event);
 
 		block->raiseModified(MOD_STATE_WRITE_NEEDED,
-				"node metadata modified in activateBlock");
+				"node metadata modified by node timer");
+	}
+	else
+	{
+		block->raiseModified(MOD_STATE_WRITE_AT_UNLOAD,
+				"node timers run");
 	}
-
-	/* Handle ActiveBlockModifiers */
-	ABMHandler abmhandler(m_abms, dtime_s, this, false);
-	abmhandler.apply(block);
 }
 
 void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
@@ -850,6 +1184,9 @@ void ServerEnvironment::clearAllObjects()
 			continue;
 		}
 
+		// Drop it from the sleeping objects
+		if(obj->m_sleeping)
+			wakeObject(obj);
 		// Tell the object about removal
 		obj->removingFromEnvironment();
 		// Deregister in scripting api
@@ -921,6 +1258,7 @@ void ServerEnvironment::step(float dtime)
 	DSTACK(__FUNCTION_NAME);
 	
 	//TimeTaker timer("ServerEnv step");
+	u32 step_start_us = porting::getTimeUs();
 
 	/* Step time of day */
 	stepTimeOfDay(dtime);
@@ -1004,6 +1342,8 @@ void ServerEnvironment::step(float dtime)
 			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
 					<<") became inactive"<<std::endl;*/
 			
+			m_active_block_step_times.erase(p);
+
 			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
 			if(block==NULL)
 				continue;
@@ -1029,99 +1369,20 @@ void ServerEnvironment::step(float dtime)
 			if(block==NULL){
 				// Block needs to be fetched first
 				m_emerger->queueBlockEmerge(p, false);
-				m_active_blocks.m_list.remove(p);
+				m_active_blocks.retryLater(p);
 				continue;
 			}
 
 			activateBlock(block);
+			// activateBlock() has run the timers up to now
+			m_active_block_step_times[p] = m_active_block_clock;
 		}
 	}
 
 	/*
-		Mess around in active blocks
+		Run node timers and ABMs in a slice of the active blocks
 	*/
-	if(m_active_blocks_nodemetadata_interval.step(dtime, 1.0))
-	{
-		ScopeProfiler sp(g_profiler, "SEnv: mess in act. blocks avg /1s", SPT_AVG);
-		
-		float dtime = 1.0;
-
-		for(core::map<v3s16, bool>::Iterator
-				i = m_active_blocks.m_list.getIterator();
-				i.atEnd()==false; i++)
-		{
-			v3s16 p = i.getNode()->getKey();
-			
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
-
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if(block==NULL)
-				continue;
-
-			// Reset block usage timer
-			block->resetUsageTimer();
-			
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
-			// If time has changed much from the one on disk,
-			// set block to be saved when it is unloaded
-			if(block->getTimestamp() > block->getDiskTimestamp() + 60)
-				block->raiseModified(MOD_STATE_WRITE_AT_UNLOAD,
-						"Timestamp older than 60s (step)");
-
-			// Run node metadata
-			bool changed = block->m_node_metadata->step(dtime);
-			if(changed)
-			{
-				MapEditEvent event;
-				event.type = MEET_BLOCK_NODE_METADATA_CHANGED;
-				event.p = p;
-				m_map->dispatchEvent(&event);
-
-				block->raiseModified(MOD_STATE_WRITE_NEEDED,
-						"node metadata modified in step");
-			}
-		}
-	}
-	
-	const float abm_interval = 1.0;
-	if(m_active_block_modifier_interval.step(dtime, abm_interval))
-	{
-		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /1s", SPT_AVG);
-		TimeTaker timer("modify in active blocks");
-		
-		// Initialize handling of ActiveBlockModifiers
-		ABMHandler abmhandler(m_abms, abm_interval, this, true);
-
-		for(core::map<v3s16, bool>::Iterator
-				i = m_active_blocks.m_list.getIterator();
-				i.atEnd()==false; i++)
-		{
-			v3s16 p = i.getNode()->getKey();
-			
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
-
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if(block==NULL)
-				continue;
-			
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
-
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
-		}
-
-		u32 time_ms = timer.stop(true);
-		u32 max_time_ms = 200;
-		if(time_ms > max_time_ms){
-			infostream<<"WARNING: active block modifiers took "
-					<<time_ms<<"ms (longer than "
-					<<max_time_ms<<"ms)"<<std::endl;
-		}
-	}
+	stepActiveBlocks(dtime);
 	
 	/*
 		Step script environment (run global on_step())
@@ -1146,21 +1407,59 @@ void ServerEnvironment::step(float dtime)
 			send_recommended = true;
 		}
 
+		std::vector<ServerActiveObject*> objects;
+		objects.reserve(m_active_objects.size());
+		bool only_peaceful_mobs = g_settings->getBool("only_peaceful_mobs");
 		for(core::map<u16, ServerActiveObject*>::Iterator
 				i = m_active_objects.getIterator();
 				i.atEnd()==false; i++)
 		{
 			ServerActiveObject* obj = i.getNode()->getValue();
 			// Remove non-peaceful mobs on peaceful mode
-			if(g_settings->getBool("only_peaceful_mobs")){
+			if(only_peaceful_mobs){
 				if(!obj->isPeaceful())
 					obj->m_removed = true;
 			}
 			// Don't step if is to be removed or stored statically
+			if(obj->m_removed || obj->m_pending_deactivation)
+				continue;
+			// Don't step if nothing has disturbed its rest
+			if(obj->m_sleeping)
+				continue;
+			objects.push_back(obj);
+		}
+		g_profiler->avg("SEnv: stepped objects", objects.size());
+		g_profiler->avg("SEnv: sleeping objects", m_sleeping_objects.size());
+
+		/*
+			Move the objects in many threads. Nothing modifies the map
+			or runs scripts meanwhile.
+		*/
+		{
+			ScopeProfiler sp(g_profiler, "SEnv: object physics avg", SPT_AVG);
+			m_object_physics.step(dtime, objects);
+		}
+
+		/*
+			Step the objects one by one in the order of their ids, which
+			runs the scripts and collects the messages to the clients
+		*/
+		for(u32 i=0; i<objects.size(); i++)
+		{
+			ServerActiveObject* obj = objects[i];
+			// The step of an earlier object may have removed this one
 			if(obj->m_removed || obj->m_pending_deactivation)
 				continue;
 			// Step object
 			obj->step(dtime, send_recommended);
+			// Put it to sleep if it has been lying still for a while
+			if(obj->isResting()){
+				obj->m_rest_time += dtime;
+				if(obj->m_rest_time >= 2.0)
+					sleepObject(obj);
+			} else {
+				obj->m_rest_time = 0;
+			}
 			// Read messages from object
 			while(obj->m_messages_out.size() > 0)
 			{
@@ -1181,6 +1480,107 @@ void ServerEnvironment::step(float dtime)
 		*/
 		removeRemovedObjects();
 	}
+
+	/*
+		Keep track of how the step times are spread; the slow steps
+		are the ones that are felt as lag
+	*/
+	m_step_times.add(porting::getTimeUs() - step_start_us);
+	if(m_step_time_report_interval.step(dtime, STEP_TIME_REPORT_INTERVAL))
+	{
+		g_profiler->avg("SEnv: step time p99 (ms)",
+				m_step_times.percentile(0.99) / 1000.0);
+		m_step_times.clear();
+	}
+}
+
+void ServerEnvironment::stepActiveBlocks(float dtime)
+{
+	ScopeProfiler sp(g_profiler, "SEnv: step act. blocks avg", SPT_AVG);
+
+	m_active_block_clock += dtime;
+	m_active_block_round_time += dtime;
+
+	/*
+		Start a new round when the last one is done and it is time.
+		The ABMs trigger once per round, so they get the time since
+		the start of the last one.
+	*/
+	if(m_active_block_round_next >= m_active_block_round.size() &&
+			m_active_block_round_time >= ACTIVE_BLOCK_ROUND_INTERVAL)
+	{
+		delete m_abm_handler;
+		m_abm_handler = new ABMHandler(m_abms, m_active_block_round_time,
+				this, true);
+		m_active_block_round.clear();
+		for(core::map<v3s16, bool>::Iterator
+				i = m_active_blocks.m_list.getIterator();
+				i.atEnd()==false; i++)
+			m_active_block_round.push_back(i.getNode()->getKey());
+		m_active_block_round_next = 0;
+		m_active_block_round_time = 0;
+	}
+
+	u32 left = m_active_block_round.size() - m_active_block_round_next;
+	if(left == 0)
+		return;
+
+	/*
+		Do the share of the blocks that keeps the round on schedule,
+		but stop when the time budget of the step is used up
+	*/
+	u32 quota = left;
+	float time_left = ACTIVE_BLOCK_ROUND_INTERVAL - m_active_block_round_time;
+	if(time_left > dtime)
+		quota = MYMIN(left, (u32)ceil((float)left * dtime / time_left));
+	u32 budget_ms = g_settings->getU16("active_block_step_budget");
+	u32 start_ms = porting::getTimeMs();
+
+	u32 stepped_count = 0;
+	while(stepped_count < quota &&
+			m_active_block_round_next < m_active_block_round.size())
+	{
+		// Always step at least one block so that the round advances
+		if(stepped_count > 0 && budget_ms != 0 &&
+				porting::getTimeMs() - start_ms >= budget_ms)
+			break;
+
+		v3s16 p = m_active_block_round[m_active_block_round_next++];
+		stepped_count++;
+
+		// The block may have become inactive after the round started
+		std::map<v3s16, f64>::iterator t = m_active_block_step_times.find(p);
+		if(t == m_active_block_step_times.end())
+			continue;
+
+		MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+		if(block==NULL)
+			continue;
+
+		// Time since the block was stepped the last time
+		float dtime_block = m_active_block_clock - t->second;
+		t->second = m_active_block_clock;
+
+		// Reset block usage timer
+		block->resetUsageTimer();
+		
+		// Set current time as timestamp
+		block->setTimestampNoChangedFlag(m_game_time);
+		// If time has changed much from the one on disk,
+		// set block to be saved when it is unloaded
+		if(block->getTimestamp() > block->getDiskTimestamp() + 60)
+			block->raiseModified(MOD_STATE_WRITE_AT_UNLOAD,
+					"Timestamp older than 60s (step)");
+
+		// Run node timers
+		stepNodeTimers(block, dtime_block);
+
+		/* Handle ActiveBlockModifiers */
+		m_abm_handler->apply(block);
+	}
+	g_profiler->avg("SEnv: stepped act. blocks", stepped_count);
+	g_profiler->avg("SEnv: act. blocks left in round",
+			m_active_block_round.size() - m_active_block_round_next);
 }
 
 ServerActiveObject* ServerEnvironment::getActiveObject(u16 id)
@@ -1381,10 +1781,72 @@ ActiveObjectMessage ServerEnvironment::getActiveObjectMessage()
 	return m_active_object_messages.pop_front();
 }
 
+void ServerEnvironment::wakeObject(ServerActiveObject *obj)
+{
+	if(!obj->m_sleeping)
+		return;
+	m_sleeping_objects.erase(
+			std::make_pair(obj->m_sleeping_block, obj->getId()));
+	obj->m_sleeping = false;
+	obj->m_rest_time = 0;
+}
+
+void ServerEnvironment::wakeObjectsInArea(VoxelArea area)
+{
+	if(m_sleeping_objects.empty() || area.getExtent() == v3s16(0,0,0))
+		return;
+	// Objects lean on the nodes around them
+	area.pad(v3s16(2,2,2));
+	v3s16 bp_min = getNodeBlockPos(area.MinEdge);
+	v3s16 bp_max = getNodeBlockPos(area.MaxEdge);
+	/*
+		The set is ordered by X first, so this walks every object in the
+		X range of the blocks; the rest are skipped below
+	*/
+	std::set<std::pair<v3s16, u16> >::iterator i =
+			m_sleeping_objects.lower_bound(std::make_pair(bp_min, (u16)0));
+	std::set<std::pair<v3s16, u16> >::iterator end =
+			m_sleeping_objects.upper_bound(std::make_pair(bp_max, (u16)65535));
+	std::vector<ServerActiveObject*> woken;
+	for(; i != end; i++)
+	{
+		v3s16 bp = i->first;
+		if(bp.Y < bp_min.Y || bp.Y > bp_max.Y ||
+				bp.Z < bp_min.Z || bp.Z > bp_max.Z)
+			continue;
+		ServerActiveObject *obj = getActiveObject(i->second);
+		if(obj == NULL)
+			continue;
+		if(area.contains(floatToInt(obj->getBasePosition(), BS)))
+			woken.push_back(obj);
+	}
+	for(u32 j=0; j<woken.size(); j++)
+		wakeObject(woken[j]);
+}
+
+void ServerEnvironment::onMapEditEvent(MapEditEvent *event)
+{
+	// Metadata doesn't move anything
+	if(event->type == MEET_BLOCK_NODE_METADATA_CHANGED)
+		return;
+	wakeObjectsInArea(event->getArea());
+}
+
 /*
 	************ Private methods *************
 */
 
+void ServerEnvironment::sleepObject(ServerActiveObject *obj)
+{
+	if(obj->m_sleeping)
+		return;
+	obj->m_sleeping = true;
+	obj->m_sleeping_block = getNodeBlockPos(
+			floatToInt(obj->getBasePosition(), BS));
+	m_sleeping_objects.insert(
+			std::make_pair(obj->m_sleeping_block, obj->getId()));
+}
+
 u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 		bool set_changed)
 {
@@ -1506,6 +1968,9 @@ void ServerEnvironment::removeRemovedObjects()
 		if(obj->m_known_by_count > 0)
 			continue;
 		
+		// Drop it from the sleeping objects
+		if(obj->m_sleeping)
+			wakeObject(obj);
 		// Tell the object about removal
 		obj->removingFromEnvironment();
 		// Deregister in scripting api
@@ -1795,6 +2260,9 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 				<<"object id="<<id<<" is not known by clients"
 				<<"; deleting"<<std::endl;
 
+		// Drop it from the sleeping objects
+		if(obj->m_sleeping)
+			wakeObject(obj);
 		// Tell the object about removal
 		obj->removingFromEnvironment();
 		// Deregister in scripting api
@@ -31,12 +31,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include <set>
+#include <map>
 #include "common_irrlicht.h"
 #include "player.h"
 #include "map.h"
 #include <ostream>
 #include "utility.h"
 #include "activeobject.h"
+#include "profiler.h" // For TimeHistogram
+#include <jsemaphore.h>
 
 class Server;
 class ServerEnvironment;
@@ -144,15 +147,29 @@ struct ABMWithState
 	float timer;
 
 	ABMWithState(ActiveBlockModifier *abm_);
+
+	// Advances the timer by dtime_s. Returns the time the ABM is due
+	// to be applied for, a whole number of trigger intervals, or 0 if
+	// the timer hasn't reached the interval yet.
+	float step(float dtime_s);
 };
 
 /*
 	List of active blocks, used by ServerEnvironment
+
+	The blocks within radius of the positions are active. Each block
+	counts how many of the areas around the positions it is in, so an
+	update only has to go through the blocks at the edges of the areas
+	that moved.
 */
 
 class ActiveBlockList
 {
 public:
+	ActiveBlockList():
+		m_radius(-1)
+	{}
+
 	void update(core::list<v3s16> &active_positions,
 			s16 radius,
 			core::map<v3s16, bool> &blocks_removed,
@@ -162,13 +179,38 @@ public:
 		return (m_list.find(p) != NULL);
 	}
 
+	/*
+		Takes a block that couldn't be activated off the list. The next
+		update adds it again if it is still in range.
+	*/
+	void retryLater(v3s16 p){
+		m_list.remove(p);
+		m_retry.insert(p);
+	}
+
 	void clear(){
 		m_list.clear();
+		m_refs.clear();
+		m_retry.clear();
+		m_positions.clear();
+		m_radius = -1;
 	}
 
 	core::map<v3s16, bool> m_list;
 
 private:
+	// Adds delta to the counts of the blocks in area
+	void changeRefs(const VoxelArea &area, s16 delta,
+			core::map<v3s16, bool> &blocks_removed,
+			core::map<v3s16, bool> &blocks_added);
+
+	// Number of areas each block in range is in
+	std::map<v3s16, u16> m_refs;
+	// Blocks in range that are taken off m_list by retryLater()
+	std::set<v3s16> m_retry;
+	// Positions and radius of the last update
+	std::multiset<v3s16> m_positions;
+	s16 m_radius;
 };
 
 class IBackgroundBlockEmerger
@@ -177,13 +219,95 @@ public:
 	virtual void queueBlockEmerge(v3s16 blockpos, bool allow_generate)=0;
 };
 
+class ObjectPhysicsManager;
+class ABMHandler;
+
+/*
+	A thread helping ObjectPhysicsManager to move the active objects
+*/
+class ObjectPhysicsThread : public SimpleThread
+{
+public:
+	ObjectPhysicsThread(ObjectPhysicsManager *manager):
+		m_manager(manager)
+	{
+	}
+
+	void * Thread();
+
+private:
+	ObjectPhysicsManager *m_manager;
+};
+
+/*
+	Moves the active objects of a server step in many threads.
+
+	The objects are handed out in chunks to the helper threads and the
+	calling thread alike. Each object only changes itself, so the result
+	doesn't depend on which thread moves which object.
+*/
+class ObjectPhysicsManager
+{
+public:
+	ObjectPhysicsManager();
+	~ObjectPhysicsManager();
+
+	/*
+		Sets the number of threads moving the objects, including the
+		calling thread; 0 = the number of processors, but at most 4.
+		The helper threads are only started when they are needed.
+	*/
+	void setThreadCount(u32 count);
+	u32 getThreadCount()
+	{
+		return m_thread_count;
+	}
+
+	// Calls stepPhysics(dtime) of all the objects and returns when
+	// all of them are done
+	void step(float dtime, std::vector<ServerActiveObject*> &objects);
+
+	/*
+		Used by the helper threads: each step is started by posting
+		m_step_begin once per thread, and step() returns after every
+		thread has posted m_step_done.
+	*/
+	void waitForStep()
+	{
+		m_step_begin.Wait();
+	}
+	void stepDone()
+	{
+		m_step_done.Post();
+	}
+
+	// Moves chunks of the objects of the current step until there are
+	// none left
+	void work();
+
+private:
+	void stop();
+
+	u32 m_thread_count;
+	std::vector<ObjectPhysicsThread*> m_threads;
+	JSemaphore m_step_begin;
+	JSemaphore m_step_done;
+	// Protects the variables below
+	JMutex m_mutex;
+	// The objects of the current step; NULL between steps
+	std::vector<ServerActiveObject*> *m_objects;
+	float m_dtime;
+	// The first object not yet handed out
+	u32 m_next;
+};
+
 /*
 	The server-side environment.
 
 	This is not thread-safe. Server uses an environment mutex.
 */
 
-class ServerEnvironment : public Environment
+class ServerEnvironment : public Environment, public MapEventReceiver
 {
 public:
 	ServerEnvironment(ServerMap *map, lua_State *L, IGameDef *gamedef,
@@ -208,10 +332,15 @@ public:
 	}
 
 	/*
-		Save players
+		Save and load players. They are kept in the map database and
+		loaded when they join; only the ones that have changed since
+		they were last saved are written again.
 	*/
-	void serializePlayers(const std::string &savedir);
-	void deSerializePlayers(const std::string &savedir);
+	void savePlayers();
+	// Returns NULL if the player has never been saved
+	RemotePlayer* loadPlayer(const std::string &name);
+	// Moves the players of the player files of old worlds to the database
+	void migratePlayerFiles(const std::string &savedir);
 
 	/*
 		Save and load time of day and game timer
@@ -266,6 +395,18 @@ public:
 	*/
 	ActiveObjectMessage getActiveObjectMessage();
 
+	/*
+		Sleeping objects
+		-------------------------------------------
+	*/
+
+	// Makes a sleeping object be stepped again
+	void wakeObject(ServerActiveObject *obj);
+	// Wakes the objects that are in or next to the area (in nodes)
+	void wakeObjectsInArea(VoxelArea area);
+	// Wakes the objects around changed nodes
+	void onMapEditEvent(MapEditEvent *event);
+
 	/*
 		Activate objects and dynamically modify for the dtime determined
 		from timestamp and additional_dtime
@@ -321,6 +462,12 @@ private:
 		Convert stored objects from block to active
 	*/
 	void activateObjects(MapBlock *block);
+
+	/*
+		Advance the node timers of a block by dtime and run the ones
+		that are due
+	*/
+	void stepNodeTimers(MapBlock *block, float dtime);
 	
 	/*
 		Convert objects that are not in active blocks to static.
@@ -333,6 +480,15 @@ private:
 	*/
 	void deactivateFarObjects(bool force_delete);
 
+	// Stops stepping a resting object
+	void sleepObject(ServerActiveObject *obj);
+
+	/*
+		Runs the node timers and ABMs of the next blocks of the round,
+		as many as are due in this step and fit in the time budget
+	*/
+	void stepActiveBlocks(float dtime);
+
 	/*
 		Member variables
 	*/
@@ -345,8 +501,14 @@ private:
 	IGameDef *m_gamedef;
 	// Background block emerger (the server, in practice)
 	IBackgroundBlockEmerger *m_emerger;
+	// Players as they were last saved or loaded, by name
+	std::map<std::string, std::string> m_saved_players;
 	// Active object list
 	core::map<u16, ServerActiveObject*> m_active_objects;
+	// Moves the active objects in parallel
+	ObjectPhysicsManager m_object_physics;
+	// Sleeping objects by the block they fell asleep in
+	std::set<std::pair<v3s16, u16> > m_sleeping_objects;
 	// Outgoing network message buffer for active objects
 	Queue<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -356,13 +518,30 @@ private:
 	// List of active blocks
 	ActiveBlockList m_active_blocks;
 	IntervalLimiter m_active_blocks_management_interval;
-	IntervalLimiter m_active_block_modifier_interval;
-	IntervalLimiter m_active_blocks_nodemetadata_interval;
 	// Time from the beginning of the game in seconds.
 	// Incremented in step().
 	u32 m_game_time;
 	// A helper variable for incrementing the latter
 	float m_game_time_fraction_counter;
+	/*
+		The active blocks are stepped in rounds of about a second, a
+		slice of the blocks in each server step.
+	*/
+	// Blocks of the current round; the ones from the index on are left
+	std::vector<v3s16> m_active_block_round;
+	u32 m_active_block_round_next;
+	// Time since the current round started
+	float m_active_block_round_time;
+	// The ABMs that trigger in the current round
+	ABMHandler *m_abm_handler;
+	// Time from the start of the environment, and the time of it at
+	// which each active block was last stepped
+	f64 m_active_block_clock;
+	std::map<v3s16, f64> m_active_block_step_times;
+	// Durations of the steps since the last report, to find out how
+	// slow the slowest ones are
+	TimeHistogram m_step_times;
+	IntervalLimiter m_step_time_report_interval;
 	core::list<ABMWithState> m_abms;
 };
 
@@ -2736,15 +2736,20 @@ void the_game(
 		
 		if(show_debug)
 		{
+			ClientMap &map = client.getEnv().getClientMap();
 			char temptext[300];
 			snprintf(temptext, 300,
 					"(% .1f, % .1f, % .1f)"
-					" (yaw = %.1f) (seed = %lli)",
+					" (yaw = %.1f) (seed = %lli)"
+					" (map: %u blocks, %u compressed, %u KiB)",
 					player_position.X/BS,
 					player_position.Y/BS,
 					player_position.Z/BS,
 					wrapDegrees_0_360(camera_yaw),
-					client.getMapSeed());
+					client.getMapSeed(),
+					map.getBlockCount(),
+					map.getCompressedBlockCount(),
+					map.getNodeDataSize() / 1024);
 
 			guitext2->setText(narrow_to_wide(temptext).c_str());
 			guitext2->setVisible(true);
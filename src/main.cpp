@@ -340,9 +340,13 @@ int main(int argc, char *argv[])
 			"Set logfile path ('' = no logging)"));
 	allowed_options.insert("gameid", ValueSpec(VALUETYPE_STRING,
 			"Set gameid (\"--gameid list\" prints available ones)"));
+	allowed_options.insert("objectbench", ValueSpec(VALUETYPE_FLAG,
+			"Move thousands of dropped items in the world and exit"));
 #ifndef SERVER
 	allowed_options.insert("speedtests", ValueSpec(VALUETYPE_FLAG,
 			"Run speed tests"));
+	allowed_options.insert("meshbench", ValueSpec(VALUETYPE_FLAG,
+			"Mesh a region of --world with the null video driver"));
 	allowed_options.insert("address", ValueSpec(VALUETYPE_STRING,
 			"Address to connect to. ('' = local game)"));
 	allowed_options.insert("random-input", ValueSpec(VALUETYPE_FLAG,
@@ -715,6 +719,15 @@ int main(int argc, char *argv[])
 		}
 		verbosestream<<"Using gameid ["<<gamespec.id<<"]"<<std::endl;
 
+		if(cmd_args.getFlag("objectbench"))
+		{
+			dstream<<"Running object speed tests"<<std::endl;
+			SpeedTest *st = new SpeedTest();
+			st->ObjectSpeedTests(world_path, gamespec);
+			delete(st);
+			return 0;
+		}
+
 		// Create server
 		Server server(world_path, configpath, gamespec, false);
 		server.start(port);
@@ -786,6 +799,10 @@ int main(int argc, char *argv[])
 		driverType = video::EDT_OPENGL;
 	}
 
+	// The mesh benchmark doesn't draw anything
+	if(cmd_args.getFlag("meshbench"))
+		driverType = video::EDT_NULL;
+
 	/*
 		Create device and exit if creation failed
 	*/
@@ -841,6 +858,29 @@ int main(int argc, char *argv[])
 		delete(st);
 		return 0;
 	}
+
+	if(cmd_args.getFlag("meshbench"))
+	{
+		if(commanded_world == ""){
+			errorstream<<"--meshbench requires --world"<<std::endl;
+			return 1;
+		}
+		bool is_legacy_world = false;
+		SubgameSpec gamespec = commanded_gamespec;
+		if(!gamespec.isValid())
+			gamespec = findSubgame(getWorldGameId(commanded_world,
+					is_legacy_world));
+		if(!gamespec.isValid()){
+			errorstream<<"Game for world ["<<commanded_world<<"] not found"
+					<<std::endl;
+			return 1;
+		}
+		dstream<<"Running mesh speed tests"<<std::endl;
+		SpeedTest *st = new SpeedTest();
+		st->MeshSpeedTests(device, commanded_world, gamespec);
+		delete(st);
+		return 0;
+	}
 	
 	device->setResizable(true);
 
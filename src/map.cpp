@@ -71,6 +71,7 @@ Map::Map(std::ostream &dout, IGameDef *gamedef):
 {
 	/*m_sector_mutex.Init();
 	assert(m_sector_mutex.IsInitialized());*/
+	m_walkable_bits_mutex.Init();
 }
 
 Map::~Map()
@@ -154,6 +155,24 @@ MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 	return block;
 }
 
+MapBlock * Map::getBlockNoCreateNoCache(v3s16 p3d)
+{
+	core::map<v2s16, MapSector*>::Node *n =
+			m_sectors.find(v2s16(p3d.X, p3d.Z));
+	if(n == NULL)
+		return NULL;
+	return n->getValue()->getBlockNoCreateNoCache(p3d.Y);
+}
+
+const u8 * Map::getWalkableBits(v3s16 p)
+{
+	MapBlock *block = getBlockNoCreateNoCache(p);
+	if(block == NULL)
+		return NULL;
+	JMutexAutoLock lock(m_walkable_bits_mutex);
+	return block->getWalkableBits();
+}
+
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
 {	
 	MapBlock *block = getBlockNoCreateNoEx(p3d);
@@ -1023,6 +1042,12 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 
 	setNode(p, n);
 
+	/*
+		Remove the timer of the previous node
+	*/
+
+	removeNodeTimer(p);
+
 	/*
 		Add intial metadata
 	*/
@@ -1179,10 +1204,11 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	}
 
 	/*
-		Remove node metadata
+		Remove node metadata and timer
 	*/
 
 	removeNodeMetadata(p);
+	removeNodeTimer(p);
 
 	/*
 		Remove the node.
@@ -1426,7 +1452,7 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	bool save_before_unloading = (mapType() == MAPTYPE_SERVER);
 	
 	// Profile modified reasons
-	Profiler modprofiler;
+	std::map<std::string, u32> modified_counts;
 	
 	core::list<v2s16> sector_deletion_queue;
 	u32 deleted_blocks_count = 0;
@@ -1461,7 +1487,7 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 				if(block->getModified() != MOD_STATE_CLEAN
 						&& save_before_unloading)
 				{
-					modprofiler.add(block->getModifiedReason(), 1);
+					modified_counts[block->getModifiedReason()]++;
 					saveBlock(block);
 					saved_blocks_count++;
 				}
@@ -1503,7 +1529,7 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 		if(saved_blocks_count != 0){
 			PrintInfo(infostream); // ServerMap/ClientMap:
 			infostream<<"Blocks modified by: "<<std::endl;
-			modprofiler.print(infostream);
+			printCounts(infostream, modified_counts);
 		}
 	}
 }
@@ -1898,33 +1924,43 @@ void Map::removeNodeMetadata(v3s16 p)
 	block->m_node_metadata->remove(p_rel);
 }
 
-void Map::nodeMetadataStep(float dtime,
-		core::map<v3s16, MapBlock*> &changed_blocks)
+NodeTimer Map::getNodeTimer(v3s16 p)
 {
-	/*
-		NOTE:
-		Currently there is no way to ensure that all the necessary
-		blocks are loaded when this is run. (They might get unloaded)
-		NOTE: ^- Actually, that might not be so. In a quick test it
-		reloaded a block with a furnace when I walked back to it from
-		a distance.
-	*/
-	core::map<v2s16, MapSector*>::Iterator si;
-	si = m_sectors.getIterator();
-	for(; si.atEnd() == false; si++)
+	v3s16 blockpos = getNodeBlockPos(p);
+	v3s16 p_rel = p - blockpos*MAP_BLOCKSIZE;
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if(block == NULL)
 	{
-		MapSector *sector = si.getNode()->getValue();
-		core::list< MapBlock * > sectorblocks;
-		sector->getBlocks(sectorblocks);
-		core::list< MapBlock * >::Iterator i;
-		for(i=sectorblocks.begin(); i!=sectorblocks.end(); i++)
-		{
-			MapBlock *block = *i;
-			bool changed = block->m_node_metadata->step(dtime);
-			if(changed)
-				changed_blocks[block->getPos()] = block;
-		}
+		infostream<<"WARNING: Map::getNodeTimer(): Block not found"
+				<<std::endl;
+		return NodeTimer();
 	}
+	return block->m_node_timers.get(p_rel);
+}
+
+void Map::setNodeTimer(v3s16 p, NodeTimer t)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	v3s16 p_rel = p - blockpos*MAP_BLOCKSIZE;
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if(block == NULL)
+	{
+		infostream<<"WARNING: Map::setNodeTimer(): Block not found"
+				<<std::endl;
+		return;
+	}
+	block->m_node_timers.set(p_rel, t);
+	block->raiseModified(MOD_STATE_WRITE_AT_UNLOAD, "node timer set");
+}
+
+void Map::removeNodeTimer(v3s16 p)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	v3s16 p_rel = p - blockpos*MAP_BLOCKSIZE;
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if(block == NULL)
+		return;
+	block->m_node_timers.remove(p_rel);
 }
 
 /*
@@ -1937,7 +1973,9 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef):
 	m_map_metadata_changed(true),
 	m_database(NULL),
 	m_database_read(NULL),
-	m_database_write(NULL)
+	m_database_write(NULL),
+	m_database_player_read(NULL),
+	m_database_player_write(NULL)
 {
 	verbosestream<<__FUNCTION_NAME<<std::endl;
 
@@ -2057,6 +2095,10 @@ ServerMap::~ServerMap()
 		sqlite3_finalize(m_database_read);
 	if(m_database_write)
 		sqlite3_finalize(m_database_write);
+	if(m_database_player_read)
+		sqlite3_finalize(m_database_player_read);
+	if(m_database_player_write)
+		sqlite3_finalize(m_database_player_write);
 	if(m_database)
 		sqlite3_close(m_database);
 
@@ -2727,6 +2769,18 @@ void ServerMap::verifyDatabase() {
 		
 		if(needs_create)
 			createDatabase();
+
+		// Databases made before players were stored in them lack this
+		d = sqlite3_exec(m_database,
+			"CREATE TABLE IF NOT EXISTS `players` ("
+				"`name` TEXT NOT NULL PRIMARY KEY,"
+				"`data` BLOB"
+			");"
+		, NULL, NULL, NULL);
+		if(d != SQLITE_OK) {
+			infostream<<"WARNING: Player table failed to create: "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot create player table");
+		}
 	
 		d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
 		if(d != SQLITE_OK) {
@@ -2746,6 +2800,18 @@ void ServerMap::verifyDatabase() {
 			throw FileNotGoodException("Cannot prepare read statement");
 		}
 		
+		d = sqlite3_prepare(m_database, "SELECT `data` FROM `players` WHERE `name`=? LIMIT 1", -1, &m_database_player_read, NULL);
+		if(d != SQLITE_OK) {
+			infostream<<"WARNING: Database player read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot prepare player read statement");
+		}
+		
+		d = sqlite3_prepare(m_database, "REPLACE INTO `players` VALUES(?, ?)", -1, &m_database_player_write, NULL);
+		if(d != SQLITE_OK) {
+			infostream<<"WARNING: Database player write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot prepare player write statement");
+		}
+		
 		infostream<<"ServerMap: Database opened"<<std::endl;
 	}
 }
@@ -2861,7 +2927,7 @@ void ServerMap::save(ModifiedState save_level)
 	}
 
 	// Profile modified reasons
-	Profiler modprofiler;
+	std::map<std::string, u32> modified_counts;
 	
 	u32 sector_meta_count = 0;
 	u32 block_count = 0;
@@ -2899,7 +2965,7 @@ void ServerMap::save(ModifiedState save_level)
 					save_started = true;
 				}
 
-				modprofiler.add(block->getModifiedReason(), 1);
+				modified_counts[block->getModifiedReason()]++;
 
 				saveBlock(block);
 				block_count++;
@@ -2928,7 +2994,7 @@ void ServerMap::save(ModifiedState save_level)
 				<<std::endl;
 		PrintInfo(infostream); // ServerMap/ClientMap:
 		infostream<<"Blocks modified by: "<<std::endl;
-		modprofiler.print(infostream);
+		printCounts(infostream, modified_counts);
 	}
 }
 
@@ -3530,6 +3596,50 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 	return getBlockNoCreateNoEx(blockpos);
 }
 
+bool ServerMap::savePlayer(const std::string &name, const std::string &data)
+{
+	verifyDatabase();
+
+	bool success = true;
+	if(sqlite3_bind_text(m_database_player_write, 1, name.c_str(), name.size(), NULL) != SQLITE_OK)
+	{
+		infostream<<"WARNING: Player name failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+		success = false;
+	}
+	else if(sqlite3_bind_blob(m_database_player_write, 2, data.c_str(), data.size(), NULL) != SQLITE_OK)
+	{
+		infostream<<"WARNING: Player data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+		success = false;
+	}
+	else if(sqlite3_step(m_database_player_write) != SQLITE_DONE)
+	{
+		infostream<<"WARNING: Player failed to save ("<<name<<") "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		success = false;
+	}
+	// Make ready for later reuse
+	sqlite3_reset(m_database_player_write);
+	return success;
+}
+
+bool ServerMap::loadPlayer(const std::string &name, std::string &data)
+{
+	verifyDatabase();
+
+	if(sqlite3_bind_text(m_database_player_read, 1, name.c_str(), name.size(), NULL) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind player name for load: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+	bool found = false;
+	if(sqlite3_step(m_database_player_read) == SQLITE_ROW) {
+		const char *bytes = (const char *)sqlite3_column_blob(m_database_player_read, 0);
+		size_t len = sqlite3_column_bytes(m_database_player_read, 0);
+		data = bytes ? std::string(bytes, len) : "";
+		found = true;
+	}
+	sqlite3_reset(m_database_player_read);
+	return found;
+}
+
 void ServerMap::PrintInfo(std::ostream &out)
 {
 	out<<"ServerMap: ";
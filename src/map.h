@@ -32,6 +32,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "voxel.h"
 #include "utility.h" // Needed for UniqueQueue, a member of Map
 #include "modifiedstate.h"
+#include "nodetimer.h"
 
 extern "C" {
 	#include "sqlite3.h"
@@ -190,6 +191,18 @@ public:
 	MapBlock * getBlockNoCreate(v3s16 p);
 	// Returns NULL if not found
 	MapBlock * getBlockNoCreateNoEx(v3s16 p);
+	/*
+		Same as the above, but doesn't use or update the sector and
+		block caches. This can be called from many threads at once as
+		long as nothing modifies the map.
+	*/
+	MapBlock * getBlockNoCreateNoCache(v3s16 p);
+	/*
+		MapBlock::getWalkableBits() of the block at p, or NULL if it
+		isn't loaded. Like getBlockNoCreateNoCache(), this can be called
+		from many threads at once.
+	*/
+	const u8 * getWalkableBits(v3s16 p);
 	
 	/* Server overrides */
 	virtual MapBlock * emergeBlock(v3s16 p, bool allow_generate=true)
@@ -309,8 +322,15 @@ public:
 	NodeMetadata* getNodeMetadata(v3s16 p);
 	void setNodeMetadata(v3s16 p, NodeMetadata *meta);
 	void removeNodeMetadata(v3s16 p);
-	void nodeMetadataStep(float dtime,
-			core::map<v3s16, MapBlock*> &changed_blocks);
+
+	/*
+		Node Timers
+		These are basically coordinate wrappers to MapBlock
+	*/
+	
+	NodeTimer getNodeTimer(v3s16 p);
+	void setNodeTimer(v3s16 p, NodeTimer t);
+	void removeNodeTimer(v3s16 p);
 	
 	/*
 		Misc.
@@ -337,6 +357,9 @@ protected:
 
 	// Queued transforming water nodes
 	UniqueQueue<v3s16> m_transforming_liquid;
+
+	// Held while building the walkable bits of a block
+	JMutex m_walkable_bits_mutex;
 };
 
 /*
@@ -463,6 +486,15 @@ public:
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
+	/*
+		Players are stored by name in the same database as the blocks.
+		Call beginSave() and endSave() around saving many of them.
+	*/
+	// Returns false if the player could not be written
+	bool savePlayer(const std::string &name, const std::string &data);
+	// Returns false if there is no player by the name
+	bool loadPlayer(const std::string &name, std::string &data);
+
 	// For debug printing
 	virtual void PrintInfo(std::ostream &out);
 
@@ -498,6 +530,8 @@ private:
 	sqlite3_stmt *m_database_read;
 	sqlite3_stmt *m_database_write;
 	sqlite3_stmt *m_database_list;
+	sqlite3_stmt *m_database_player_read;
+	sqlite3_stmt *m_database_player_write;
 };
 
 class MapVoxelManipulator : public VoxelManipulator
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 
 #include <sstream>
+#include <map>
 #include "map.h"
 // For g_settings
 #include "main.h"
@@ -56,12 +57,16 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_usage_timer(0)
 {
 	data = NULL;
+	m_compressed = NULL;
+	m_walkable_bits = NULL;
+	m_walkable_bits_valid = false;
 	if(dummy == false)
 		reallocate();
 	
 #ifndef SERVER
 	//mesh_mutex.Init();
 	mesh = NULL;
+	face_connectivity = FACE_CONNECTIVITY_ALL;
 #endif
 }
 
@@ -83,6 +88,8 @@ MapBlock::~MapBlock()
 
 	if(data)
 		delete[] data;
+	delete m_compressed;
+	delete[] m_walkable_bits;
 }
 
 bool MapBlock::isValidPositionParent(v3s16 p)
@@ -104,6 +111,7 @@ MapNode MapBlock::getNodeParent(v3s16 p)
 	}
 	else
 	{
+		decompressIfNeeded();
 		if(data == NULL)
 			throw InvalidPositionException();
 		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
@@ -118,9 +126,10 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 	}
 	else
 	{
+		decompressIfNeeded();
 		if(data == NULL)
 			throw InvalidPositionException();
-		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		setNodeData(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X, n);
 	}
 }
 
@@ -138,6 +147,7 @@ MapNode MapBlock::getNodeParentNoEx(v3s16 p)
 	}
 	else
 	{
+		decompressIfNeeded();
 		if(data == NULL)
 		{
 			return MapNode(CONTENT_IGNORE);
@@ -341,6 +351,8 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
+	decompressIfNeeded();
+
 	// Copy from data to VoxelManipulator
 	dst.copyFrom(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
@@ -351,9 +363,12 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
+	decompressIfNeeded();
+
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+	m_walkable_bits_valid = false;
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -362,6 +377,7 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	// Running this function un-expires m_day_night_differs
 	m_day_night_differs_expired = false;
 
+	decompressIfNeeded();
 	if(data == NULL)
 	{
 		m_day_night_differs = false;
@@ -411,7 +427,7 @@ void MapBlock::expireDayNightDiff()
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	if(data == NULL){
+	if(isDummy()){
 		m_day_night_differs = false;
 		m_day_night_differs_expired = false;
 		return;
@@ -420,6 +436,125 @@ void MapBlock::expireDayNightDiff()
 	m_day_night_differs_expired = true;
 }
 
+void MapBlock::compressNodes()
+{
+	if(data == NULL)
+		return;
+
+	const u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	MapBlockCompressedNodes *c = new MapBlockCompressedNodes;
+
+	// Build the palette; the key of a node is its params
+	std::map<u32, u16> palette_ids;
+	std::vector<u16> ids(nodecount);
+	for(u32 i=0; i<nodecount; i++)
+	{
+		const MapNode &n = data[i];
+		u32 key = ((u32)n.param0 << 16) | ((u32)n.param1 << 8) | n.param2;
+		std::map<u32, u16>::iterator j = palette_ids.find(key);
+		if(j == palette_ids.end())
+		{
+			j = palette_ids.insert(
+					std::make_pair(key, (u16)c->palette.size())).first;
+			c->palette.push_back(n);
+		}
+		ids[i] = j->second;
+	}
+
+	u32 palette_size = c->palette.size();
+	if(palette_size <= 1)        c->bits = 0;
+	else if(palette_size <= 2)   c->bits = 1;
+	else if(palette_size <= 4)   c->bits = 2;
+	else if(palette_size <= 16)  c->bits = 4;
+	else if(palette_size <= 256) c->bits = 8;
+	else                         c->bits = 16;
+
+	if(palette_size * sizeof(MapNode) + nodecount * c->bits / 8
+			>= nodecount * sizeof(MapNode))
+	{
+		delete c;
+		return;
+	}
+
+	c->indices.resize(nodecount * c->bits / 8, 0);
+	for(u32 i=0; i<nodecount; i++)
+	{
+		if(c->bits == 16)
+		{
+			c->indices[i*2] = ids[i] & 0xff;
+			c->indices[i*2+1] = ids[i] >> 8;
+		}
+		else if(c->bits != 0)
+		{
+			u32 bit = i * c->bits;
+			c->indices[bit / 8] |= ids[i] << (bit % 8);
+		}
+	}
+
+	delete[] data;
+	data = NULL;
+	m_compressed = c;
+}
+
+void MapBlock::decompressNodes()
+{
+	assert(m_compressed != NULL && data == NULL);
+	MapBlockCompressedNodes *c = m_compressed;
+
+	const u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	data = new MapNode[nodecount];
+	u32 mask = (1 << c->bits) - 1;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		u16 id = 0;
+		if(c->bits == 16)
+		{
+			id = c->indices[i*2] | (c->indices[i*2+1] << 8);
+		}
+		else if(c->bits != 0)
+		{
+			u32 bit = i * c->bits;
+			id = (c->indices[bit / 8] >> (bit % 8)) & mask;
+		}
+		data[i] = c->palette[id];
+	}
+
+	delete c;
+	m_compressed = NULL;
+}
+
+u32 MapBlock::getNodeDataSize()
+{
+	if(m_compressed != NULL)
+		return sizeof(MapBlockCompressedNodes)
+				+ m_compressed->palette.size() * sizeof(MapNode)
+				+ m_compressed->indices.size();
+	if(data != NULL)
+		return MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE * sizeof(MapNode);
+	return 0;
+}
+
+const u8 * MapBlock::getWalkableBits()
+{
+	if(m_walkable_bits_valid)
+		return m_walkable_bits;
+	decompressIfNeeded();
+	if(data == NULL)
+		return NULL;
+	const u32 size = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE/8;
+	if(m_walkable_bits == NULL)
+		m_walkable_bits = new u8[size];
+	INodeDefManager *nodemgr = m_gamedef->ndef();
+	memset(m_walkable_bits, 0, size);
+	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	{
+		if(nodemgr->get(data[i]).walkable)
+			m_walkable_bits[i>>3] |= 1<<(i&7);
+	}
+	m_walkable_bits_valid = true;
+	return m_walkable_bits;
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -546,6 +681,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 	
+	decompressIfNeeded();
 	if(data == NULL)
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
@@ -621,6 +757,10 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 
 		// Write block-specific node definition id mapping
 		nimap.serialize(os);
+
+		// Node timers
+		if(version >= 23)
+			m_node_timers.serialize(os);
 	}
 }
 
@@ -630,11 +770,16 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
+	decompressIfNeeded();
+
 	m_day_night_differs_expired = false;
+	m_walkable_bits_valid = false;
 
 	if(version <= 21)
 	{
 		deSerialize_pre22(is, version, disk);
+		if(disk)
+			startMetadataTimers();
 		return;
 	}
 
@@ -689,6 +834,29 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		NameIdMapping nimap;
 		nimap.deSerialize(is);
 		correctBlockNodeIds(&nimap, data, m_gamedef);
+
+		// Node timers
+		if(version >= 23)
+			m_node_timers.deSerialize(is);
+		else
+			startMetadataTimers();
+	}
+}
+
+void MapBlock::startMetadataTimers()
+{
+	/*
+		Metadata that has a step() used to be stepped all the time.
+		Blocks from before node timers have no timers for it, so start
+		one for each; they stop by themselves when there is nothing to do.
+	*/
+	std::vector<v3s16> positions = m_node_metadata->getAllKeys();
+	for(std::vector<v3s16>::iterator i = positions.begin();
+			i != positions.end(); i++)
+	{
+		NodeMetadata *meta = m_node_metadata->get(*i);
+		if(meta->stepInterval() > 0)
+			m_node_timers.set(*i, NodeTimer(meta->stepInterval(), 0));
 	}
 }
 
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <jmutex.h>
 #include <jmutexautolock.h>
 #include <exception>
+#include <vector>
 #include "debug.h"
 #include "common_irrlicht.h"
 #include "mapnode.h"
@@ -32,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "voxel.h"
 #include "staticobject.h"
 #include "modifiedstate.h"
+#include "nodetimer.h"
 
 class Map;
 class NodeMetadataList;
@@ -97,6 +99,19 @@ public:
 };
 #endif
 
+/*
+	Palette compressed nodes of a MapBlock; see MapBlock::compressNodes()
+*/
+struct MapBlockCompressedNodes
+{
+	// The distinct nodes of the block
+	std::vector<MapNode> palette;
+	// Bits per index to the palette: 0, 1, 2, 4, 8 or 16
+	u8 bits;
+	// The indices of the nodes, packed from the lowest bits up
+	std::vector<u8> indices;
+};
+
 /*
 	MapBlock itself
 */
@@ -121,12 +136,18 @@ public:
 	{
 		if(data != NULL)
 			delete[] data;
+		if(m_compressed != NULL)
+		{
+			delete m_compressed;
+			m_compressed = NULL;
+		}
 		u32 l = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
 		data = new MapNode[l];
 		for(u32 i=0; i<l; i++){
 			//data[i] = MapNode();
 			data[i] = MapNode(CONTENT_IGNORE);
 		}
+		m_walkable_bits_valid = false;
 		raiseModified(MOD_STATE_WRITE_NEEDED, "reallocate");
 	}
 
@@ -136,7 +157,7 @@ public:
 
 	bool isDummy()
 	{
-		return (data == NULL);
+		return (data == NULL && m_compressed == NULL);
 	}
 	void unDummify()
 	{
@@ -220,7 +241,7 @@ public:
 	{
 		if(m_lighting_expired)
 			return false;
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return true;
 	}
@@ -253,7 +274,7 @@ public:
 	
 	bool isValidPosition(v3s16 p)
 	{
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return (p.X >= 0 && p.X < MAP_BLOCKSIZE
 				&& p.Y >= 0 && p.Y < MAP_BLOCKSIZE
@@ -262,6 +283,7 @@ public:
 
 	MapNode getNode(s16 x, s16 y, s16 z)
 	{
+		decompressIfNeeded();
 		if(data == NULL)
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
@@ -286,12 +308,13 @@ public:
 	
 	void setNode(s16 x, s16 y, s16 z, MapNode & n)
 	{
+		decompressIfNeeded();
 		if(data == NULL)
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		setNodeData(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNode");
 	}
 	
@@ -306,6 +329,7 @@ public:
 
 	MapNode getNodeNoCheck(s16 x, s16 y, s16 z)
 	{
+		decompressIfNeeded();
 		if(data == NULL)
 			throw InvalidPositionException();
 		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
@@ -318,9 +342,10 @@ public:
 	
 	void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
+		decompressIfNeeded();
 		if(data == NULL)
 			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		setNodeData(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
 	}
 	
@@ -430,6 +455,30 @@ public:
 		Serialization
 	*/
 	
+	/*
+		Node data compression, used for client blocks that are out of
+		sight. The nodes are stored as indices to a palette of the
+		distinct nodes of the block, and are decompressed again by
+		any access to them.
+	*/
+	// Does nothing if it wouldn't save memory
+	void compressNodes();
+	bool isCompressed()
+	{
+		return (m_compressed != NULL);
+	}
+	// Memory used by the nodes of the block, in bytes
+	u32 getNodeDataSize();
+
+	/*
+		Whether each node is walkable, one bit per node in the order of
+		the node data, for collision detection. Built when first needed
+		after the content of a node has changed. Returns NULL for dummy
+		blocks. Not thread-safe; threads go through
+		Map::getWalkableBits().
+	*/
+	const u8 * getWalkableBits();
+
 	// These don't write or read version by itself
 	// Set disk to true for on-disk format, false for over-the-network format
 	void serialize(std::ostream &os, u8 version, bool disk);
@@ -444,6 +493,23 @@ private:
 
 	void serialize_pre22(std::ostream &os, u8 version, bool disk);
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
+	// Starts timers for stepped metadata of blocks saved without timers
+	void startMetadataTimers();
+
+	void decompressNodes();
+	void decompressIfNeeded()
+	{
+		if(m_compressed != NULL)
+			decompressNodes();
+	}
+
+	// Sets a node in data, keeping track of content changes
+	void setNodeData(u32 i, MapNode &n)
+	{
+		if(data[i].getContent() != n.getContent())
+			m_walkable_bits_valid = false;
+		data[i] = n;
+	}
 
 	/*
 		Used only internally, because changes can't be tracked
@@ -451,6 +517,7 @@ private:
 
 	MapNode & getNodeRef(s16 x, s16 y, s16 z)
 	{
+		decompressIfNeeded();
 		if(data == NULL)
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
@@ -471,9 +538,13 @@ public:
 #ifndef SERVER // Only on client
 	MapBlockMesh *mesh;
 	//JMutex mesh_mutex;
+	// Which faces can be seen from each other through the block,
+	// see getFaceConnectivity(); updated together with the mesh
+	u32 face_connectivity;
 #endif
 	
 	NodeMetadataList *m_node_metadata;
+	NodeTimerList m_node_timers;
 	StaticObjectList m_static_objects;
 	
 private:
@@ -493,6 +564,12 @@ private:
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
 	MapNode * data;
+	// If not NULL, the nodes are in here and data is NULL
+	MapBlockCompressedNodes *m_compressed;
+
+	// See getWalkableBits(); NULL until first needed
+	u8 *m_walkable_bits;
+	bool m_walkable_bits_valid;
 
 	/*
 		- On the server, this is used for telling whether the
@@ -27,6 +27,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "gamedef.h"
 #include "mesh.h"
 #include "content_mapblock.h"
+#include "shader.h"
 
 /*
 	MeshMakeData
@@ -37,7 +38,11 @@ MeshMakeData::MeshMakeData(IGameDef *gamedef):
 	m_blockpos(-1337,-1337,-1337),
 	m_crack_pos_relative(-1337, -1337, -1337),
 	m_smooth_lighting(false),
-	m_gamedef(gamedef)
+	m_greedy_meshing(false),
+	m_lod(1),
+	m_daynight_shader(NULL),
+	m_gamedef(gamedef),
+	m_cache_hash(0)
 {}
 
 void MeshMakeData::fill(MapBlock *block)
@@ -122,11 +127,34 @@ void MeshMakeData::setCrack(int crack_level, v3s16 crack_pos)
 		m_crack_pos_relative = crack_pos - m_blockpos*MAP_BLOCKSIZE;
 }
 
+bool MeshMakeData::hasCrack()
+{
+	v3s16 p = m_crack_pos_relative;
+	return (p.X >= 0 && p.X < MAP_BLOCKSIZE
+			&& p.Y >= 0 && p.Y < MAP_BLOCKSIZE
+			&& p.Z >= 0 && p.Z < MAP_BLOCKSIZE);
+}
+
 void MeshMakeData::setSmoothLighting(bool smooth_lighting)
 {
 	m_smooth_lighting = smooth_lighting;
 }
 
+void MeshMakeData::setGreedyMeshing(bool greedy_meshing)
+{
+	m_greedy_meshing = greedy_meshing;
+}
+
+void MeshMakeData::setLod(u16 lod)
+{
+	m_lod = lod;
+}
+
+void MeshMakeData::setDayNightShader(DayNightShader *shader)
+{
+	m_daynight_shader = shader;
+}
+
 /*
 	Light and vertex color functions
 */
@@ -450,10 +478,18 @@ static void makeFastFace(TileSpec tile, u16 li0, u16 li1, u16 li2, u16 li3,
 		vertex_pos[i] += pos;
 	}
 
-	f32 abs_scale = 1.;
-	if     (scale.X < 0.999 || scale.X > 1.001) abs_scale = scale.X;
-	else if(scale.Y < 0.999 || scale.Y > 1.001) abs_scale = scale.Y;
-	else if(scale.Z < 0.999 || scale.Z > 1.001) abs_scale = scale.Z;
+	/*
+		Texture scale along the bottom edge (vertices 0 and 1) and the
+		left edge (vertices 1 and 2) of the face
+	*/
+	f32 u_scale = 1.;
+	if     (vertex_dirs[0].X != vertex_dirs[1].X) u_scale = scale.X;
+	else if(vertex_dirs[0].Y != vertex_dirs[1].Y) u_scale = scale.Y;
+	else if(vertex_dirs[0].Z != vertex_dirs[1].Z) u_scale = scale.Z;
+	f32 v_scale = 1.;
+	if     (vertex_dirs[1].X != vertex_dirs[2].X) v_scale = scale.X;
+	else if(vertex_dirs[1].Y != vertex_dirs[2].Y) v_scale = scale.Y;
+	else if(vertex_dirs[1].Z != vertex_dirs[2].Z) v_scale = scale.Z;
 
 	v3f normal(dir.X, dir.Y, dir.Z);
 
@@ -466,16 +502,16 @@ static void makeFastFace(TileSpec tile, u16 li0, u16 li1, u16 li2, u16 li3,
 
 	face.vertices[0] = video::S3DVertex(vertex_pos[0], normal,
 			MapBlock_LightColor(alpha, li0),
-			core::vector2d<f32>(x0+w*abs_scale, y0+h));
+			core::vector2d<f32>(x0+w*u_scale, y0+h*v_scale));
 	face.vertices[1] = video::S3DVertex(vertex_pos[1], normal,
 			MapBlock_LightColor(alpha, li1),
-			core::vector2d<f32>(x0, y0+h));
+			core::vector2d<f32>(x0, y0+h*v_scale));
 	face.vertices[2] = video::S3DVertex(vertex_pos[2], normal,
 			MapBlock_LightColor(alpha, li2),
 			core::vector2d<f32>(x0, y0));
 	face.vertices[3] = video::S3DVertex(vertex_pos[3], normal,
 			MapBlock_LightColor(alpha, li3),
-			core::vector2d<f32>(x0+w*abs_scale, y0));
+			core::vector2d<f32>(x0+w*u_scale, y0));
 
 	face.tile = tile;
 	
@@ -664,10 +700,60 @@ static void getTileInfo(
 	return;
 }
 
+/*
+	Face information of a node position, as returned by getTileInfo()
+*/
+struct FaceInfo
+{
+	bool makes_face;
+	// Set if the face has already been drawn by greedy meshing
+	bool merged;
+	v3s16 p_corrected;
+	v3s16 face_dir_corrected;
+	u16 lights[4];
+	TileSpec tile;
+};
+
+/*
+	Gets the face information of position j of a row, either from
+	infos or by calling getTileInfo()
+*/
+static void getRowTileInfo(
+		// Input:
+		MeshMakeData *data,
+		const FaceInfo *infos,
+		u16 j,
+		v3s16 p,
+		v3s16 face_dir,
+		// Output:
+		bool &makes_face,
+		v3s16 &p_corrected,
+		v3s16 &face_dir_corrected,
+		u16 *lights,
+		TileSpec &tile
+	)
+{
+	if(infos == NULL)
+	{
+		getTileInfo(data, p, face_dir,
+				makes_face, p_corrected, face_dir_corrected,
+				lights, tile);
+		return;
+	}
+	const FaceInfo &info = infos[j];
+	makes_face = info.makes_face && !info.merged;
+	p_corrected = info.p_corrected;
+	face_dir_corrected = info.face_dir_corrected;
+	for(u16 i=0; i<4; i++)
+		lights[i] = info.lights[i];
+	tile = info.tile;
+}
+
 /*
 	startpos:
 	translate_dir: unit vector with only one of x, y or z
 	face_dir: unit vector with only one of x, y or z
+	infos: NULL or precalculated face information of the row
 */
 static void updateFastFaceRow(
 		MeshMakeData *data,
@@ -676,6 +762,7 @@ static void updateFastFaceRow(
 		v3f translate_dir_f,
 		v3s16 face_dir,
 		v3f face_dir_f,
+		const FaceInfo *infos,
 		core::array<FastFace> &dest)
 {
 	v3s16 p = startpos;
@@ -687,7 +774,7 @@ static void updateFastFaceRow(
 	v3s16 face_dir_corrected;
 	u16 lights[4] = {0,0,0,0};
 	TileSpec tile;
-	getTileInfo(data, p, face_dir, 
+	getRowTileInfo(data, infos, 0, p, face_dir,
 			makes_face, p_corrected, face_dir_corrected,
 			lights, tile);
 
@@ -710,7 +797,7 @@ static void updateFastFaceRow(
 		{
 			p_next = p + translate_dir;
 			
-			getTileInfo(data, p_next, face_dir,
+			getRowTileInfo(data, infos, j+1, p_next, face_dir,
 					next_makes_face, next_p_corrected,
 					next_face_dir_corrected, next_lights,
 					next_tile);
@@ -801,9 +888,11 @@ static void updateFastFaceRow(
 						sp, face_dir_corrected, scale,
 						dest);
 				
-				g_profiler->avg("Meshgen: faces drawn by tiling", 0);
+				static ProfilerHandle tiling_handle =
+						g_profiler->getHandle("Meshgen: faces drawn by tiling");
+				g_profiler->avg(tiling_handle, 0);
 				for(int i=1; i<continuous_tiles_count; i++){
-					g_profiler->avg("Meshgen: faces drawn by tiling", 1);
+					g_profiler->avg(tiling_handle, 1);
 				}
 			}
 
@@ -823,53 +912,454 @@ static void updateFastFaceRow(
 	}
 }
 
+/*
+	Whether a face can be merged with others in two dimensions.
+
+	Only faces of opaque cubes with an uniform light are merged. The
+	texture has to repeat over the merged face, so textures that are
+	in the texture atlas are not merged.
+*/
+static bool isGreedyMergeable(MeshMakeData *data, const FaceInfo &info)
+{
+	if(!info.makes_face)
+		return false;
+	const TileSpec &tile = info.tile;
+	if(tile.texture.atlas == NULL || tile.texture.tiled != 0)
+		return false;
+	if(info.lights[1] != info.lights[0]
+			|| info.lights[2] != info.lights[0]
+			|| info.lights[3] != info.lights[0])
+		return false;
+	INodeDefManager *ndef = data->m_gamedef->ndef();
+	v3s16 blockpos_nodes = data->m_blockpos * MAP_BLOCKSIZE;
+	MapNode n = data->m_vmanip.getNodeNoEx(blockpos_nodes + info.p_corrected);
+	const ContentFeatures &f = ndef->get(n);
+	return (f.drawtype == NDT_NORMAL && f.solidness == 2);
+}
+
+static bool canGreedyMerge(const FaceInfo &a, const FaceInfo &b,
+		bool b_mergeable)
+{
+	return (b_mergeable && !b.merged
+			&& b.face_dir_corrected == a.face_dir_corrected
+			&& b.lights[0] == a.lights[0]
+			&& b.tile == a.tile);
+}
+
+/*
+	Gets the face information of a layer of the block and, if greedy
+	meshing is enabled, draws the faces that can be merged as rectangles
+	as large as possible.
+
+	origin: first position of the layer
+	translate_dir: direction of the rows
+	row_dir: direction in which the rows follow each other
+	infos: MAP_BLOCKSIZE*MAP_BLOCKSIZE entries, row by row
+	greedy_faces: incremented by the number of faces merged into rectangles
+*/
+static void updateFastFaceLayer(
+		MeshMakeData *data,
+		v3s16 origin,
+		v3s16 translate_dir,
+		v3s16 row_dir,
+		v3s16 face_dir,
+		FaceInfo *infos,
+		core::array<FastFace> &dest,
+		u32 &greedy_faces)
+{
+	const u16 size = MAP_BLOCKSIZE;
+	bool mergeable[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+
+	for(u16 j=0; j<size; j++)
+	for(u16 i=0; i<size; i++)
+	{
+		FaceInfo &info = infos[j*size + i];
+		v3s16 p = origin + translate_dir * i + row_dir * j;
+		getTileInfo(data, p, face_dir,
+				info.makes_face, info.p_corrected,
+				info.face_dir_corrected, info.lights, info.tile);
+		info.merged = false;
+		mergeable[j*size + i] = isGreedyMergeable(data, info);
+	}
+
+	v3f translate_dir_f(translate_dir.X, translate_dir.Y, translate_dir.Z);
+	v3f row_dir_f(row_dir.X, row_dir.Y, row_dir.Z);
+
+	for(u16 j=0; j<size; j++)
+	for(u16 i=0; i<size; i++)
+	{
+		FaceInfo &info = infos[j*size + i];
+		if(!mergeable[j*size + i] || info.merged)
+			continue;
+
+		// Grow along the row
+		u16 w = 1;
+		while(i + w < size && canGreedyMerge(info,
+				infos[j*size + i + w], mergeable[j*size + i + w]))
+			w++;
+
+		// Grow over the next rows as long as the whole width fits
+		u16 h = 1;
+		while(j + h < size)
+		{
+			bool fits = true;
+			for(u16 k=0; k<w; k++)
+			{
+				u32 index = (j+h)*size + i + k;
+				if(!canGreedyMerge(info, infos[index], mergeable[index]))
+				{
+					fits = false;
+					break;
+				}
+			}
+			if(!fits)
+				break;
+			h++;
+		}
+
+		for(u16 y=0; y<h; y++)
+		for(u16 x=0; x<w; x++)
+			infos[(j+y)*size + i + x].merged = true;
+
+		v3f pf(info.p_corrected.X, info.p_corrected.Y, info.p_corrected.Z);
+		v3f sp = pf + translate_dir_f * ((f32)(w-1) / 2.)
+				+ row_dir_f * ((f32)(h-1) / 2.);
+		v3f scale = v3f(1,1,1) + translate_dir_f * (w-1)
+				+ row_dir_f * (h-1);
+		makeFastFace(info.tile, info.lights[0], info.lights[1],
+				info.lights[2], info.lights[3],
+				sp, info.face_dir_corrected, scale, dest);
+
+		greedy_faces += w*h;
+	}
+}
+
 static void updateAllFastFaceRows(MeshMakeData *data,
 		core::array<FastFace> &dest)
 {
 	/*
-		Go through every y,z and get top(y+) faces in rows of x+
+		For each face direction:
+		layer_dir: direction in which the layers follow each other
+		translate_dir: direction of the rows in a layer
+		row_dir: direction in which the rows follow each other
+		face_dir: direction of the faces
+
+		- top(y+) faces in rows of x+
+		- right(x+) faces in rows of z+
+		- back(z+) faces in rows of x+
 	*/
-	for(s16 y=0; y<MAP_BLOCKSIZE; y++){
-		for(s16 z=0; z<MAP_BLOCKSIZE; z++){
-			updateFastFaceRow(data,
-					v3s16(0,y,z),
-					v3s16(1,0,0), //dir
-					v3f  (1,0,0),
-					v3s16(0,1,0), //face dir
-					v3f  (0,1,0),
-					dest);
+	const v3s16 layer_dirs[3] = {v3s16(0,1,0), v3s16(1,0,0), v3s16(0,0,1)};
+	const v3s16 translate_dirs[3] = {v3s16(1,0,0), v3s16(0,0,1), v3s16(1,0,0)};
+	const v3s16 row_dirs[3] = {v3s16(0,0,1), v3s16(0,1,0), v3s16(0,1,0)};
+
+	FaceInfo infos[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	u32 greedy_faces = 0;
+
+	for(u16 d=0; d<3; d++)
+	{
+		v3s16 face_dir = layer_dirs[d];
+		v3f face_dir_f(face_dir.X, face_dir.Y, face_dir.Z);
+		v3s16 translate_dir = translate_dirs[d];
+		v3f translate_dir_f(translate_dir.X, translate_dir.Y, translate_dir.Z);
+		v3s16 row_dir = row_dirs[d];
+
+		for(s16 l=0; l<MAP_BLOCKSIZE; l++)
+		{
+			v3s16 origin = face_dir * l;
+
+			const FaceInfo *layer_infos = NULL;
+			if(data->m_greedy_meshing)
+			{
+				updateFastFaceLayer(data, origin, translate_dir, row_dir,
+						face_dir, infos, dest, greedy_faces);
+				layer_infos = infos;
+			}
+
+			for(s16 r=0; r<MAP_BLOCKSIZE; r++)
+			{
+				updateFastFaceRow(data,
+						origin + row_dir * r,
+						translate_dir,
+						translate_dir_f,
+						face_dir,
+						face_dir_f,
+						layer_infos ? &layer_infos[r*MAP_BLOCKSIZE] : NULL,
+						dest);
+			}
 		}
 	}
 
-	/*
-		Go through every x,y and get right(x+) faces in rows of z+
-	*/
-	for(s16 x=0; x<MAP_BLOCKSIZE; x++){
-		for(s16 y=0; y<MAP_BLOCKSIZE; y++){
-			updateFastFaceRow(data,
-					v3s16(x,y,0),
-					v3s16(0,0,1), //dir
-					v3f  (0,0,1),
-					v3s16(1,0,0), //face dir
-					v3f  (1,0,0),
-					dest);
+	if(data->m_greedy_meshing)
+	{
+		static ProfilerHandle greedy_handle =
+				g_profiler->getHandle("Meshgen: faces drawn by greedy meshing");
+		g_profiler->avg(greedy_handle, greedy_faces);
+	}
+}
+
+/*
+	Level of detail meshes
+
+	A far away block is drawn as cubes of lod*lod*lod nodes. A cell of
+	the block is filled if at least half of its nodes are cubes or
+	liquid, and it is drawn with the content of its topmost such node.
+*/
+
+enum LodCellState
+{
+	LOD_CELL_EMPTY,
+	LOD_CELL_FILLED,
+	// Mostly not loaded; no faces are drawn towards it
+	LOD_CELL_UNKNOWN
+};
+
+struct LodCell
+{
+	LodCellState state;
+	// Representative node of a filled cell
+	MapNode filled;
+	// Node of the cell through which the faces are lit
+	MapNode empty;
+};
+
+static bool isLodFilling(const ContentFeatures &f)
+{
+	return (f.drawtype == NDT_NORMAL
+			|| f.drawtype == NDT_LIQUID
+			|| f.drawtype == NDT_ALLFACES
+			|| f.drawtype == NDT_ALLFACES_OPTIONAL);
+}
+
+/*
+	cellpos: position of the cell in cells, relative to the block;
+	         may be one cell outside of the block
+*/
+static LodCell getLodCell(MeshMakeData *data, v3s16 cellpos, s16 lod)
+{
+	INodeDefManager *ndef = data->m_gamedef->ndef();
+	v3s16 origin = data->m_blockpos * MAP_BLOCKSIZE + cellpos * lod;
+	s32 volume = (s32)lod * lod * lod;
+	s32 filling_count = 0;
+	s32 unknown_count = 0;
+	bool empty_found = false;
+
+	LodCell cell;
+	cell.state = LOD_CELL_EMPTY;
+	cell.filled = MapNode(CONTENT_IGNORE);
+	cell.empty = MapNode(CONTENT_IGNORE);
+
+	// From the top, so that the representative nodes are the surface
+	for(s16 y=lod-1; y>=0; y--)
+	for(s16 z=0; z<lod; z++)
+	for(s16 x=0; x<lod; x++)
+	{
+		MapNode n = data->m_vmanip.getNodeNoEx(origin + v3s16(x,y,z));
+		if(n.getContent() == CONTENT_IGNORE)
+		{
+			unknown_count++;
+			continue;
+		}
+		if(isLodFilling(ndef->get(n)))
+		{
+			if(filling_count == 0)
+				cell.filled = n;
+			filling_count++;
+		}
+		else if(!empty_found)
+		{
+			cell.empty = n;
+			empty_found = true;
+		}
+	}
+
+	if(unknown_count * 2 > volume)
+		cell.state = LOD_CELL_UNKNOWN;
+	else if(filling_count * 2 >= volume)
+		cell.state = LOD_CELL_FILLED;
+	return cell;
+}
+
+static void updateLodFaces(MeshMakeData *data, core::array<FastFace> &dest)
+{
+	s16 lod = data->m_lod;
+	s16 cells = MAP_BLOCKSIZE / lod;
+	// The cells of the block and one layer of cells around it
+	s16 size = cells + 2;
+	std::vector<LodCell> grid(size * size * size);
+	for(s16 z=-1; z<=cells; z++)
+	for(s16 y=-1; y<=cells; y++)
+	for(s16 x=-1; x<=cells; x++)
+	{
+		grid[((z+1) * size + (y+1)) * size + (x+1)] =
+				getLodCell(data, v3s16(x,y,z), lod);
+	}
+
+	for(s16 z=0; z<cells; z++)
+	for(s16 y=0; y<cells; y++)
+	for(s16 x=0; x<cells; x++)
+	{
+		const LodCell &cell = grid[((z+1) * size + (y+1)) * size + (x+1)];
+		if(cell.state != LOD_CELL_FILLED)
+			continue;
+
+		v3s16 p_cell(x*lod, y*lod, z*lod);
+		v3f center = v3f(p_cell.X, p_cell.Y, p_cell.Z)
+				+ v3f(1,1,1) * ((f32)(lod-1) / 2.);
+
+		for(u16 i=0; i<6; i++)
+		{
+			v3s16 dir = g_6dirs[i];
+			v3s16 np = v3s16(x,y,z) + dir + v3s16(1,1,1);
+			const LodCell &ncell = grid[(np.Z * size + np.Y) * size + np.X];
+			if(ncell.state != LOD_CELL_EMPTY)
+				continue;
+
+			TileSpec tile = getNodeTile(cell.filled, p_cell, dir, data);
+			u16 light = getFaceLight(cell.filled, ncell.empty, dir, data);
+			makeFastFace(tile, light, light, light, light,
+					center, dir, v3f(lod, lod, lod), dest);
+
+			/*
+				A texture in the texture atlas doesn't repeat over the
+				face, so it is stretched instead
+			*/
+			if(tile.texture.tiled != 0)
+			{
+				FastFace &face = dest[dest.size()-1];
+				float x0 = tile.texture.pos.X;
+				float y0 = tile.texture.pos.Y;
+				float w = tile.texture.size.X;
+				float h = tile.texture.size.Y;
+				face.vertices[0].TCoords = core::vector2d<f32>(x0+w, y0+h);
+				face.vertices[1].TCoords = core::vector2d<f32>(x0, y0+h);
+				face.vertices[2].TCoords = core::vector2d<f32>(x0, y0);
+				face.vertices[3].TCoords = core::vector2d<f32>(x0+w, y0);
+			}
 		}
 	}
+}
+
+/*
+	Face connectivity
+*/
+
+u32 getFaceConnectivity(MeshMakeData *data)
+{
+	INodeDefManager *ndef = data->m_gamedef->ndef();
+	v3s16 blockpos_nodes = data->m_blockpos * MAP_BLOCKSIZE;
+	const s32 size = MAP_BLOCKSIZE;
+	const s32 volume = size * size * size;
+
+	// Nodes that can be seen through and haven't been visited yet
+	std::vector<u8> open(volume);
+	s32 open_count = 0;
+	for(s32 z=0; z<size; z++)
+	for(s32 y=0; y<size; y++)
+	for(s32 x=0; x<size; x++)
+	{
+		MapNode n = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x,y,z));
+		const ContentFeatures &f = ndef->get(n);
+		bool opaque = (f.solidness == 2 || f.visual_solidness == 2);
+		open[(z * size + y) * size + x] = opaque ? 0 : 1;
+		if(!opaque)
+			open_count++;
+	}
+	if(open_count == 0)
+		return 0;
+	if(open_count == volume)
+		return FACE_CONNECTIVITY_ALL;
 
 	/*
-		Go through every y,z and get back(z+) faces in rows of x+
+		Flood fill every region of non-opaque nodes and connect all the
+		faces of the block the region touches
 	*/
-	for(s16 z=0; z<MAP_BLOCKSIZE; z++){
-		for(s16 y=0; y<MAP_BLOCKSIZE; y++){
-			updateFastFaceRow(data,
-					v3s16(0,y,z),
-					v3s16(1,0,0), //dir
-					v3f  (1,0,0),
-					v3s16(0,0,1), //face dir
-					v3f  (0,0,1),
-					dest);
+	// Index offsets of the directions of g_6dirs
+	const s32 offsets[6] = {size*size, size, 1, -size*size, -size, -1};
+	u32 connectivity = 0;
+	std::vector<s32> stack;
+	for(s32 i=0; i<volume; i++)
+	{
+		if(!open[i])
+			continue;
+		open[i] = 0;
+		stack.push_back(i);
+		// Bits are indices of g_6dirs
+		u8 faces = 0;
+		while(!stack.empty())
+		{
+			s32 j = stack.back();
+			stack.pop_back();
+			s32 x = j % size;
+			s32 y = (j / size) % size;
+			s32 z = j / (size * size);
+			bool on_face[6] = {
+				z == size-1, y == size-1, x == size-1, z == 0, y == 0, x == 0
+			};
+			for(u8 k=0; k<6; k++)
+			{
+				if(on_face[k])
+				{
+					faces |= 1<<k;
+					continue;
+				}
+				s32 neighbor = j + offsets[k];
+				if(open[neighbor])
+				{
+					open[neighbor] = 0;
+					stack.push_back(neighbor);
+				}
+			}
+		}
+		for(u8 a=0; a<6; a++)
+		for(u8 b=a+1; b<6; b++)
+		{
+			if((faces & (1<<a)) && (faces & (1<<b)))
+				connectivity |= faceConnectivityBit(a, b);
 		}
 	}
+	return connectivity;
+}
+
+/*
+	Mesh hash
+*/
+
+// 64-bit FNV-1a
+static void hashBytes(u64 &hash, const u8 *bytes, u32 count)
+{
+	for(u32 i=0; i<count; i++)
+	{
+		hash ^= bytes[i];
+		hash *= (u64)1099511628211ULL;
+	}
+}
+
+u64 getMeshHash(MeshMakeData *data)
+{
+	u64 hash = (u64)14695981039346656037ULL;
+	v3s16 blockpos_nodes = data->m_blockpos * MAP_BLOCKSIZE;
+	// The nodes that the mesh depends on: the normal meshes look one
+	// node into the neighbors, the LOD ones one cell of lod nodes
+	s16 border = MYMAX(data->m_lod, 1);
+	for(s16 z=-border; z<MAP_BLOCKSIZE+border; z++)
+	for(s16 y=-border; y<MAP_BLOCKSIZE+border; y++)
+	for(s16 x=-border; x<MAP_BLOCKSIZE+border; x++)
+	{
+		MapNode n = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x,y,z));
+		u8 bytes[3] = {n.param0, n.param1, n.param2};
+		hashBytes(hash, bytes, 3);
+	}
+	u8 options[10];
+	writeV3S16(&options[0], data->m_blockpos);
+	options[6] = data->m_smooth_lighting ? 1 : 0;
+	options[7] = data->m_greedy_meshing ? 1 : 0;
+	options[8] = data->m_lod;
+	options[9] = data->m_daynight_shader ? 1 : 0;
+	hashBytes(hash, options, 10);
+	// 0 means not cached
+	if(hash == 0)
+		hash = 1;
+	return hash;
 }
 
 /*
@@ -879,6 +1369,7 @@ static void updateAllFastFaceRows(MeshMakeData *data,
 MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 	m_mesh(new scene::SMesh()),
 	m_gamedef(data->m_gamedef),
+	m_lod(data->m_lod),
 	m_animation_force_timer(0), // force initial animation
 	m_last_crack(-1),
 	m_crack_materials(),
@@ -901,7 +1392,10 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 	{
 		// 4-23ms for MAP_BLOCKSIZE=16  (NOTE: probably outdated)
 		//TimeTaker timer2("updateAllFastFaceRows()");
-		updateAllFastFaceRows(data, fastfaces_new);
+		if(data->m_lod > 1)
+			updateLodFaces(data, fastfaces_new);
+		else
+			updateAllFastFaceRows(data, fastfaces_new);
 	}
 	// End of slow part
 
@@ -949,13 +1443,16 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 		- whatever
 	*/
 
-	mapblock_mesh_generate_special(data, collector);
+	// Far away blocks are drawn without them
+	if(data->m_lod == 1)
+		mapblock_mesh_generate_special(data, collector);
 	
 
 	/*
 		Convert MeshCollector to SMesh
 		Also store animation info
 	*/
+	DayNightShader *shader = data->m_daynight_shader;
 	for(u32 i = 0; i < collector.prebuffers.size(); i++)
 	{
 		PreMeshBuffer &p = collector.prebuffers[i];
@@ -967,23 +1464,24 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 		// - Cracks
 		if(p.tile.material_flags & MATERIAL_FLAG_CRACK)
 		{
-			ITextureSource *tsrc = data->m_gamedef->tsrc();
-			std::string crack_basename = tsrc->getTextureName(p.tile.texture.id);
-			if(p.tile.material_flags & MATERIAL_FLAG_CRACK_OVERLAY)
-				crack_basename += "^[cracko";
-			else
-				crack_basename += "^[crack";
-			m_crack_materials.insert(std::make_pair(i, crack_basename));
+			bool overlay = (p.tile.material_flags & MATERIAL_FLAG_CRACK_OVERLAY);
+			m_crack_materials.insert(std::make_pair(i,
+					std::make_pair(p.tile.texture.id, overlay)));
 		}
 		// - Lighting
-		for(u32 j = 0; j < p.vertices.size(); j++)
+		//   With the shader the vertices keep the day and night light
+		//   and they are blended on the GPU
+		if(shader == NULL)
 		{
-			video::SColor &vc = p.vertices[j].Color;
-			u8 day = vc.getRed();
-			u8 night = vc.getGreen();
-			finalColorBlend(vc, day, night, 1000);
-			if(day != night)
-				m_daynight_diffs[i][j] = std::make_pair(day, night);
+			for(u32 j = 0; j < p.vertices.size(); j++)
+			{
+				video::SColor &vc = p.vertices[j].Color;
+				u8 day = vc.getRed();
+				u8 night = vc.getGreen();
+				finalColorBlend(vc, day, night, 1000);
+				if(day != night)
+					m_daynight_diffs[i][j] = std::make_pair(day, night);
+			}
 		}
 
 
@@ -999,6 +1497,9 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 				= video::EMT_TRANSPARENT_ALPHA_CHANNEL_REF;
 		material.setTexture(0, p.tile.texture.atlas);
 		p.tile.applyMaterialOptions(material);
+		if(shader)
+			material.MaterialType = shader->getMaterialType(
+					material.MaterialType);
 
 		// Create meshbuffer
 
@@ -1015,6 +1516,11 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 				p.indices.pointer(), p.indices.size());
 	}
 
+	u32 vertex_count = 0;
+	for(u32 i = 0; i < collector.prebuffers.size(); i++)
+		vertex_count += collector.prebuffers[i].vertices.size();
+	g_profiler->avg("Meshgen: vertices per block", vertex_count);
+
 	/*
 		Do some stuff to the mesh
 	*/
@@ -1050,6 +1556,37 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 		!m_daynight_diffs.empty();
 }
 
+MapBlockMesh::MapBlockMesh(const MapBlockMesh &other):
+	m_mesh(other.m_mesh),
+	m_gamedef(other.m_gamedef),
+	m_lod(other.m_lod),
+	m_has_animation(other.m_has_animation),
+	m_animation_force_timer(0), // force initial animation
+	m_last_crack(-1),
+	m_crack_materials(other.m_crack_materials),
+	m_last_daynight_ratio((u32) -1),
+	m_daynight_diffs(other.m_daynight_diffs)
+{
+	m_mesh->grab();
+}
+
+u32 MapBlockMesh::getMemoryUsage()
+{
+	u32 memory = sizeof(MapBlockMesh);
+	for(u32 i=0; i<m_mesh->getMeshBufferCount(); i++)
+	{
+		scene::IMeshBuffer *buf = m_mesh->getMeshBuffer(i);
+		memory += buf->getVertexCount() * sizeof(video::S3DVertex)
+				+ buf->getIndexCount() * sizeof(u16);
+	}
+	// A map node per vertex with differing day and night light
+	for(std::map<u32, std::map<u32, std::pair<u8, u8> > >::iterator
+			i = m_daynight_diffs.begin();
+			i != m_daynight_diffs.end(); i++)
+		memory += i->second.size() * 40;
+	return memory;
+}
+
 MapBlockMesh::~MapBlockMesh()
 {
 	m_mesh->drop();
@@ -1069,18 +1606,15 @@ bool MapBlockMesh::animate(bool faraway, float time, int crack, u32 daynight_rat
 	// Cracks
 	if(crack != m_last_crack)
 	{
-		for(std::map<u32, std::string>::iterator
+		ITextureSource *tsrc = m_gamedef->getTextureSource();
+		for(std::map<u32, std::pair<u32, bool> >::iterator
 				i = m_crack_materials.begin();
 				i != m_crack_materials.end(); i++)
 		{
 			scene::IMeshBuffer *buf = m_mesh->getMeshBuffer(i->first);
-			std::string basename = i->second;
-
-			// Create new texture name from original
-			ITextureSource *tsrc = m_gamedef->getTextureSource();
-			std::ostringstream os;
-			os<<basename<<crack;
-			AtlasPointer ap = tsrc->getTexture(os.str());
+			u32 crack_id = tsrc->getCrackTextureId(
+					i->second.first, i->second.second, crack);
+			AtlasPointer ap = tsrc->getTexture(crack_id);
 			buf->getMaterial().setTexture(0, ap.atlas);
 		}
 
@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <map>
 
 class IGameDef;
+class DayNightShader;
 
 /*
 	Mesh making stuff
@@ -40,7 +41,14 @@ struct MeshMakeData
 	v3s16 m_blockpos;
 	v3s16 m_crack_pos_relative;
 	bool m_smooth_lighting;
+	bool m_greedy_meshing;
+	// Size of the cubes the block is drawn with; 1 for full detail
+	u16 m_lod;
+	DayNightShader *m_daynight_shader;
 	IGameDef *m_gamedef;
+	// Key of the mesh in the client's mesh cache, see getMeshHash();
+	// 0 if the mesh is not to be cached
+	u64 m_cache_hash;
 
 	MeshMakeData(IGameDef *gamedef);
 
@@ -59,11 +67,31 @@ struct MeshMakeData
 		Set the (node) position of a crack
 	*/
 	void setCrack(int crack_level, v3s16 crack_pos);
+	// Whether the crack is in this block
+	bool hasCrack();
 
 	/*
 		Enable or disable smooth lighting
 	*/
 	void setSmoothLighting(bool smooth_lighting);
+
+	/*
+		Enable or disable merging the faces of opaque cubes into
+		rectangles instead of rows
+	*/
+	void setGreedyMeshing(bool greedy_meshing);
+
+	/*
+		Set the level of detail: the block is drawn as cubes of
+		lod*lod*lod nodes. Must divide MAP_BLOCKSIZE.
+	*/
+	void setLod(u16 lod);
+
+	/*
+		Set the shader that blends day and night light, or NULL to
+		blend them on the CPU in MapBlockMesh::animate()
+	*/
+	void setDayNightShader(DayNightShader *shader);
 };
 
 /*
@@ -82,6 +110,8 @@ class MapBlockMesh
 public:
 	// Builds the mesh given
 	MapBlockMesh(MeshMakeData *data);
+	// Shares the geometry of other; the animation starts over
+	MapBlockMesh(const MapBlockMesh &other);
 	~MapBlockMesh();
 
 	// Main animation function, parameters:
@@ -92,11 +122,26 @@ public:
 	// Returns true if anything has been changed.
 	bool animate(bool faraway, float time, int crack, u32 daynight_ratio);
 
+	// Whether animate() may change the mesh
+	bool hasAnimation()
+	{
+		return m_has_animation;
+	}
+
 	scene::SMesh* getMesh()
 	{
 		return m_mesh;
 	}
 
+	// Level of detail the mesh was built with
+	u16 getLod() const
+	{
+		return m_lod;
+	}
+
+	// Approximate memory used by the geometry and the animation info
+	u32 getMemoryUsage();
+
 	bool isAnimationForced() const
 	{
 		return m_animation_force_timer == 0;
@@ -111,6 +156,7 @@ public:
 private:
 	scene::SMesh *m_mesh;
 	IGameDef *m_gamedef;
+	u16 m_lod;
 
 	// Must animate() be called before rendering?
 	bool m_has_animation;
@@ -119,8 +165,9 @@ private:
 	// Animation info: cracks
 	// Last crack value passed to animate()
 	int m_last_crack;
-	// Maps mesh buffer (i.e. material) indices to base texture names
-	std::map<u32, std::string> m_crack_materials;
+	// Maps mesh buffer (i.e. material) indices to base texture ids
+	// and whether the crack is drawn as an overlay
+	std::map<u32, std::pair<u32, bool> > m_crack_materials;
 
 	// Animation info: day/night transitions
 	// Last daynight_ratio value passed to animate()
@@ -159,6 +206,34 @@ inline video::SColor MapBlock_LightColor(u8 alpha, u16 light)
 	return video::SColor(alpha, (light & 0xff), (light >> 8), 0);
 }
 
+/*
+	Face connectivity of a block.
+
+	Bit faceConnectivityBit(a, b) is set if face b of the block can be
+	seen from face a through the non-opaque nodes of the block. Face
+	indices are those of g_6dirs.
+*/
+#define FACE_CONNECTIVITY_ALL 0xffffffff
+
+inline u32 faceConnectivityBit(u8 a, u8 b)
+{
+	if(a > b)
+		return 1 << (b * 6 + a);
+	return 1 << (a * 6 + b);
+}
+
+// Computes the face connectivity of the block of data
+u32 getFaceConnectivity(MeshMakeData *data);
+
+/*
+	Hash of everything the mesh of the block of data is made of: the
+	nodes of the block and of a border around it (one node, or lod
+	nodes for the LOD meshes), the position and the meshing options.
+	Meshes with a crack are not to be cached, as the crack position is
+	not included.
+*/
+u64 getMeshHash(MeshMakeData *data);
+
 // Compute light at node
 u16 getInteriorLight(MapNode n, s32 increment, MeshMakeData *data);
 u16 getFaceLight(MapNode n, MapNode n2, v3s16 face_dir, MeshMakeData *data);
@@ -86,6 +86,14 @@ MapBlock * MapSector::getBlockNoCreateNoEx(s16 y)
 	return getBlockBuffered(y);
 }
 
+MapBlock * MapSector::getBlockNoCreateNoCache(s16 y)
+{
+	core::map<s16, MapBlock*>::Node *n = m_blocks.find(y);
+	if(n == NULL)
+		return NULL;
+	return n->getValue();
+}
+
 MapBlock * MapSector::createBlankBlockNoInsert(s16 y)
 {
 	assert(getBlockBuffered(y) == NULL);
@@ -57,6 +57,8 @@ public:
 	}
 
 	MapBlock * getBlockNoCreateNoEx(s16 y);
+	// Doesn't use or update the block cache
+	MapBlock * getBlockNoCreateNoCache(s16 y);
 	MapBlock * createBlankBlockNoInsert(s16 y);
 	MapBlock * createBlankBlock(s16 y);
 
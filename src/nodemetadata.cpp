@@ -248,19 +248,15 @@ void NodeMetadataList::set(v3s16 p, NodeMetadata *d)
 	m_data.insert(p, d);
 }
 
-bool NodeMetadataList::step(float dtime)
+std::vector<v3s16> NodeMetadataList::getAllKeys()
 {
-	bool something_changed = false;
+	std::vector<v3s16> keys;
 	for(core::map<v3s16, NodeMetadata*>::Iterator
 			i = m_data.getIterator();
 			i.atEnd()==false; i++)
 	{
-		v3s16 p = i.getNode()->getKey();
-		NodeMetadata *meta = i.getNode()->getValue();
-		bool changed = meta->step(dtime);
-		if(changed)
-			something_changed = true;
+		keys.push_back(i.getNode()->getKey());
 	}
-	return something_changed;
+	return keys;
 }
 
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes.h"
 #include <string>
 #include <iostream>
+#include <vector>
 
 /*
 	NodeMetadata stores arbitary amounts of data for special blocks.
@@ -64,7 +65,11 @@ public:
 	virtual void inventoryModified(){}
 
 	// A step in time. Shall return true if metadata changed.
+	// Called by a node timer, which is kept running as long as this
+	// returns true and is restarted by inventory changes.
 	virtual bool step(float dtime) {return false;}
+	// Interval of step() calls; 0 = step() does nothing
+	virtual float stepInterval() {return 0;}
 
 	// Whether the related node and this metadata cannot be removed
 	virtual bool nodeRemovalDisabled(){return false;}
@@ -128,9 +133,8 @@ public:
 	void remove(v3s16 p);
 	// Deletes old data and sets a new one
 	void set(v3s16 p, NodeMetadata *d);
-	
-	// A step in time. Returns true if something changed.
-	bool step(float dtime);
+	// Get all positions that have metadata
+	std::vector<v3s16> getAllKeys();
 
 private:
 	core::map<v3s16, NodeMetadata*> m_data;
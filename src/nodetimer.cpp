@@ -0,0 +1,143 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "nodetimer.h"
+#include "utility.h"
+#include "log.h"
+#include "constants.h" // MAP_BLOCKSIZE
+
+/*
+	NodeTimerList
+*/
+
+void NodeTimerList::serialize(std::ostream &os) const
+{
+	/*
+		Version 1:
+		u16 count
+		for each timer:
+			u16 position (z*16*16 + y*16 + x)
+			s32 timeout*1000
+			s32 elapsed*1000
+	*/
+	writeU8(os, 1); // version
+	writeU16(os, m_timers.size());
+	for(std::map<v3s16, Entry>::const_iterator
+			i = m_timers.begin(); i != m_timers.end(); i++)
+	{
+		v3s16 p = i->first;
+		const Entry &e = i->second;
+		u16 p16 = p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X;
+		writeU16(os, p16);
+		writeF1000(os, e.timeout);
+		writeF1000(os, m_time - e.start_time);
+	}
+}
+
+void NodeTimerList::deSerialize(std::istream &is)
+{
+	clear();
+
+	u8 version = readU8(is);
+	if(version != 1)
+		throw SerializationError("NodeTimerList::deSerialize: "
+				"unsupported version");
+
+	u16 count = readU16(is);
+	for(u16 i=0; i<count; i++)
+	{
+		u16 p16 = readU16(is);
+		v3s16 p(0,0,0);
+		p.Z += p16 / MAP_BLOCKSIZE / MAP_BLOCKSIZE;
+		p16 -= p.Z * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+		p.Y += p16 / MAP_BLOCKSIZE;
+		p16 -= p.Y * MAP_BLOCKSIZE;
+		p.X += p16;
+
+		NodeTimer t;
+		t.timeout = readF1000(is);
+		t.elapsed = readF1000(is);
+
+		if(!t.isStarted())
+			continue;
+		if(m_timers.find(p) != m_timers.end())
+		{
+			infostream<<"WARNING: NodeTimerList::deSerialize(): "
+					<<"already set data at position"
+					<<"("<<p.X<<","<<p.Y<<","<<p.Z<<"): Ignoring."
+					<<std::endl;
+			continue;
+		}
+		set(p, t);
+	}
+}
+
+NodeTimer NodeTimerList::get(v3s16 p) const
+{
+	std::map<v3s16, Entry>::const_iterator i = m_timers.find(p);
+	if(i == m_timers.end())
+		return NodeTimer();
+	const Entry &e = i->second;
+	return NodeTimer(e.timeout, m_time - e.start_time);
+}
+
+void NodeTimerList::remove(v3s16 p)
+{
+	std::map<v3s16, Entry>::iterator i = m_timers.find(p);
+	if(i == m_timers.end())
+		return;
+	m_due.erase(i->second.due);
+	m_timers.erase(i);
+}
+
+void NodeTimerList::set(v3s16 p, const NodeTimer &t)
+{
+	remove(p);
+	if(!t.isStarted())
+		return;
+	Entry e;
+	e.timeout = t.timeout;
+	e.start_time = m_time - t.elapsed;
+	e.due = m_due.insert(std::make_pair(e.start_time + t.timeout, p));
+	m_timers[p] = e;
+}
+
+void NodeTimerList::clear()
+{
+	m_due.clear();
+	m_timers.clear();
+}
+
+void NodeTimerList::step(f32 dtime,
+		std::vector<std::pair<v3s16, NodeTimer> > &expired)
+{
+	m_time += dtime;
+	while(!m_due.empty() && m_due.begin()->first <= m_time)
+	{
+		v3s16 p = m_due.begin()->second;
+		std::map<v3s16, Entry>::iterator i = m_timers.find(p);
+		assert(i != m_timers.end());
+		const Entry &e = i->second;
+		expired.push_back(std::make_pair(p,
+				NodeTimer(e.timeout, m_time - e.start_time)));
+		m_timers.erase(i);
+		m_due.erase(m_due.begin());
+	}
+}
+
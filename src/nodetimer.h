@@ -0,0 +1,99 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef NODETIMER_HEADER
+#define NODETIMER_HEADER
+
+#include "irrlichttypes.h"
+#include <iostream>
+#include <map>
+#include <vector>
+
+/*
+	NodeTimer provides per-node timed callback functionality.
+	Can be used for:
+	- Furnaces, to keep the fire burning
+	- "activated" nodes, like a mesecon circuit that switches off
+	  after a while
+*/
+
+class NodeTimer
+{
+public:
+	NodeTimer(): timeout(0.), elapsed(0.) {}
+	NodeTimer(f32 timeout_, f32 elapsed_):
+		timeout(timeout_), elapsed(elapsed_) {}
+
+	// A timer with a timeout of 0 is not started
+	bool isStarted() const { return timeout > 0.001; }
+
+	f32 timeout;
+	f32 elapsed;
+};
+
+/*
+	List of the node timers of a block.
+
+	The timers are kept in order of the time they are due, so stepping
+	the list only costs something for the timers that actually expire.
+*/
+
+class NodeTimerList
+{
+public:
+	NodeTimerList(): m_time(0) {}
+	~NodeTimerList() {}
+
+	void serialize(std::ostream &os) const;
+	void deSerialize(std::istream &is);
+
+	// Returns a timer with a timeout of 0 if there is none at p
+	NodeTimer get(v3s16 p) const;
+	// Deletes the timer
+	void remove(v3s16 p);
+	// Replaces an old timer
+	void set(v3s16 p, const NodeTimer &t);
+	void clear();
+	u32 size() const { return m_timers.size(); }
+
+	/*
+		Advances time by dtime. The timers that are due are removed
+		from the list and returned in expired, with elapsed set to the
+		time since they were started.
+	*/
+	void step(f32 dtime, std::vector<std::pair<v3s16, NodeTimer> > &expired);
+
+private:
+	struct Entry
+	{
+		f32 timeout;
+		// Time of m_time at which the timer was started
+		f64 start_time;
+		std::multimap<f64, v3s16>::iterator due;
+	};
+
+	// Current time of this list; only ever increases
+	f64 m_time;
+	// Positions by the time of m_time at which their timer is due
+	std::multimap<f64, v3s16> m_due;
+	std::map<v3s16, Entry> m_timers;
+};
+
+#endif
+
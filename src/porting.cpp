@@ -120,6 +120,22 @@ void signal_handler_init(void)
 
 #endif
 
+u32 getNumberOfProcessors()
+{
+#ifdef _WIN32
+	SYSTEM_INFO sysinfo;
+	GetSystemInfo(&sysinfo);
+	return sysinfo.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1)
+		return 1;
+	return n;
+#else
+	return 1;
+#endif
+}
+
 /*
 	Path mangler
 */
@@ -80,6 +80,11 @@ std::string getDataPath(const char *subpath);
 */
 void initializePaths();
 
+/*
+	Number of processors available to the process; 1 if unknown.
+*/
+u32 getNumberOfProcessors();
+
 /*
 	Resolution is 10-20ms.
 	Remember to check for overflows.
@@ -91,6 +96,18 @@ void initializePaths();
 	{
 		return GetTickCount();
 	}
+	/*
+		A microsecond counter for measuring short durations; wraps
+		around every 71 minutes, so only differences are meaningful.
+	*/
+	inline u32 getTimeUs()
+	{
+		LARGE_INTEGER freq, t;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&t);
+		return (u32)((t.QuadPart / freq.QuadPart) * 1000000 +
+				(t.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+	}
 #else // Posix
 	#include <sys/time.h>
 	inline u32 getTimeMs()
@@ -99,6 +116,12 @@ void initializePaths();
 		gettimeofday(&tv, NULL);
 		return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 	}
+	inline u32 getTimeUs()
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * 1000000 + tv.tv_usec;
+	}
 	/*#include <sys/timeb.h>
 	inline u32 getTimeMs()
 	{
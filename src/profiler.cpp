@@ -0,0 +1,649 @@
+/*
+Minetest-c55
+Copyright (C) 2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "profiler.h"
+#include <algorithm>
+#include <cmath>
+
+// Number of slow steps kept
+#define PROFILER_SLOW_STEPS 32
+
+/*
+	TimeHistogram
+*/
+
+static u32 histogramBucket(u32 us)
+{
+	if(us < 16)
+		return us;
+	// Shift the value to 16...31; the shift selects the power of two
+	// and the rest of the value the bucket in it
+	u32 shift = 0;
+	while((us >> shift) >= 32)
+		shift++;
+	return 16 + shift * 16 + ((us >> shift) - 16);
+}
+
+static u32 histogramBucketUpperBound(u32 index)
+{
+	if(index < 16)
+		return index;
+	u32 shift = (index - 16) / 16;
+	u32 sub = (index - 16) % 16;
+	return ((17 + sub) << shift) - 1;
+}
+
+void TimeHistogram::clear()
+{
+	for(u32 i=0; i<BUCKET_COUNT; i++)
+		m_buckets[i] = 0;
+	m_count = 0;
+	m_max = 0;
+	m_sum = 0;
+}
+
+void TimeHistogram::add(u32 us)
+{
+	m_buckets[histogramBucket(us)]++;
+	m_count++;
+	if(us > m_max)
+		m_max = us;
+	m_sum += us;
+}
+
+void TimeHistogram::merge(const TimeHistogram &other)
+{
+	for(u32 i=0; i<BUCKET_COUNT; i++)
+		m_buckets[i] += other.m_buckets[i];
+	m_count += other.m_count;
+	if(other.m_max > m_max)
+		m_max = other.m_max;
+	m_sum += other.m_sum;
+}
+
+u32 TimeHistogram::percentile(float p) const
+{
+	if(m_count == 0)
+		return 0;
+	// Number of values at or below the percentile
+	u32 wanted = (u32)ceil(p * m_count);
+	if(wanted == 0)
+		wanted = 1;
+	u32 seen = 0;
+	for(u32 i=0; i<BUCKET_COUNT; i++)
+	{
+		seen += m_buckets[i];
+		if(seen >= wanted)
+			return MYMIN(histogramBucketUpperBound(i), m_max);
+	}
+	return m_max;
+}
+
+/*
+	Per-thread counters
+*/
+
+struct ProfilerCounter
+{
+	ProfilerCounter():
+		value(0),
+		avgcount(0),
+		seen(false),
+		graph_value(0),
+		graph_seen(false),
+		histogram(NULL),
+		step_us(0),
+		in_step(false)
+	{}
+
+	float value;
+	// 0 if nothing since clear(), -2 if add() is used, otherwise the
+	// number of avg() calls
+	int avgcount;
+	bool seen;
+	float graph_value;
+	bool graph_seen;
+	// Created when the first duration is recorded
+	TimeHistogram *histogram;
+	// Time in the current step of the thread
+	u32 step_us;
+	bool in_step;
+};
+
+struct ProfilerThreadData
+{
+	ProfilerThreadData(threadid_t thread_):
+		thread(thread_),
+		step_running(false),
+		step_start_us(0)
+	{
+		mutex.Init();
+	}
+	~ProfilerThreadData()
+	{
+		for(u32 i=0; i<counters.size(); i++)
+			delete counters[i].histogram;
+	}
+
+	ProfilerCounter& getCounter(ProfilerHandle h)
+	{
+		if(h >= counters.size())
+			counters.resize(h + 1);
+		return counters[h];
+	}
+
+	/*
+		Only the owning thread changes the counters. It locks the mutex
+		while doing so, which only ever waits when the counters are
+		being read.
+	*/
+	JMutex mutex;
+	threadid_t thread;
+	std::vector<ProfilerCounter> counters;
+	// Used only by the owning thread
+	std::map<std::string, ProfilerHandle> handles;
+	bool step_running;
+	u32 step_start_us;
+	std::vector<ProfilerHandle> step_handles;
+};
+
+/*
+	Identifiers of the profilers; 0 is none. Profilers can be created
+	in any thread, and g_profiler already during static initialization,
+	so the counter and its mutex are set up on first use.
+*/
+struct ProfilerIdAllocator
+{
+	JMutex mutex;
+	u32 next_id;
+
+	ProfilerIdAllocator():
+		next_id(1)
+	{
+		mutex.Init();
+	}
+};
+
+static u32 allocateProfilerId()
+{
+	static ProfilerIdAllocator allocator;
+	JMutexAutoLock lock(allocator.mutex);
+	return allocator.next_id++;
+}
+
+// The counters of the current thread in the profiler that used them last
+static THREAD_LOCAL u32 t_profiler_id = 0;
+static THREAD_LOCAL ProfilerThreadData *t_thread_data = NULL;
+
+// Prints a name followed by a dashed line up to the value column
+static void printName(std::ostream &o, const std::string &name)
+{
+	o<<"  "<<name<<": ";
+	s32 clampsize = 40;
+	s32 space = clampsize - name.size();
+	for(s32 j=0; j<space; j++)
+	{
+		if(j%2 == 0 && j < space - 1)
+			o<<"-";
+		else
+			o<<" ";
+	}
+}
+
+/*
+	Profiler
+*/
+
+Profiler::Profiler():
+	m_id(allocateProfilerId()),
+	m_slow_steps_next(0)
+{
+	m_mutex.Init();
+	m_step_handle = getHandle("Server: step");
+}
+
+Profiler::~Profiler()
+{
+	for(u32 i=0; i<m_threads.size(); i++)
+		delete m_threads[i];
+}
+
+ProfilerThreadData* Profiler::getThreadData()
+{
+	if(t_profiler_id == m_id)
+		return t_thread_data;
+
+	JMutexAutoLock lock(m_mutex);
+	threadid_t thread = get_current_thread_id();
+	ProfilerThreadData *data = NULL;
+	// A new thread may get the id of one that has ended; the counters
+	// of the old one are simply continued
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		if(m_threads[i]->thread == thread)
+		{
+			data = m_threads[i];
+			break;
+		}
+	}
+	if(data == NULL)
+	{
+		data = new ProfilerThreadData(thread);
+		m_threads.push_back(data);
+	}
+	t_profiler_id = m_id;
+	t_thread_data = data;
+	return data;
+}
+
+ProfilerHandle Profiler::getHandle(const std::string &name)
+{
+	ProfilerThreadData *data = getThreadData();
+	std::map<std::string, ProfilerHandle>::iterator i =
+			data->handles.find(name);
+	if(i != data->handles.end())
+		return i->second;
+
+	ProfilerHandle h;
+	{
+		JMutexAutoLock lock(m_mutex);
+		std::map<std::string, ProfilerHandle>::iterator n =
+				m_handles.find(name);
+		if(n != m_handles.end())
+		{
+			h = n->second;
+		}
+		else
+		{
+			h = m_names.size();
+			m_names.push_back(name);
+			m_handles[name] = h;
+		}
+	}
+	data->handles[name] = h;
+	return h;
+}
+
+void Profiler::add(ProfilerHandle h, float value)
+{
+	ProfilerThreadData *data = getThreadData();
+	JMutexAutoLock lock(data->mutex);
+	ProfilerCounter &c = data->getCounter(h);
+	/* No average shall have been used; mark add used as -2 */
+	if(c.avgcount == 0 || c.avgcount == -1)
+		c.avgcount = -2;
+	assert(c.avgcount == -2);
+	c.value += value;
+	c.seen = true;
+}
+
+void Profiler::avg(ProfilerHandle h, float value)
+{
+	ProfilerThreadData *data = getThreadData();
+	JMutexAutoLock lock(data->mutex);
+	ProfilerCounter &c = data->getCounter(h);
+	/* No add shall have been used */
+	assert(c.avgcount != -2);
+	if(c.avgcount <= 0)
+		c.avgcount = 1;
+	else
+		c.avgcount++;
+	c.value += value;
+	c.seen = true;
+}
+
+void Profiler::graphAdd(ProfilerHandle h, float value)
+{
+	ProfilerThreadData *data = getThreadData();
+	JMutexAutoLock lock(data->mutex);
+	ProfilerCounter &c = data->getCounter(h);
+	c.graph_value += value;
+	c.graph_seen = true;
+}
+
+void Profiler::record(ProfilerHandle h, u32 duration_us)
+{
+	ProfilerThreadData *data = getThreadData();
+	JMutexAutoLock lock(data->mutex);
+	ProfilerCounter &c = data->getCounter(h);
+	if(c.histogram == NULL)
+		c.histogram = new TimeHistogram();
+	c.histogram->add(duration_us);
+	if(data->step_running)
+	{
+		c.step_us += duration_us;
+		if(!c.in_step)
+		{
+			c.in_step = true;
+			data->step_handles.push_back(h);
+		}
+	}
+}
+
+void Profiler::clear()
+{
+	JMutexAutoLock lock(m_mutex);
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		ProfilerThreadData *data = m_threads[i];
+		JMutexAutoLock lock2(data->mutex);
+		for(u32 j=0; j<data->counters.size(); j++)
+		{
+			data->counters[j].value = 0;
+			data->counters[j].avgcount = 0;
+		}
+	}
+}
+
+void Profiler::printPage(std::ostream &o, u32 page, u32 pagecount)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	// Sum up the threads
+	std::vector<float> values(m_names.size(), 0);
+	std::vector<int> avgcounts(m_names.size(), 0);
+	std::vector<bool> seen(m_names.size(), false);
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		ProfilerThreadData *data = m_threads[i];
+		JMutexAutoLock lock2(data->mutex);
+		for(u32 j=0; j<data->counters.size(); j++)
+		{
+			const ProfilerCounter &c = data->counters[j];
+			if(!c.seen)
+				continue;
+			seen[j] = true;
+			values[j] += c.value;
+			if(c.avgcount >= 1)
+				avgcounts[j] += c.avgcount;
+		}
+	}
+	std::map<std::string, float> data;
+	for(u32 j=0; j<m_names.size(); j++)
+	{
+		if(seen[j])
+			data[m_names[j]] = values[j] / MYMAX(avgcounts[j], 1);
+	}
+
+	u32 minindex, maxindex;
+	paging(data.size(), page, pagecount, minindex, maxindex);
+
+	for(std::map<std::string, float>::iterator
+			i = data.begin(); i != data.end(); i++)
+	{
+		if(maxindex == 0)
+			break;
+		maxindex--;
+
+		if(minindex != 0)
+		{
+			minindex--;
+			continue;
+		}
+
+		printName(o, i->first);
+		o<<i->second;
+		o<<std::endl;
+	}
+}
+
+void printCounts(std::ostream &o, const std::map<std::string, u32> &counts)
+{
+	for(std::map<std::string, u32>::const_iterator
+			i = counts.begin(); i != counts.end(); i++)
+	{
+		printName(o, i->first);
+		o<<i->second;
+		o<<std::endl;
+	}
+}
+
+void Profiler::graphGet(GraphValues &result)
+{
+	JMutexAutoLock lock(m_mutex);
+	result.clear();
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		ProfilerThreadData *data = m_threads[i];
+		JMutexAutoLock lock2(data->mutex);
+		for(u32 j=0; j<data->counters.size(); j++)
+		{
+			ProfilerCounter &c = data->counters[j];
+			if(!c.graph_seen)
+				continue;
+			result[m_names[j]] += c.graph_value;
+			c.graph_value = 0;
+			c.graph_seen = false;
+		}
+	}
+}
+
+void Profiler::stepBegin()
+{
+	ProfilerThreadData *data = getThreadData();
+	JMutexAutoLock lock(data->mutex);
+	for(u32 i=0; i<data->step_handles.size(); i++)
+	{
+		ProfilerCounter &c = data->counters[data->step_handles[i]];
+		c.step_us = 0;
+		c.in_step = false;
+	}
+	data->step_handles.clear();
+	data->step_running = true;
+	data->step_start_us = porting::getTimeUs();
+}
+
+static bool slowerSection(const std::pair<std::string, u32> &a,
+		const std::pair<std::string, u32> &b)
+{
+	return a.second > b.second;
+}
+
+void Profiler::stepEnd(u32 slow_threshold_us)
+{
+	ProfilerThreadData *data = getThreadData();
+	u32 duration_us;
+	std::vector<std::pair<ProfilerHandle, u32> > sections;
+	{
+		JMutexAutoLock lock(data->mutex);
+		if(!data->step_running)
+			return;
+		data->step_running = false;
+		duration_us = porting::getTimeUs() - data->step_start_us;
+		for(u32 i=0; i<data->step_handles.size(); i++)
+		{
+			ProfilerHandle h = data->step_handles[i];
+			ProfilerCounter &c = data->counters[h];
+			sections.push_back(std::make_pair(h, c.step_us));
+			c.step_us = 0;
+			c.in_step = false;
+		}
+		data->step_handles.clear();
+	}
+	record(m_step_handle, duration_us);
+	if(slow_threshold_us == 0 || duration_us < slow_threshold_us)
+		return;
+
+	// The thread's mutex is not held here; see the order in the header
+	JMutexAutoLock lock(m_mutex);
+	ProfilerSlowStep step;
+	step.time = time(NULL);
+	step.duration_us = duration_us;
+	for(u32 i=0; i<sections.size(); i++)
+	{
+		step.sections.push_back(std::make_pair(
+				m_names[sections[i].first], sections[i].second));
+	}
+	std::stable_sort(step.sections.begin(), step.sections.end(),
+			slowerSection);
+
+	if(m_slow_steps.size() < PROFILER_SLOW_STEPS)
+		m_slow_steps.push_back(step);
+	else
+		m_slow_steps[m_slow_steps_next] = step;
+	m_slow_steps_next = (m_slow_steps_next + 1) % PROFILER_SLOW_STEPS;
+}
+
+void Profiler::mergeHistograms(std::map<std::string, TimeHistogram> &result)
+{
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		ProfilerThreadData *data = m_threads[i];
+		JMutexAutoLock lock(data->mutex);
+		for(u32 j=0; j<data->counters.size(); j++)
+		{
+			const TimeHistogram *h = data->counters[j].histogram;
+			if(h == NULL || h->getCount() == 0)
+				continue;
+			result[m_names[j]].merge(*h);
+		}
+	}
+}
+
+void Profiler::printHistograms(std::ostream &o)
+{
+	JMutexAutoLock lock(m_mutex);
+	std::map<std::string, TimeHistogram> histograms;
+	mergeHistograms(histograms);
+	for(std::map<std::string, TimeHistogram>::iterator
+			i = histograms.begin(); i != histograms.end(); i++)
+	{
+		const TimeHistogram &h = i->second;
+		printName(o, i->first);
+		o<<"p50="<<(h.percentile(0.5) / 1000.0)<<"ms"
+				<<" p99="<<(h.percentile(0.99) / 1000.0)<<"ms"
+				<<" max="<<(h.getMax() / 1000.0)<<"ms"
+				<<" n="<<h.getCount()<<std::endl;
+	}
+}
+
+void Profiler::printSlowSteps(std::ostream &o, u32 max_steps,
+		u32 max_sections)
+{
+	JMutexAutoLock lock(m_mutex);
+	u32 count = MYMIN(max_steps, m_slow_steps.size());
+	// Newest first
+	for(u32 k=0; k<count; k++)
+	{
+		u32 i = (m_slow_steps_next + m_slow_steps.size() - 1 - k)
+				% m_slow_steps.size();
+		const ProfilerSlowStep &step = m_slow_steps[i];
+		char cs[20];
+		strftime(cs, 20, "%H:%M:%S", localtime(&step.time));
+		o<<"["<<cs<<"] "<<(step.duration_us / 1000)<<"ms:";
+		for(u32 j=0; j<step.sections.size() && j<max_sections; j++)
+		{
+			o<<(j == 0 ? " " : ", ")<<step.sections[j].first<<" "
+					<<(step.sections[j].second / 1000)<<"ms";
+		}
+		o<<std::endl;
+	}
+}
+
+static std::string jsonString(const std::string &s)
+{
+	std::string r = "\"";
+	for(u32 i=0; i<s.size(); i++)
+	{
+		if(s[i] == '"' || s[i] == '\\')
+			r += '\\';
+		r += s[i];
+	}
+	return r + "\"";
+}
+
+void Profiler::writeJson(std::ostream &o)
+{
+	JMutexAutoLock lock(m_mutex);
+	std::map<std::string, TimeHistogram> histograms;
+	mergeHistograms(histograms);
+
+	o<<"{\n\t\"time\": "<<(u32)time(NULL)<<",\n";
+
+	o<<"\t\"sections\": {";
+	for(std::map<std::string, TimeHistogram>::iterator
+			i = histograms.begin(); i != histograms.end(); i++)
+	{
+		const TimeHistogram &h = i->second;
+		o<<(i == histograms.begin() ? "\n" : ",\n");
+		o<<"\t\t"<<jsonString(i->first)<<": {"
+				<<"\"count\": "<<h.getCount()
+				<<", \"avg_us\": "<<h.getAverage()
+				<<", \"p50_us\": "<<h.percentile(0.5)
+				<<", \"p99_us\": "<<h.percentile(0.99)
+				<<", \"max_us\": "<<h.getMax()<<"}";
+	}
+	o<<"\n\t},\n";
+
+	// Oldest first
+	o<<"\t\"slow_steps\": [";
+	for(u32 k=0; k<m_slow_steps.size(); k++)
+	{
+		u32 i = (m_slow_steps_next + k) % m_slow_steps.size();
+		const ProfilerSlowStep &step = m_slow_steps[i];
+		o<<(k == 0 ? "\n" : ",\n");
+		o<<"\t\t{\"time\": "<<(u32)step.time
+				<<", \"duration_us\": "<<step.duration_us
+				<<", \"sections\": [";
+		for(u32 j=0; j<step.sections.size(); j++)
+		{
+			o<<(j == 0 ? "" : ", ")<<"["
+					<<jsonString(step.sections[j].first)<<", "
+					<<step.sections[j].second<<"]";
+		}
+		o<<"]}";
+	}
+	o<<"\n\t]\n}\n";
+}
+
+void Profiler::clearHistograms()
+{
+	JMutexAutoLock lock(m_mutex);
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		ProfilerThreadData *data = m_threads[i];
+		JMutexAutoLock lock2(data->mutex);
+		for(u32 j=0; j<data->counters.size(); j++)
+		{
+			if(data->counters[j].histogram)
+				data->counters[j].histogram->clear();
+		}
+	}
+	m_slow_steps.clear();
+	m_slow_steps_next = 0;
+}
+
+bool Profiler::getHistogram(const std::string &name, TimeHistogram &result)
+{
+	JMutexAutoLock lock(m_mutex);
+	std::map<std::string, ProfilerHandle>::iterator n = m_handles.find(name);
+	if(n == m_handles.end())
+		return false;
+	ProfilerHandle h = n->second;
+	result.clear();
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		ProfilerThreadData *data = m_threads[i];
+		JMutexAutoLock lock2(data->mutex);
+		if(h < data->counters.size() && data->counters[h].histogram)
+			result.merge(*data->counters[h].histogram);
+	}
+	return result.getCount() != 0;
+}
+
@@ -26,151 +26,174 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <jmutex.h>
 #include <jmutexautolock.h>
 #include <map>
+#include <vector>
+#include <ctime>
+#include "porting.h" // For getTimeUs
+#include "threads.h"
 
 /*
-	Time profiler
+	Distribution of durations in microseconds.
+
+	Below 16us every value has a bucket of its own; above that each
+	power of two is split in 16 buckets, so that a percentile is within
+	about 6% of the real value while the histogram has a fixed size.
 */
 
-class Profiler
+class TimeHistogram
 {
 public:
-	Profiler()
+	TimeHistogram()
 	{
-		m_mutex.Init();
+		clear();
 	}
 
-	void add(const std::string &name, float value)
+	void clear();
+	void add(u32 us);
+	// Adds the values of another histogram to this one
+	void merge(const TimeHistogram &other);
+
+	// Upper bound of the bucket at fraction p (0...1); 0 if empty
+	u32 percentile(float p) const;
+
+	u32 getCount() const
 	{
-		JMutexAutoLock lock(m_mutex);
-		{
-			/* No average shall have been used; mark add used as -2 */
-			core::map<std::string, int>::Node *n = m_avgcounts.find(name);
-			if(n == NULL)
-				m_avgcounts[name] = -2;
-			else{
-				if(n->getValue() == -1)
-					n->setValue(-2);
-				assert(n->getValue() == -2);
-			}
-		}
-		{
-			core::map<std::string, float>::Node *n = m_data.find(name);
-			if(n == NULL)
-				m_data[name] = value;
-			else
-				n->setValue(n->getValue() + value);
-		}
+		return m_count;
 	}
+	u32 getMax() const
+	{
+		return m_max;
+	}
+	float getAverage() const
+	{
+		return m_count == 0 ? 0 : m_sum / m_count;
+	}
+
+private:
+	enum{
+		SUB_BUCKETS = 16,
+		BUCKET_COUNT = 16 + 28 * 16
+	};
+
+	u32 m_buckets[BUCKET_COUNT];
+	u32 m_count;
+	u32 m_max;
+	f64 m_sum;
+};
+
+/*
+	A server step that took longer than the slow step threshold
+*/
+struct ProfilerSlowStep
+{
+	time_t time;
+	u32 duration_us;
+	// Time spent in the profiled sections during the step, slowest
+	// first; the time of nested sections is included in their parents
+	std::vector<std::pair<std::string, u32> > sections;
+};
+
+/*
+	Time profiler
+
+	Each thread has counters of its own, so that the threads don't wait
+	for each other when they record something; the counters of all the
+	threads are summed up when they are read. A counter is found by a
+	handle, an index that is looked up once by the name of the counter.
+	Hot code should keep the handle, e.g. in a static variable:
+
+		static ProfilerHandle h = g_profiler->getHandle("Foo: bar (num)");
+		g_profiler->add(h, 1);
+
+	getHandle() and the functions taking the name find the handle from a
+	table of the thread, which needs no locking but costs a map lookup.
+*/
+
+typedef u32 ProfilerHandle;
 
+struct ProfilerThreadData;
+
+class Profiler
+{
+public:
+	Profiler();
+	~Profiler();
+
+	// Returns the handle of a counter, registering the name if it is new
+	ProfilerHandle getHandle(const std::string &name);
+
+	void add(ProfilerHandle h, float value);
+	void avg(ProfilerHandle h, float value);
+	void graphAdd(ProfilerHandle h, float value);
+	// Adds a duration of a profiled section to its histogram
+	void record(ProfilerHandle h, u32 duration_us);
+
+	void add(const std::string &name, float value)
+	{
+		add(getHandle(name), value);
+	}
 	void avg(const std::string &name, float value)
 	{
-		JMutexAutoLock lock(m_mutex);
-		{
-			core::map<std::string, int>::Node *n = m_avgcounts.find(name);
-			if(n == NULL)
-				m_avgcounts[name] = 1;
-			else{
-				/* No add shall have been used */
-				assert(n->getValue() != -2);
-				if(n->getValue() <= 0)
-					n->setValue(1);
-				else
-					n->setValue(n->getValue() + 1);
-			}
-		}
-		{
-			core::map<std::string, float>::Node *n = m_data.find(name);
-			if(n == NULL)
-				m_data[name] = value;
-			else
-				n->setValue(n->getValue() + value);
-		}
+		avg(getHandle(name), value);
 	}
-
-	void clear()
+	void graphAdd(const std::string &id, float value)
 	{
-		JMutexAutoLock lock(m_mutex);
-		for(core::map<std::string, float>::Iterator
-				i = m_data.getIterator();
-				i.atEnd() == false; i++)
-		{
-			i.getNode()->setValue(0);
-		}
-		m_avgcounts.clear();
+		graphAdd(getHandle(id), value);
+	}
+	void record(const std::string &name, u32 duration_us)
+	{
+		record(getHandle(name), duration_us);
 	}
 
+	void clear();
+
 	void print(std::ostream &o)
 	{
 		printPage(o, 1, 1);
 	}
 
-	void printPage(std::ostream &o, u32 page, u32 pagecount)
-	{
-		JMutexAutoLock lock(m_mutex);
+	void printPage(std::ostream &o, u32 page, u32 pagecount);
 
-		u32 minindex, maxindex;
-		paging(m_data.size(), page, pagecount, minindex, maxindex);
+	typedef std::map<std::string, float> GraphValues;
 
-		for(core::map<std::string, float>::Iterator
-				i = m_data.getIterator();
-				i.atEnd() == false; i++)
-		{
-			if(maxindex == 0)
-				break;
-			maxindex--;
+	void graphGet(GraphValues &result);
 
-			if(minindex != 0)
-			{
-				minindex--;
-				continue;
-			}
+	/*
+		Timing distributions. These are kept until clearHistograms()
+		instead of being reset on every print like the sums.
+	*/
 
-			std::string name = i.getNode()->getKey();
-			int avgcount = 1;
-			core::map<std::string, int>::Node *n = m_avgcounts.find(name);
-			if(n){
-				if(n->getValue() >= 1)
-					avgcount = n->getValue();
-			}
-			o<<"  "<<name<<": ";
-			s32 clampsize = 40;
-			s32 space = clampsize - name.size();
-			for(s32 j=0; j<space; j++)
-			{
-				if(j%2 == 0 && j < space - 1)
-					o<<"-";
-				else
-					o<<" ";
-			}
-			o<<(i.getNode()->getValue() / avgcount);
-			o<<std::endl;
-		}
-	}
+	// The sections recorded by the current thread between these make
+	// up the breakdown of a step, which is kept if the step was slow
+	void stepBegin();
+	void stepEnd(u32 slow_threshold_us);
 
-	typedef std::map<std::string, float> GraphValues;
+	void printHistograms(std::ostream &o);
+	// Prints the latest slow steps and their slowest sections
+	void printSlowSteps(std::ostream &o, u32 max_steps, u32 max_sections);
+	void writeJson(std::ostream &o);
+	void clearHistograms();
 
-	void graphAdd(const std::string &id, float value)
-	{
-		JMutexAutoLock lock(m_mutex);
-		std::map<std::string, float>::iterator i =
-				m_graphvalues.find(id);
-		if(i == m_graphvalues.end())
-			m_graphvalues[id] = value;
-		else
-			i->second += value;
-	}
-	void graphGet(GraphValues &result)
-	{
-		JMutexAutoLock lock(m_mutex);
-		result = m_graphvalues;
-		m_graphvalues.clear();
-	}
+	// Returns false if nothing has been recorded by the name
+	bool getHistogram(const std::string &name, TimeHistogram &result);
 
 private:
+	// Returns the counters of the current thread, creating them if needed
+	ProfilerThreadData* getThreadData();
+	// Sums up the histograms of all threads; m_mutex must be locked
+	void mergeHistograms(std::map<std::string, TimeHistogram> &result);
+
+	// Identifies this profiler in the per-thread cache of getThreadData()
+	u32 m_id;
+	// Protects the members below. The mutex of a thread may be locked
+	// while holding this one, but not the other way around.
 	JMutex m_mutex;
-	core::map<std::string, float> m_data;
-	core::map<std::string, int> m_avgcounts;
-	std::map<std::string, float> m_graphvalues;
+	std::map<std::string, ProfilerHandle> m_handles;
+	std::vector<std::string> m_names;
+	std::vector<ProfilerThreadData*> m_threads;
+	ProfilerHandle m_step_handle;
+	// Ring of the latest slow steps
+	std::vector<ProfilerSlowStep> m_slow_steps;
+	u32 m_slow_steps_next;
 };
 
 enum ScopeProfilerType{
@@ -185,52 +208,62 @@ public:
 	ScopeProfiler(Profiler *profiler, const std::string &name,
 			enum ScopeProfilerType type = SPT_ADD):
 		m_profiler(profiler),
-		m_name(name),
-		m_timer(NULL),
 		m_type(type)
 	{
-		if(m_profiler)
-			m_timer = new TimeTaker(m_name.c_str());
+		if(m_profiler){
+			m_handle = m_profiler->getHandle(name);
+			m_start_us = porting::getTimeUs();
+		}
 	}
-	// name is copied
 	ScopeProfiler(Profiler *profiler, const char *name,
 			enum ScopeProfilerType type = SPT_ADD):
 		m_profiler(profiler),
-		m_name(name),
-		m_timer(NULL),
+		m_type(type)
+	{
+		if(m_profiler){
+			m_handle = m_profiler->getHandle(name);
+			m_start_us = porting::getTimeUs();
+		}
+	}
+	ScopeProfiler(Profiler *profiler, ProfilerHandle handle,
+			enum ScopeProfilerType type = SPT_ADD):
+		m_profiler(profiler),
+		m_handle(handle),
 		m_type(type)
 	{
 		if(m_profiler)
-			m_timer = new TimeTaker(m_name.c_str());
+			m_start_us = porting::getTimeUs();
 	}
 	~ScopeProfiler()
 	{
-		if(m_timer)
+		if(m_profiler)
 		{
-			float duration_ms = m_timer->stop(true);
-			float duration = duration_ms / 1000.0;
-			if(m_profiler){
-				switch(m_type){
-				case SPT_ADD:
-					m_profiler->add(m_name, duration);
-					break;
-				case SPT_AVG:
-					m_profiler->avg(m_name, duration);
-					break;
-				case SPT_GRAPH_ADD:
-					m_profiler->graphAdd(m_name, duration);
-					break;
-				}
+			u32 duration_us = porting::getTimeUs() - m_start_us;
+			float duration = duration_us / 1000000.0;
+			m_profiler->record(m_handle, duration_us);
+			switch(m_type){
+			case SPT_ADD:
+				m_profiler->add(m_handle, duration);
+				break;
+			case SPT_AVG:
+				m_profiler->avg(m_handle, duration);
+				break;
+			case SPT_GRAPH_ADD:
+				m_profiler->graphAdd(m_handle, duration);
+				break;
 			}
-			delete m_timer;
 		}
 	}
 private:
 	Profiler *m_profiler;
-	std::string m_name;
-	TimeTaker *m_timer;
+	ProfilerHandle m_handle;
+	u32 m_start_us;
 	enum ScopeProfilerType m_type;
 };
 
+// Prints plain event counts in the same layout as Profiler::print().
+// Cheaper than a temporary Profiler for counting within one function.
+void printCounts(std::ostream &o, const std::map<std::string, u32> &counts);
+
 #endif
 
@@ -24,11 +24,20 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <cstdlib>
 #include "log.h"
 #include <iostream>
+#include <map>
+#include "porting.h"
+#include "main.h" // For g_profiler
+#include "profiler.h"
+
+#include "config.h" // For USE_LUAJIT
 
 extern "C" {
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
+#if USE_LUAJIT
+#include <luajit.h>
+#endif
 }
 
 LuaError::LuaError(lua_State *L, const std::string &s)
@@ -111,16 +120,326 @@ bool script_load(lua_State *L, const char *path)
 	return true;
 }
 
+/*
+	Lua execution budget
+*/
+
+struct ScriptBudget
+{
+	u32 callback_ms;
+	u32 step_ms;
+	u32 hook_instructions;
+	u32 offense_limit;
+	float defer_time;
+
+	// Nesting level of budgeted calls; the outermost one owns the hook
+	int depth;
+	u32 deadline_ms;
+	// Set by the hook once the deadline has passed
+	bool aborted;
+	bool abort_reported;
+	// Lua time used during the current server step
+	u32 step_used_ms;
+
+	// Aborts per mod since it was last deferred
+	std::map<std::string, u32> offenses;
+	// Mods whose deferrable callbacks are skipped, and until when
+	std::map<std::string, u32> deferred_until;
+
+	ScriptBudget():
+		callback_ms(0),
+		step_ms(0),
+		hook_instructions(10000),
+		offense_limit(3),
+		defer_time(30),
+		depth(0),
+		deadline_ms(0),
+		aborted(false),
+		abort_reported(false),
+		step_used_ms(0)
+	{}
+};
+
+static ScriptBudget* get_budget(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, "minetest_script_budget");
+	ScriptBudget *budget = (ScriptBudget*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return budget;
+}
+
+// Time comparison that survives getTimeMs() wrapping around
+static bool time_reached(u32 now, u32 t)
+{
+	return (s32)(now - t) >= 0;
+}
+
+static void script_budget_hook(lua_State *L, lua_Debug *ar)
+{
+	ScriptBudget *budget = get_budget(L);
+	if(budget == NULL || budget->depth == 0)
+		return;
+	if(!budget->aborted){
+		if(!time_reached(porting::getTimeMs(), budget->deadline_ms))
+			return;
+		budget->aborted = true;
+		// Check on every instruction from now on
+		lua_sethook(L, script_budget_hook, LUA_MASKCOUNT, 1);
+	}
+	// Raised again on every instruction until the callback has unwound,
+	// so that a pcall() in the mod cannot swallow it
+	luaL_error(L, "time budget of %d ms exceeded", budget->callback_ms);
+}
+
+// Guesses the mod that defined the function at index.
+// Mod code is loaded from <modpath>/<modname>/*.lua
+static std::string get_function_modname(lua_State *L, int index)
+{
+	lua_Debug ar;
+	lua_pushvalue(L, index);
+	if(!lua_getinfo(L, ">S", &ar) || ar.source == NULL
+			|| ar.source[0] != '@')
+		return "?";
+	std::string source(ar.source + 1);
+	size_t end = source.find_last_of("/\\");
+	if(end == std::string::npos || end == 0)
+		return "?";
+	size_t begin = source.find_last_of("/\\", end - 1);
+	if(begin == std::string::npos)
+		begin = 0;
+	else
+		begin++;
+	return source.substr(begin, end - begin);
+}
+
+void script_budget_configure(lua_State *L, u32 callback_ms, u32 step_ms,
+		u32 hook_instructions, u32 offense_limit, float defer_time)
+{
+	ScriptBudget *budget = get_budget(L);
+	assert(budget);
+	budget->callback_ms = callback_ms;
+	budget->step_ms = step_ms;
+	budget->hook_instructions = hook_instructions > 0 ?
+			hook_instructions : 1;
+	budget->offense_limit = offense_limit > 0 ? offense_limit : 1;
+	budget->defer_time = defer_time;
+}
+
+void script_budget_step_begin(lua_State *L)
+{
+	ScriptBudget *budget = get_budget(L);
+	assert(budget);
+	if(budget->step_ms != 0)
+		g_profiler->avg("Lua: step time used (ms)", budget->step_used_ms);
+	budget->step_used_ms = 0;
+}
+
+static int script_skip_call(lua_State *L, int nargs, int nresults)
+{
+	lua_pop(L, nargs + 1);
+	for(int i = 0; i < nresults; i++)
+		lua_pushnil(L);
+	return 0;
+}
+
+int script_pcall_budget(lua_State *L, int nargs, int nresults,
+		const char *what, bool deferrable)
+{
+	ScriptBudget *budget = get_budget(L);
+	assert(budget);
+	int function = lua_gettop(L) - nargs;
+	bool outermost = (budget->depth == 0);
+
+	if(outermost && deferrable){
+		if(budget->step_ms != 0 && budget->step_used_ms >= budget->step_ms){
+			g_profiler->add("Lua: callbacks deferred by step budget (num)", 1);
+			return script_skip_call(L, nargs, nresults);
+		}
+		if(!budget->deferred_until.empty()){
+			std::string modname = get_function_modname(L, function);
+			std::map<std::string, u32>::iterator i =
+					budget->deferred_until.find(modname);
+			if(i != budget->deferred_until.end()){
+				if(!time_reached(porting::getTimeMs(), i->second)){
+					g_profiler->add("Lua: callbacks of deferred mods (num)", 1);
+					return script_skip_call(L, nargs, nresults);
+				}
+				infostream<<"Lua: no longer deferring callbacks of mod \""
+						<<modname<<"\""<<std::endl;
+				budget->deferred_until.erase(i);
+			}
+		}
+	}
+
+	u32 start_ms = porting::getTimeMs();
+	if(outermost){
+		budget->aborted = false;
+		budget->abort_reported = false;
+		if(budget->callback_ms != 0){
+			budget->deadline_ms = start_ms + budget->callback_ms;
+			lua_sethook(L, script_budget_hook, LUA_MASKCOUNT,
+					budget->hook_instructions);
+		}
+	}
+
+	// lua_pcall pops the function; keep a copy of it below the call
+	// for finding out its mod in case it gets aborted
+	bool keep_function = (budget->callback_ms != 0);
+	if(keep_function){
+		lua_pushvalue(L, function);
+		lua_insert(L, function);
+	}
+
+	budget->depth++;
+	int ret = lua_pcall(L, nargs, nresults, 0);
+	budget->depth--;
+
+	std::string modname;
+	if(keep_function){
+		// The copy is below the results or the error message
+		int fcopy = lua_gettop(L) - (ret == 0 ? nresults : 1);
+		if(budget->aborted && ret != 0)
+			modname = get_function_modname(L, fcopy);
+		lua_remove(L, fcopy);
+	}
+
+	if(outermost){
+		if(budget->callback_ms != 0)
+			lua_sethook(L, NULL, 0, 0);
+		budget->step_used_ms += porting::getTimeMs() - start_ms;
+	}
+
+	if(budget->aborted && ret != 0){
+		if(!budget->abort_reported){
+			budget->abort_reported = true;
+			errorstream<<"Lua: "<<what<<" of mod \""<<modname
+					<<"\" exceeded the time budget of "
+					<<budget->callback_ms<<" ms and was aborted: "
+					<<lua_tostring(L, -1)<<std::endl;
+			g_profiler->add("Lua: callbacks aborted (num)", 1);
+			u32 &offenses = budget->offenses[modname];
+			offenses++;
+			if(offenses >= budget->offense_limit){
+				offenses = 0;
+				budget->deferred_until[modname] = porting::getTimeMs()
+						+ (u32)(budget->defer_time * 1000);
+				errorstream<<"Lua: mod \""<<modname<<"\" repeatedly exceeded"
+						<<" the time budget; deferring its ABMs and entity"
+						<<" steps for "<<budget->defer_time<<" s"<<std::endl;
+			}
+		}
+		lua_pop(L, 1); // Pop error message
+		for(int i = 0; i < nresults; i++)
+			lua_pushnil(L);
+		ret = 0;
+	}
+	if(outermost)
+		budget->aborted = false;
+	return ret;
+}
+
+const char* script_interpreter_name()
+{
+#if USE_LUAJIT
+	return LUAJIT_VERSION;
+#else
+	return LUA_RELEASE;
+#endif
+}
+
+/*
+	Garbage collector statistics
+
+	Lua 5.1 has no callback for finished collection cycles, so an empty
+	userdata with a finalizer is used as a sentinel: the collector
+	finalizes it once per cycle and it replaces itself with a new one.
+*/
+
+static void create_gc_sentinel(lua_State *L);
+
+static int gc_sentinel_finalizer(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, "minetest_gc_cycles");
+	lua_Number cycles = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	lua_pushnumber(L, cycles + 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, "minetest_gc_cycles");
+	create_gc_sentinel(L);
+	return 0;
+}
+
+static void create_gc_sentinel(lua_State *L)
+{
+	lua_newuserdata(L, 1);
+	if(luaL_newmetatable(L, "minetest_gc_sentinel")){
+		lua_pushcfunction(L, gc_sentinel_finalizer);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
+}
+
+void script_report_gc_stats(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, "minetest_gc_cycles");
+	lua_Number cycles = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	lua_pushnumber(L, 0);
+	lua_setfield(L, LUA_REGISTRYINDEX, "minetest_gc_cycles");
+
+	g_profiler->avg("Lua: heap size (KB)", lua_gc(L, LUA_GCCOUNT, 0));
+	g_profiler->add("Lua: GC cycles (num)", cycles);
+}
+
+void script_gc_configure(lua_State *L, int pause, int stepmul)
+{
+	lua_gc(L, LUA_GCSETPAUSE, pause);
+	lua_gc(L, LUA_GCSETSTEPMUL, stepmul);
+}
+
+void script_gc_step(lua_State *L, u32 max_ms, int step_kb)
+{
+	int heap_before_kb = lua_gc(L, LUA_GCCOUNT, 0);
+	u32 start_ms = porting::getTimeMs();
+	u32 steps = 0;
+	u32 time_ms = 0;
+	do{
+		steps++;
+		// Returns 1 when the step finished a collection cycle
+		if(lua_gc(L, LUA_GCSTEP, step_kb))
+			break;
+		time_ms = porting::getTimeMs() - start_ms;
+	}
+	while(time_ms < max_ms);
+	time_ms = porting::getTimeMs() - start_ms;
+
+	int freed_kb = heap_before_kb - lua_gc(L, LUA_GCCOUNT, 0);
+	if(freed_kb < 0)
+		freed_kb = 0;
+	g_profiler->avg("Lua: GC step time (ms)", time_ms);
+	g_profiler->avg("Lua: GC steps per server step", steps);
+	g_profiler->avg("Lua: GC freed per server step (KB)", freed_kb);
+}
+
 lua_State* script_init()
 {
 	lua_State *L = luaL_newstate();
 	luaL_openlibs(L);
+
+	create_gc_sentinel(L);
+
+	// Store execution budget as light userdata in registry
+	lua_pushlightuserdata(L, new ScriptBudget());
+	lua_setfield(L, LUA_REGISTRYINDEX, "minetest_script_budget");
+
 	return L;
 }
 
 void script_deinit(lua_State *L)
 {
+	ScriptBudget *budget = get_budget(L);
 	lua_close(L);
+	delete budget;
 }
 
 
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <exception>
 #include <string>
+#include "irrlichttypes.h"
 
 typedef struct lua_State lua_State;
 
@@ -39,11 +40,54 @@ public:
 	std::string m_s;
 };
 
+// Name and version of the Lua implementation linked in
+const char* script_interpreter_name();
 lua_State* script_init();
 void script_deinit(lua_State *L);
 std::string script_get_backtrace(lua_State *L);
 void script_error(lua_State *L, const char *fmt, ...);
 bool script_load(lua_State *L, const char *path);
+// Adds heap size and finished GC cycles since the last call to the profiler
+void script_report_gc_stats(lua_State *L);
+// Sets the pause and step multiplier of the incremental collector
+void script_gc_configure(lua_State *L, int pause, int stepmul);
+/*
+	Runs the incremental collector in steps of step_kb until a cycle
+	finishes or max_ms has passed. At least one step is always run.
+*/
+void script_gc_step(lua_State *L, u32 max_ms, int step_kb);
+
+/*
+	Lua execution budget
+
+	Callbacks run through script_pcall_budget() get at most callback_ms
+	of wall clock time; an instruction count hook checks the clock every
+	hook_instructions VM instructions and aborts the callback when the
+	time is up. A mod whose callbacks get aborted offense_limit times
+	has its deferrable callbacks skipped for defer_time seconds.
+
+	Deferrable callbacks (ABMs, entity steps) are also skipped for the
+	rest of a server step once the Lua code run during that step has
+	used up step_ms.
+
+	A value of 0 for callback_ms or step_ms disables that limit.
+
+	With LuaJIT, code that has already been compiled to machine code
+	does not run hooks, so the limits are only best-effort there.
+*/
+void script_budget_configure(lua_State *L, u32 callback_ms, u32 step_ms,
+		u32 hook_instructions, u32 offense_limit, float defer_time);
+// Called at the beginning of every server step
+void script_budget_step_begin(lua_State *L);
+/*
+	Like lua_pcall(L, nargs, nresults, 0), but with the budget applied.
+	If the callback is skipped or aborted because of the budget, this
+	logs it, pushes nresults nils and returns 0; the caller carries on
+	as if the callback had returned nothing.
+	what is used in log messages to name the callback.
+*/
+int script_pcall_budget(lua_State *L, int nargs, int nresults,
+		const char *what, bool deferrable);
 
 #endif
 
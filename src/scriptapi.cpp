@@ -533,6 +533,24 @@ static v3s16 check_v3s16(lua_State *L, int index)
 	return floatToInt(pf, 1.0);
 }
 
+/*
+	Reads a node position that is either a table or three numbers, so
+	that hot code can avoid creating a table per position. Returns the
+	stack index of the argument following the position in next_index.
+*/
+static v3s16 read_v3s16_or_xyz(lua_State *L, int index, int &next_index)
+{
+	if(lua_isnumber(L, index)){
+		v3f pf(luaL_checknumber(L, index),
+				luaL_checknumber(L, index+1),
+				luaL_checknumber(L, index+2));
+		next_index = index + 3;
+		return floatToInt(pf, 1.0);
+	}
+	next_index = index + 1;
+	return check_v3s16(L, index);
+}
+
 static void pushnode(lua_State *L, const MapNode &n, INodeDefManager *ndef)
 {
 	lua_newtable(L);
@@ -3033,6 +3051,161 @@ const luaL_reg LuaPerlinNoise::methods[] = {
 	{0,0}
 };
 
+/*
+	NodeTimerRef
+*/
+
+class NodeTimerRef
+{
+private:
+	v3s16 m_p;
+	ServerEnvironment *m_env;
+
+	static const char className[];
+	static const luaL_reg methods[];
+
+	static int gc_object(lua_State *L) {
+		NodeTimerRef *o = *(NodeTimerRef **)(lua_touserdata(L, 1));
+		delete o;
+		return 0;
+	}
+
+	static NodeTimerRef *checkobject(lua_State *L, int narg)
+	{
+		luaL_checktype(L, narg, LUA_TUSERDATA);
+		void *ud = luaL_checkudata(L, narg, className);
+		if(!ud) luaL_typerror(L, narg, className);
+		return *(NodeTimerRef**)ud;  // unbox pointer
+	}
+
+	// Exported functions
+
+	// set(self, timeout, elapsed)
+	static int l_set(lua_State *L)
+	{
+		NodeTimerRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		f32 timeout = luaL_checknumber(L, 2);
+		f32 elapsed = luaL_checknumber(L, 3);
+		env->getMap().setNodeTimer(o->m_p, NodeTimer(timeout, elapsed));
+		return 0;
+	}
+
+	// start(self, timeout)
+	static int l_start(lua_State *L)
+	{
+		NodeTimerRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		f32 timeout = luaL_checknumber(L, 2);
+		env->getMap().setNodeTimer(o->m_p, NodeTimer(timeout, 0));
+		return 0;
+	}
+
+	// stop(self)
+	static int l_stop(lua_State *L)
+	{
+		NodeTimerRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		env->getMap().removeNodeTimer(o->m_p);
+		return 0;
+	}
+
+	// is_started(self) -> boolean
+	static int l_is_started(lua_State *L)
+	{
+		NodeTimerRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		NodeTimer t = env->getMap().getNodeTimer(o->m_p);
+		lua_pushboolean(L, t.isStarted());
+		return 1;
+	}
+
+	// get_timeout(self) -> number
+	static int l_get_timeout(lua_State *L)
+	{
+		NodeTimerRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		NodeTimer t = env->getMap().getNodeTimer(o->m_p);
+		lua_pushnumber(L, t.timeout);
+		return 1;
+	}
+
+	// get_elapsed(self) -> number
+	static int l_get_elapsed(lua_State *L)
+	{
+		NodeTimerRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		NodeTimer t = env->getMap().getNodeTimer(o->m_p);
+		lua_pushnumber(L, t.elapsed);
+		return 1;
+	}
+
+public:
+	NodeTimerRef(v3s16 p, ServerEnvironment *env):
+		m_p(p),
+		m_env(env)
+	{
+	}
+
+	~NodeTimerRef()
+	{
+	}
+
+	// Creates an NodeTimerRef and leaves it on top of stack
+	// Not callable from Lua; all references are created on the C side.
+	static void create(lua_State *L, v3s16 p, ServerEnvironment *env)
+	{
+		NodeTimerRef *o = new NodeTimerRef(p, env);
+		*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+		luaL_getmetatable(L, className);
+		lua_setmetatable(L, -2);
+	}
+
+	static void Register(lua_State *L)
+	{
+		lua_newtable(L);
+		int methodtable = lua_gettop(L);
+		luaL_newmetatable(L, className);
+		int metatable = lua_gettop(L);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushvalue(L, methodtable);
+		lua_settable(L, metatable);  // hide metatable from Lua getmetatable()
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, methodtable);
+		lua_settable(L, metatable);
+
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, gc_object);
+		lua_settable(L, metatable);
+
+		lua_pop(L, 1);  // drop metatable
+
+		luaL_openlib(L, 0, methods, 0);  // fill methodtable
+		lua_pop(L, 1);  // drop methodtable
+
+		// Cannot be created from Lua
+		//lua_register(L, className, create_object);
+	}
+};
+const char NodeTimerRef::className[] = "NodeTimerRef";
+const luaL_reg NodeTimerRef::methods[] = {
+	method(NodeTimerRef, start),
+	method(NodeTimerRef, set),
+	method(NodeTimerRef, stop),
+	method(NodeTimerRef, is_started),
+	method(NodeTimerRef, get_timeout),
+	method(NodeTimerRef, get_elapsed),
+	{0,0}
+};
+
 /*
 	EnvRef
 */
@@ -3140,6 +3313,50 @@ private:
 		}
 	}
 
+	// EnvRef:get_node_raw(pos) -> content id, param1, param2
+	// EnvRef:get_node_raw(x, y, z) -> content id, param1, param2
+	// Does not create any tables or strings
+	static int l_get_node_raw(lua_State *L)
+	{
+		EnvRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		// pos
+		int next_index;
+		v3s16 pos = read_v3s16_or_xyz(L, 2, next_index);
+		// Do it
+		MapNode n = env->getMap().getNodeNoEx(pos);
+		lua_pushinteger(L, n.getContent());
+		lua_pushinteger(L, n.getParam1());
+		lua_pushinteger(L, n.getParam2());
+		return 3;
+	}
+
+	// EnvRef:set_node_raw(pos, id, param1, param2)
+	// EnvRef:set_node_raw(x, y, z, id, param1, param2)
+	static int l_set_node_raw(lua_State *L)
+	{
+		EnvRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		INodeDefManager *ndef = env->getGameDef()->ndef();
+		// pos
+		int i;
+		v3s16 pos = read_v3s16_or_xyz(L, 2, i);
+		// content
+		int id = luaL_checkint(L, i);
+		if(id < 0 || id > MAX_CONTENT || ndef->get(id).name == "")
+			return luaL_argerror(L, i, "unknown content id");
+		content_t c = id;
+		u8 param1 = luaL_optint(L, i+1, 0);
+		u8 param2 = luaL_optint(L, i+2, 0);
+		// Do it
+		bool succeeded = env->getMap().addNodeWithEvent(pos,
+				MapNode(c, param1, param2));
+		lua_pushboolean(L, succeeded);
+		return 1;
+	}
+
 	// EnvRef:get_node_light(pos, timeofday)
 	// pos = {x=num, y=num, z=num}
 	// timeofday: nil = current time, 0 = night, 0.5 = day
@@ -3261,6 +3478,18 @@ private:
 		return 1;
 	}
 
+	// EnvRef:get_node_timer(pos)
+	static int l_get_node_timer(lua_State *L)
+	{
+		EnvRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		// Do it
+		v3s16 p = read_v3s16(L, 2);
+		NodeTimerRef::create(L, p, env);
+		return 1;
+	}
+
 	// EnvRef:get_player_by_name(name)
 	static int l_get_player_by_name(lua_State *L)
 	{
@@ -3521,12 +3750,15 @@ const luaL_reg EnvRef::methods[] = {
 	method(EnvRef, remove_node),
 	method(EnvRef, get_node),
 	method(EnvRef, get_node_or_nil),
+	method(EnvRef, get_node_raw),
+	method(EnvRef, set_node_raw),
 	method(EnvRef, get_node_light),
 	method(EnvRef, add_entity),
 	method(EnvRef, add_item),
 	method(EnvRef, add_rat),
 	method(EnvRef, add_firefly),
 	method(EnvRef, get_meta),
+	method(EnvRef, get_node_timer),
 	method(EnvRef, get_player_by_name),
 	method(EnvRef, get_objects_inside_radius),
 	method(EnvRef, set_timeofday),
@@ -3727,7 +3959,7 @@ public:
 		pushnode(L, n, env->getGameDef()->ndef());
 		lua_pushnumber(L, active_object_count);
 		lua_pushnumber(L, active_object_count_wider);
-		if(lua_pcall(L, 4, 0, 0))
+		if(script_pcall_budget(L, 4, 0, "ABM action", true))
 			script_error(L, "error: %s", lua_tostring(L, -1));
 	}
 };
@@ -3840,7 +4072,15 @@ static int l_register_item_raw(lua_State *L)
 	if(def.type == ITEM_NODE)
 	{
 		ContentFeatures f = read_content_features(L, table);
-		ndef->set(f.name, f);
+		content_t id = ndef->set(f.name, f);
+		if(id == CONTENT_IGNORE && f.name != "ignore"){
+			errorstream<<"register_item_raw: No free content id for "
+					<<f.name<<std::endl;
+			return 0;
+		}
+		// Return the content id of the node
+		lua_pushinteger(L, id);
+		return 1;
 	}
 
 	return 0; /* number of results */
@@ -4297,6 +4537,31 @@ static int l_notify_authentication_modified(lua_State *L)
 	return 0;
 }
 
+// get_content_id(name) -> content id or nil
+static int l_get_content_id(lua_State *L)
+{
+	std::string name = luaL_checkstring(L, 1);
+	INodeDefManager *ndef = get_server(L)->getNodeDefManager();
+	content_t c;
+	if(!ndef->getId(name, c)){
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, c);
+	return 1;
+}
+
+// get_name_from_content_id(id) -> name
+static int l_get_name_from_content_id(lua_State *L)
+{
+	int id = luaL_checkint(L, 1);
+	if(id < 0 || id > MAX_CONTENT)
+		return luaL_argerror(L, 1, "content id out of range");
+	INodeDefManager *ndef = get_server(L)->getNodeDefManager();
+	lua_pushstring(L, ndef->get(id).name.c_str());
+	return 1;
+}
+
 static const struct luaL_Reg minetest_f [] = {
 	{"debug", l_debug},
 	{"log", l_log},
@@ -4320,6 +4585,8 @@ static const struct luaL_Reg minetest_f [] = {
 	{"is_singleplayer", l_is_singleplayer},
 	{"get_password_hash", l_get_password_hash},
 	{"notify_authentication_modified", l_notify_authentication_modified},
+	{"get_content_id", l_get_content_id},
+	{"get_name_from_content_id", l_get_name_from_content_id},
 	{NULL, NULL}
 };
 
@@ -4357,6 +4624,7 @@ void scriptapi_export(lua_State *L, Server *server)
 	LuaItemStack::Register(L);
 	InvRef::Register(L);
 	NodeMetaRef::Register(L);
+	NodeTimerRef::Register(L);
 	ObjectRef::Register(L);
 	EnvRef::Register(L);
 	LuaPseudoRandom::Register(L);
@@ -4612,7 +4880,7 @@ static void scriptapi_run_callbacks(lua_State *L, int nargs,
 		// Call function
 		for(int i = 0; i < nargs; i++)
 			lua_pushvalue(L, arg+i);
-		if(lua_pcall(L, nargs, 1, 0))
+		if(script_pcall_budget(L, nargs, 1, "callback", false))
 			script_error(L, "error: %s", lua_tostring(L, -1));
 
 		// Move return value to designated space in stack
@@ -4926,7 +5194,7 @@ bool scriptapi_item_on_drop(lua_State *L, ItemStack &item,
 	LuaItemStack::create(L, item);
 	objectref_get_or_create(L, dropper);
 	pushFloatPos(L, pos);
-	if(lua_pcall(L, 3, 1, 0))
+	if(script_pcall_budget(L, 3, 1, "item callback", false))
 		script_error(L, "error: %s", lua_tostring(L, -1));
 	if(!lua_isnil(L, -1))
 		item = read_item(L, -1);
@@ -4948,7 +5216,7 @@ bool scriptapi_item_on_place(lua_State *L, ItemStack &item,
 	LuaItemStack::create(L, item);
 	objectref_get_or_create(L, placer);
 	push_pointed_thing(L, pointed);
-	if(lua_pcall(L, 3, 1, 0))
+	if(script_pcall_budget(L, 3, 1, "item callback", false))
 		script_error(L, "error: %s", lua_tostring(L, -1));
 	if(!lua_isnil(L, -1))
 		item = read_item(L, -1);
@@ -4970,7 +5238,7 @@ bool scriptapi_item_on_use(lua_State *L, ItemStack &item,
 	LuaItemStack::create(L, item);
 	objectref_get_or_create(L, user);
 	push_pointed_thing(L, pointed);
-	if(lua_pcall(L, 3, 1, 0))
+	if(script_pcall_budget(L, 3, 1, "item callback", false))
 		script_error(L, "error: %s", lua_tostring(L, -1));
 	if(!lua_isnil(L, -1))
 		item = read_item(L, -1);
@@ -4994,7 +5262,7 @@ bool scriptapi_node_on_punch(lua_State *L, v3s16 pos, MapNode node,
 	push_v3s16(L, pos);
 	pushnode(L, node, ndef);
 	objectref_get_or_create(L, puncher);
-	if(lua_pcall(L, 3, 0, 0))
+	if(script_pcall_budget(L, 3, 0, "node callback", false))
 		script_error(L, "error: %s", lua_tostring(L, -1));
 	return true;
 }
@@ -5016,11 +5284,32 @@ bool scriptapi_node_on_dig(lua_State *L, v3s16 pos, MapNode node,
 	push_v3s16(L, pos);
 	pushnode(L, node, ndef);
 	objectref_get_or_create(L, digger);
-	if(lua_pcall(L, 3, 0, 0))
+	if(script_pcall_budget(L, 3, 0, "node callback", false))
 		script_error(L, "error: %s", lua_tostring(L, -1));
 	return true;
 }
 
+bool scriptapi_node_on_timer(lua_State *L, v3s16 pos, MapNode node,
+		f32 elapsed)
+{
+	realitycheck(L);
+	assert(lua_checkstack(L, 20));
+	StackUnroller stack_unroller(L);
+
+	INodeDefManager *ndef = get_server(L)->ndef();
+
+	// Push callback function on stack
+	if(!get_item_callback(L, ndef->get(node).name.c_str(), "on_timer"))
+		return false;
+
+	// Call function
+	push_v3s16(L, pos);
+	lua_pushnumber(L, elapsed);
+	if(script_pcall_budget(L, 2, 1, "node callback", false))
+		script_error(L, "error: %s", lua_tostring(L, -1));
+	return lua_toboolean(L, -1);
+}
+
 /*
 	environment
 */
@@ -5132,7 +5421,7 @@ void scriptapi_luaentity_activate(lua_State *L, u16 id,
 		lua_pushvalue(L, object); // self
 		lua_pushlstring(L, staticdata.c_str(), staticdata.size());
 		// Call with 2 arguments, 0 results
-		if(lua_pcall(L, 2, 0, 0))
+		if(script_pcall_budget(L, 2, 0, "entity on_activate", false))
 			script_error(L, "error running function on_activate: %s\n",
 					lua_tostring(L, -1));
 	}
@@ -5211,7 +5500,7 @@ void scriptapi_luaentity_get_properties(lua_State *L, u16 id,
 	lua_pop(L, 1);
 }
 
-void scriptapi_luaentity_step(lua_State *L, u16 id, float dtime)
+bool scriptapi_luaentity_step(lua_State *L, u16 id, float dtime)
 {
 	realitycheck(L);
 	assert(lua_checkstack(L, 20));
@@ -5225,13 +5514,14 @@ void scriptapi_luaentity_step(lua_State *L, u16 id, float dtime)
 	// Get step function
 	lua_getfield(L, -1, "on_step");
 	if(lua_isnil(L, -1))
-		return;
+		return false;
 	luaL_checktype(L, -1, LUA_TFUNCTION);
 	lua_pushvalue(L, object); // self
 	lua_pushnumber(L, dtime); // dtime
 	// Call with 2 arguments, 0 results
-	if(lua_pcall(L, 2, 0, 0))
+	if(script_pcall_budget(L, 2, 0, "entity on_step", true))
 		script_error(L, "error running function 'on_step': %s\n", lua_tostring(L, -1));
+	return true;
 }
 
 // Calls entity:on_punch(ObjectRef puncher, time_from_last_punch,
@@ -5260,7 +5550,7 @@ void scriptapi_luaentity_punch(lua_State *L, u16 id,
 	push_tool_capabilities(L, *toolcap);
 	push_v3f(L, dir);
 	// Call with 5 arguments, 0 results
-	if(lua_pcall(L, 5, 0, 0))
+	if(script_pcall_budget(L, 5, 0, "entity on_punch", false))
 		script_error(L, "error running function 'on_punch': %s\n", lua_tostring(L, -1));
 }
 
@@ -5285,7 +5575,7 @@ void scriptapi_luaentity_rightclick(lua_State *L, u16 id,
 	lua_pushvalue(L, object); // self
 	objectref_get_or_create(L, clicker); // Clicker reference
 	// Call with 2 arguments, 0 results
-	if(lua_pcall(L, 2, 0, 0))
+	if(script_pcall_budget(L, 2, 0, "entity on_rightclick", false))
 		script_error(L, "error running function 'on_rightclick': %s\n", lua_tostring(L, -1));
 }
 
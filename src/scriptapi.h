@@ -81,6 +81,9 @@ bool scriptapi_node_on_punch(lua_State *L, v3s16 p, MapNode node,
 		ServerActiveObject *puncher);
 bool scriptapi_node_on_dig(lua_State *L, v3s16 p, MapNode node,
 		ServerActiveObject *digger);
+// Returns true if the timer shall be restarted
+bool scriptapi_node_on_timer(lua_State *L, v3s16 p, MapNode node,
+		f32 elapsed);
 
 /* luaentity */
 // Returns true if succesfully added into Lua; false otherwise.
@@ -91,7 +94,8 @@ void scriptapi_luaentity_rm(lua_State *L, u16 id);
 std::string scriptapi_luaentity_get_staticdata(lua_State *L, u16 id);
 void scriptapi_luaentity_get_properties(lua_State *L, u16 id,
 		ObjectProperties *prop);
-void scriptapi_luaentity_step(lua_State *L, u16 id, float dtime);
+// Returns false if the entity has no on_step
+bool scriptapi_luaentity_step(lua_State *L, u16 id, float dtime);
 void scriptapi_luaentity_punch(lua_State *L, u16 id,
 		ServerActiveObject *puncher, float time_from_last_punch,
 		const ToolCapabilities *toolcap, v3f dir);
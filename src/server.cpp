@@ -900,6 +900,29 @@ void PlayerInfo::PrintLine(std::ostream *s)
 	(*s)<<std::endl;
 }
 
+/*
+	The active object messages of one server step, serialized for
+	TOCLIENT_ACTIVE_OBJECT_MESSAGES once for all clients
+*/
+struct SerializedObjectMessages
+{
+	std::string reliable;
+	// The first byte of each message and the serialized message
+	std::vector<std::pair<u8, std::string> > unreliable;
+};
+
+/*
+	Minimum time between unreliable updates of an object at a distance
+	from a player. Objects closer than 40 nodes are updated every step.
+*/
+static f32 getObjectUpdateInterval(f32 distance)
+{
+	const f32 full_rate_distance = 40*BS;
+	if(distance < full_rate_distance)
+		return 0;
+	return MYMIN(1.0, 0.1 * distance / full_rate_distance);
+}
+
 /*
 	Server
 */
@@ -984,9 +1007,20 @@ Server::Server(
 
 	// Initialize scripting
 	
-	infostream<<"Server: Initializing Lua"<<std::endl;
+	infostream<<"Server: Initializing Lua ("<<script_interpreter_name()
+			<<")"<<std::endl;
 	m_lua = script_init();
 	assert(m_lua);
+	// Limit the time mod callbacks can hold up the server
+	script_budget_configure(m_lua,
+			g_settings->getU16("lua_callback_time_budget"),
+			g_settings->getU16("lua_step_time_budget"),
+			g_settings->getS32("lua_budget_hook_instructions"),
+			g_settings->getU16("lua_budget_offense_limit"),
+			g_settings->getFloat("lua_budget_defer_time"));
+	// Tune the incremental garbage collector
+	script_gc_configure(m_lua, g_settings->getU16("lua_gc_pause"),
+			g_settings->getU16("lua_gc_stepmul"));
 	// Export API
 	scriptapi_export(m_lua, this);
 	// Load and run builtin.lua
@@ -1047,9 +1081,9 @@ Server::Server(
 		m_env->loadMeta(m_path_world);
 	}
 
-	// Load players
-	infostream<<"Server: Loading players"<<std::endl;
-	m_env->deSerializePlayers(m_path_world);
+	// Players are loaded when they join; move the ones of old worlds
+	// to where they are loaded from
+	m_env->migratePlayerFiles(m_path_world);
 
 	/*
 		Add some test ActiveBlockModifiers to environment
@@ -1097,7 +1131,7 @@ Server::~Server()
 			Save players
 		*/
 		infostream<<"Server: Saving players"<<std::endl;
-		m_env->serializePlayers(m_path_world);
+		m_env->savePlayers();
 
 		/*
 			Save environment metadata
@@ -1236,6 +1270,9 @@ void Server::AsyncRunStep()
 		return;
 	
 	g_profiler->add("Server::AsyncRunStep with dtime (num)", 1);
+	g_profiler->stepBegin();
+
+	u32 step_start_ms = porting::getTimeMs();
 
 	//infostream<<"Server steps "<<dtime<<std::endl;
 	//infostream<<"Server::AsyncRunStep(): dtime="<<dtime<<std::endl;
@@ -1300,10 +1337,13 @@ void Server::AsyncRunStep()
 
 	{
 		JMutexAutoLock lock(m_env_mutex);
+		// Start a new Lua execution budget period
+		script_budget_step_begin(m_lua);
 		// Step environment
 		ScopeProfiler sp(g_profiler, "SEnv step");
 		ScopeProfiler sp2(g_profiler, "SEnv step avg", SPT_AVG);
 		m_env->step(dtime);
+		script_report_gc_stats(m_lua);
 	}
 		
 	const float map_timer_and_unload_dtime = 2.92;
@@ -1338,6 +1378,11 @@ void Server::AsyncRunStep()
 			if(playersao == NULL)
 				continue;
 
+			// HP changed by something else than hunger and oxygen, and
+			// not sent on death below
+			bool hp_changed = (playersao->m_hp_not_sent &&
+					playersao->getHP() > 0);
+
 			/*
 				Handle player HPs (die if hp=0)
 			*/
@@ -1418,17 +1463,12 @@ void Server::AsyncRunStep()
 				UpdateCrafting(client->peer_id);
 				SendInventory(client->peer_id);
 			}
-			if(playersao->m_hp_not_sent){
+			if(hp_changed){
 				playersao->setExhaustion(playersao->getExhaustion() + 0.3);
-				SendPlayerHP(client->peer_id);
-				SendPlayerHunger(client->peer_id);
-			}
-			if(playersao->m_hunger_not_sent){
-				SendPlayerHunger(client->peer_id);
-			}
-			if(playersao->m_oxygen_not_sent){
-				SendPlayerOxygen(client->peer_id);
+				playersao->m_hunger_not_sent = true;
 			}
+			// All that changed in this step goes in one packet
+			SendPlayerState(client->peer_id);
 		}
 	}
 	
@@ -1582,6 +1622,7 @@ void Server::AsyncRunStep()
 				
 				// Remove from known objects
 				client->m_known_objects.remove(i.getNode()->getKey());
+				client->m_held_object_messages.erase(id);
 
 				if(obj && obj->m_known_by_count > 0)
 					obj->m_known_by_count--;
@@ -1676,71 +1717,122 @@ void Server::AsyncRunStep()
 
 		ScopeProfiler sp(g_profiler, "Server: sending object messages");
 
-		// Key = object id
-		// Value = data sent by object
-		core::map<u16, core::list<ActiveObjectMessage>* > buffered_messages;
-
-		// Get active object messages from environment
+		/*
+			Get active object messages from environment and serialize
+			them once for all clients
+		*/
+		std::map<u16, SerializedObjectMessages> object_messages;
 		for(;;)
 		{
 			ActiveObjectMessage aom = m_env->getActiveObjectMessage();
 			if(aom.id == 0)
 				break;
-			
-			core::list<ActiveObjectMessage>* message_list = NULL;
-			core::map<u16, core::list<ActiveObjectMessage>* >::Node *n;
-			n = buffered_messages.find(aom.id);
-			if(n == NULL)
+
+			std::string new_data;
+			// Add object id
+			char buf[2];
+			writeU16((u8*)&buf[0], aom.id);
+			new_data.append(buf, 2);
+			// Add data
+			new_data += serializeString(aom.datastring);
+
+			SerializedObjectMessages &messages = object_messages[aom.id];
+			if(aom.reliable)
 			{
-				message_list = new core::list<ActiveObjectMessage>;
-				buffered_messages.insert(aom.id, message_list);
+				messages.reliable += new_data;
 			}
 			else
 			{
-				message_list = n->getValue();
+				u8 command = aom.datastring.empty() ? 0 : aom.datastring[0];
+				messages.unreliable.push_back(
+						std::make_pair(command, new_data));
 			}
-			message_list->push_back(aom);
 		}
-		
-		// Route data to every client
+
+		/*
+			Route data to every client that knows the object. Unreliable
+			messages of far away objects are held back and only the
+			latest of each command is sent when their interval is over.
+		*/
+		u32 held_count = 0;
 		for(core::map<u16, RemoteClient*>::Iterator
 			i = m_clients.getIterator();
 			i.atEnd()==false; i++)
 		{
 			RemoteClient *client = i.getNode()->getValue();
+			Player *player = m_env->getPlayer(client->peer_id);
+			v3f player_pos = player ? player->getPosition() : v3f(0,0,0);
+
 			std::string reliable_data;
 			std::string unreliable_data;
-			// Go through all objects in message buffer
-			for(core::map<u16, core::list<ActiveObjectMessage>* >::Iterator
-					j = buffered_messages.getIterator();
-					j.atEnd()==false; j++)
+
+			// Held back messages whose time has come, and the ones of
+			// objects that have come near
+			for(std::map<u16, RemoteClient::HeldObjectMessages>::iterator
+					j = client->m_held_object_messages.begin();
+					j != client->m_held_object_messages.end();)
+			{
+				RemoteClient::HeldObjectMessages &held = j->second;
+				held.timer += dtime;
+				ServerActiveObject *obj = m_env->getActiveObject(j->first);
+				f32 interval = 0;
+				if(obj && player)
+					interval = getObjectUpdateInterval(
+							obj->getBasePosition().getDistanceFrom(player_pos));
+				if(obj && held.timer < interval)
+				{
+					j++;
+					continue;
+				}
+				if(obj)
+				{
+					for(std::map<u8, std::string>::iterator
+							k = held.messages.begin();
+							k != held.messages.end(); k++)
+						unreliable_data += k->second;
+				}
+				client->m_held_object_messages.erase(j++);
+			}
+
+			for(std::map<u16, SerializedObjectMessages>::iterator
+					j = object_messages.begin();
+					j != object_messages.end(); j++)
 			{
 				// If object is not known by client, skip it
-				u16 id = j.getNode()->getKey();
+				u16 id = j->first;
 				if(client->m_known_objects.find(id) == NULL)
 					continue;
-				// Get message list of object
-				core::list<ActiveObjectMessage>* list = j.getNode()->getValue();
-				// Go through every message
-				for(core::list<ActiveObjectMessage>::Iterator
-						k = list->begin(); k != list->end(); k++)
+				const SerializedObjectMessages &messages = j->second;
+				reliable_data += messages.reliable;
+				if(messages.unreliable.empty())
+					continue;
+
+				ServerActiveObject *obj = m_env->getActiveObject(id);
+				f32 interval = 0;
+				if(obj && player)
+					interval = getObjectUpdateInterval(
+							obj->getBasePosition().getDistanceFrom(player_pos));
+				std::map<u16, RemoteClient::HeldObjectMessages>::iterator
+						held = client->m_held_object_messages.find(id);
+				if(interval == 0 && held == client->m_held_object_messages.end())
 				{
-					// Compose the full new data with header
-					ActiveObjectMessage aom = *k;
-					std::string new_data;
-					// Add object id
-					char buf[2];
-					writeU16((u8*)&buf[0], aom.id);
-					new_data.append(buf, 2);
-					// Add data
-					new_data += serializeString(aom.datastring);
-					// Add data to buffer
-					if(aom.reliable)
-						reliable_data += new_data;
-					else
-						unreliable_data += new_data;
+					for(u32 k=0; k<messages.unreliable.size(); k++)
+						unreliable_data += messages.unreliable[k].second;
+					continue;
+				}
+				if(held == client->m_held_object_messages.end())
+				{
+					held = client->m_held_object_messages.insert(std::make_pair(
+							id, RemoteClient::HeldObjectMessages())).first;
+				}
+				for(u32 k=0; k<messages.unreliable.size(); k++)
+				{
+					held->second.messages[messages.unreliable[k].first] =
+							messages.unreliable[k].second;
 				}
 			}
+			held_count += client->m_held_object_messages.size();
+
 			/*
 				reliable_data and unreliable_data are now ready.
 				Send them.
@@ -1772,14 +1864,7 @@ void Server::AsyncRunStep()
 						<<std::endl;
 			}*/
 		}
-
-		// Clear buffered_messages
-		for(core::map<u16, core::list<ActiveObjectMessage>* >::Iterator
-				i = buffered_messages.getIterator();
-				i.atEnd()==false; i++)
-		{
-			delete i.getNode()->getValue();
-		}
+		g_profiler->avg("Server: held back object updates", held_count);
 	}
 
 	} // enable_experimental
@@ -1803,7 +1888,7 @@ void Server::AsyncRunStep()
 		int event_count = m_unsent_map_edit_queue.size();
 
 		// We'll log the amount of each
-		Profiler prof;
+		std::map<std::string, u32> event_counts;
 
 		while(m_unsent_map_edit_queue.size() != 0)
 		{
@@ -1817,7 +1902,7 @@ void Server::AsyncRunStep()
 			if(event->type == MEET_ADDNODE)
 			{
 				//infostream<<"Server: MEET_ADDNODE"<<std::endl;
-				prof.add("MEET_ADDNODE", 1);
+				event_counts["MEET_ADDNODE"]++;
 				if(disable_single_change_sending)
 					sendAddNode(event->p, event->n, event->already_known_by_peer,
 							&far_players, 5);
@@ -1828,7 +1913,7 @@ void Server::AsyncRunStep()
 			else if(event->type == MEET_REMOVENODE)
 			{
 				//infostream<<"Server: MEET_REMOVENODE"<<std::endl;
-				prof.add("MEET_REMOVENODE", 1);
+				event_counts["MEET_REMOVENODE"]++;
 				if(disable_single_change_sending)
 					sendRemoveNode(event->p, event->already_known_by_peer,
 							&far_players, 5);
@@ -1839,13 +1924,13 @@ void Server::AsyncRunStep()
 			else if(event->type == MEET_BLOCK_NODE_METADATA_CHANGED)
 			{
 				infostream<<"Server: MEET_BLOCK_NODE_METADATA_CHANGED"<<std::endl;
-				prof.add("MEET_BLOCK_NODE_METADATA_CHANGED", 1);
+				event_counts["MEET_BLOCK_NODE_METADATA_CHANGED"]++;
 				setBlockNotSent(event->p);
 			}
 			else if(event->type == MEET_OTHER)
 			{
 				infostream<<"Server: MEET_OTHER"<<std::endl;
-				prof.add("MEET_OTHER", 1);
+				event_counts["MEET_OTHER"]++;
 				for(core::map<v3s16, bool>::Iterator
 						i = event->modified_blocks.getIterator();
 						i.atEnd()==false; i++)
@@ -1856,7 +1941,7 @@ void Server::AsyncRunStep()
 			}
 			else
 			{
-				prof.add("unknown", 1);
+				event_counts["unknown"]++;
 				infostream<<"WARNING: Server: Unknown MapEditEvent "
 						<<((u32)event->type)<<std::endl;
 			}
@@ -1899,10 +1984,10 @@ void Server::AsyncRunStep()
 
 		if(event_count >= 5){
 			infostream<<"Server: MapEditEvents:"<<std::endl;
-			prof.print(infostream);
+			printCounts(infostream, event_counts);
 		} else if(event_count != 0){
 			verbosestream<<"Server: MapEditEvents:"<<std::endl;
-			prof.print(verbosestream);
+			printCounts(verbosestream, event_counts);
 		}
 		
 	}
@@ -1941,12 +2026,33 @@ void Server::AsyncRunStep()
 			m_env->getMap().save(MOD_STATE_WRITE_NEEDED);
 
 			// Save players
-			m_env->serializePlayers(m_path_world);
+			m_env->savePlayers();
 			
 			// Save environment metadata
 			m_env->saveMeta(m_path_world);
 		}
 	}
+
+	/*
+		Step the Lua garbage collector in the time left of this step,
+		so that less of its work lands in the middle of callbacks
+	*/
+	u32 gc_step_time = g_settings->getU16("lua_gc_step_time");
+	if(gc_step_time != 0)
+	{
+		// dtime also counts the time slept between steps, so it says
+		// nothing about what is left of this one
+		s32 step_ms = g_settings->getFloat("dedicated_server_step") * 1000;
+		s32 slack_ms = step_ms - (s32)(porting::getTimeMs() - step_start_ms);
+		if(slack_ms < (s32)gc_step_time)
+			gc_step_time = MYMAX(slack_ms, 0);
+		JMutexAutoLock lock(m_env_mutex);
+		script_gc_step(m_lua, gc_step_time,
+				g_settings->getU16("lua_gc_step_size"));
+	}
+
+	g_profiler->stepEnd(
+			g_settings->getU16("profiler_slow_step_threshold") * 1000);
 }
 
 void Server::Receive()
@@ -2102,7 +2208,8 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 		
 		if(g_settings->getBool("strict_protocol_version_checking"))
 		{
-			if(net_proto_version != PROTOCOL_VERSION)
+			if(net_proto_version < SERVER_PROTOCOL_VERSION_MIN ||
+					net_proto_version > PROTOCOL_VERSION)
 			{
 				actionstream<<"Server: A mismatched client tried to connect"
 						<<" from "<<addr_s<<std::endl;
@@ -2111,6 +2218,8 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 						L"Server version is ")
 						+ narrow_to_wide(VERSION_STRING) + L",\n"
 						+ L"server's PROTOCOL_VERSION is "
+						+ narrow_to_wide(itos(SERVER_PROTOCOL_VERSION_MIN))
+						+ L"..."
 						+ narrow_to_wide(itos(PROTOCOL_VERSION))
 						+ L", client's PROTOCOL_VERSION is "
 						+ narrow_to_wide(itos(net_proto_version))
@@ -2292,14 +2401,13 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 		
 		Player *player = m_env->getPlayer(peer_id);
 
-		// Send HP
-		SendPlayerHP(peer_id);
-
-		// Send Hunger
-		SendPlayerHunger(peer_id);
-
-		// Send Oxygen
-		SendPlayerOxygen(peer_id);
+		// Send HP, hunger and oxygen
+		PlayerSAO *playersao = player->getPlayerSAO();
+		assert(playersao);
+		playersao->m_hp_not_sent = true;
+		playersao->m_hunger_not_sent = true;
+		playersao->m_oxygen_not_sent = true;
+		SendPlayerState(peer_id);
 
 		// Show death screen if necessary
 		if(player->hp == 0)
@@ -2334,7 +2442,7 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 		}
 		
 		// Warnings about protocol version can be issued here
-		if(getClient(peer_id)->net_proto_version < PROTOCOL_VERSION)
+		if(getClient(peer_id)->net_proto_version < SERVER_PROTOCOL_VERSION_MIN)
 		{
 			SendChatMessage(peer_id, L"# Server: WARNING: YOUR CLIENT IS OLD AND MAY WORK PROPERLY WITH THIS SERVER");
 		}
@@ -3350,6 +3458,11 @@ void Server::setInventoryModified(const InventoryLocation &loc)
 		NodeMetadata *meta = m_env->getMap().getNodeMetadata(loc.p);
 		if(meta)
 			meta->inventoryModified();
+		// Stepped metadata like furnaces may have work to do now
+		if(meta && meta->stepInterval() > 0 &&
+				!m_env->getMap().getNodeTimer(loc.p).isStarted())
+			m_env->getMap().setNodeTimer(loc.p,
+					NodeTimer(meta->stepInterval(), 0));
 		
 		MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(blockpos);
 		if(block)
@@ -3480,6 +3593,28 @@ void Server::SendOxygen(con::Connection &con, u16 peer_id, u8 oxygen)
 	con.Send(peer_id, 0, data, true);
 }
 
+void Server::SendPlayerState(con::Connection &con, u16 peer_id,
+		u8 fields, u8 hp, u8 hunger, u8 oxygen)
+{
+	DSTACK(__FUNCTION_NAME);
+	std::ostringstream os(std::ios_base::binary);
+
+	writeU16(os, TOCLIENT_PLAYER_STATE);
+	writeU8(os, fields);
+	if(fields & PLAYER_STATE_HP)
+		writeU8(os, hp);
+	if(fields & PLAYER_STATE_HUNGER)
+		writeU8(os, hunger);
+	if(fields & PLAYER_STATE_OXYGEN)
+		writeU8(os, oxygen);
+
+	// Make data buffer
+	std::string s = os.str();
+	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
+	// Send as reliable
+	con.Send(peer_id, 0, data, true);
+}
+
 void Server::SendKick(con::Connection &con, u16 peer_id)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -3685,6 +3820,41 @@ void Server::SendPlayerOxygen(u16 peer_id)
 	SendOxygen(m_con, peer_id, playersao->getOxygen());
 }
 
+void Server::SendPlayerState(u16 peer_id)
+{
+	DSTACK(__FUNCTION_NAME);
+	PlayerSAO *playersao = getPlayerSAO(peer_id);
+	assert(playersao);
+
+	// Older clients only know the separate messages
+	if(getClient(peer_id)->net_proto_version < 11)
+	{
+		if(playersao->m_hp_not_sent)
+			SendPlayerHP(peer_id);
+		if(playersao->m_hunger_not_sent)
+			SendPlayerHunger(peer_id);
+		if(playersao->m_oxygen_not_sent)
+			SendPlayerOxygen(peer_id);
+		return;
+	}
+
+	u8 fields = 0;
+	if(playersao->m_hp_not_sent)
+		fields |= PLAYER_STATE_HP;
+	if(playersao->m_hunger_not_sent)
+		fields |= PLAYER_STATE_HUNGER;
+	if(playersao->m_oxygen_not_sent)
+		fields |= PLAYER_STATE_OXYGEN;
+	if(fields == 0)
+		return;
+
+	playersao->m_hp_not_sent = false;
+	playersao->m_hunger_not_sent = false;
+	playersao->m_oxygen_not_sent = false;
+	SendPlayerState(m_con, peer_id, fields, playersao->getHP(),
+			playersao->getHunger(), playersao->getOxygen());
+}
+
 void Server::SendPlayerKick(u16 peer_id)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -4402,9 +4572,6 @@ void Server::StarvePlayer(u16 peer_id)
 
 	// Trigger scripted stuff
 	//scriptapi_on_dieplayer(m_lua, playersao);
-
-	SendPlayerHunger(peer_id);
-	SendPlayerHP(peer_id);
 }
 
 void Server::SuffocatePlayer(u16 peer_id)
@@ -4422,9 +4589,6 @@ void Server::SuffocatePlayer(u16 peer_id)
 
 	// Trigger scripted stuff
 	//scriptapi_on_dieplayer(m_lua, playersao);
-
-	SendPlayerOxygen(peer_id);
-	SendPlayerHP(peer_id);
 }
 
 void Server::SatisfyPlayer(u16 peer_id)
@@ -4442,8 +4606,6 @@ void Server::SatisfyPlayer(u16 peer_id)
 
 	// Trigger scripted stuff
 	//scriptapi_on_dieplayer(m_lua, playersao);
-
-	SendPlayerHP(peer_id);
 }
 
 void Server::RespawnPlayer(u16 peer_id)
@@ -4749,6 +4911,12 @@ PlayerSAO* Server::emergePlayer(const char *name, u16 peer_id)
 		return NULL;
 	}
 
+	/*
+		Load the player if it has been saved
+	*/
+	if(player == NULL)
+		player = m_env->loadPlayer(name);
+
 	/*
 		Create a new player if it doesn't exist yet
 	*/
@@ -4985,6 +5153,8 @@ void dedicated_server_loop(Server &server, bool &kill)
 			{
 				infostream<<"Profiler:"<<std::endl;
 				g_profiler->print(infostream);
+				infostream<<"Timing distributions:"<<std::endl;
+				g_profiler->printHistograms(infostream);
 				g_profiler->clear();
 			}
 		}
@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "environment.h"
 #include "common_irrlicht.h"
 #include <string>
+#include <map>
 #include "porting.h"
 #include "map.h"
 #include "inventory.h"
@@ -393,6 +394,21 @@ public:
 	*/
 	core::map<u16, bool> m_known_objects;
 
+	/*
+		Unreliable messages of far away known objects, held back so
+		that they are updated less often than near ones.
+	*/
+	struct HeldObjectMessages
+	{
+		HeldObjectMessages(): timer(0) {}
+		// Time since the first held message
+		float timer;
+		// The latest serialized message of each command (the first
+		// byte of the message)
+		std::map<u8, std::string> messages;
+	};
+	std::map<u16, HeldObjectMessages> m_held_object_messages;
+
 private:
 	/*
 		Blocks that have been sent to client.
@@ -553,10 +569,14 @@ public:
 	IWritableCraftDefManager* getWritableCraftDefManager();
 
 	const ModSpec* getModSpec(const std::string &modname);
+	const core::list<ModSpec> & getModSpecs(){ return m_mods; }
 	std::string getBuiltinLuaPath();
 	
 	std::string getWorldPath(){ return m_path_world; }
 
+	// Envlock should be locked when using the environment
+	ServerEnvironment & getEnv(){ return *m_env; }
+
 	bool isSingleplayer(){ return m_simple_singleplayer_mode; }
 	void SendPlayerKick(u16 peer_id);
 
@@ -580,6 +600,9 @@ private:
 	static void SendHP(con::Connection &con, u16 peer_id, u8 hp);
 	static void SendHunger(con::Connection &con, u16 peer_id, u8 hunger);
 	static void SendOxygen(con::Connection &con, u16 peer_id, u8 oxygen);
+	// Sends the values of the fields set in the PlayerStateField flags
+	static void SendPlayerState(con::Connection &con, u16 peer_id,
+			u8 fields, u8 hp, u8 hunger, u8 oxygen);
 	static void SendKick(con::Connection &con, u16 peer_id);
 	static void SendAccessDenied(con::Connection &con, u16 peer_id,
 			const std::wstring &reason);
@@ -604,6 +627,8 @@ private:
 	void SendPlayerHP(u16 peer_id);
 	void SendPlayerHunger(u16 peer_id);
 	void SendPlayerOxygen(u16 peer_id);
+	// Sends the HP, hunger and oxygen that haven't been sent yet
+	void SendPlayerState(u16 peer_id);
 	void SendMovePlayer(u16 peer_id);
 	void SendPlayerPrivileges(u16 peer_id);
 	/*
@@ -19,8 +19,11 @@ OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include "servercommand.h"
 #include "utility.h"
 #include "settings.h"
-#include "main.h" // For g_settings
+#include "main.h" // For g_settings, g_profiler
 #include "content_sao.h"
+#include "profiler.h"
+#include "filesys.h"
+#include <fstream>
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -184,6 +187,66 @@ void cmd_clearobjects(std::wostringstream &os,
 	ctx->flags |= SEND_TO_OTHERS;
 }
 
+void cmd_lag(std::wostringstream &os,
+	ServerCommandContext *ctx)
+{
+	std::string param;
+	if(ctx->parms.size() >= 2)
+		param = wide_to_narrow(ctx->parms[1]);
+
+	if(param == "dump" || param == "clear")
+	{
+		if(!ctx->server->checkPriv(ctx->player->getName(), "server"))
+		{
+			os<<L"-!- You don't have permission to do that";
+			return;
+		}
+		if(param == "clear")
+		{
+			g_profiler->clearHistograms();
+			os<<L"-!- Cleared the timing statistics";
+			return;
+		}
+		std::string path = ctx->server->getWorldPath()
+				+ DIR_DELIM + "profiler.json";
+		std::ofstream of(path.c_str(), std::ios_base::binary);
+		if(!of.good())
+		{
+			os<<L"-!- Could not open "<<narrow_to_wide(path);
+			return;
+		}
+		g_profiler->writeJson(of);
+		os<<L"-!- Wrote "<<narrow_to_wide(path);
+		actionstream<<ctx->player->getName()<<" dumps profiler data to "
+				<<path<<std::endl;
+		return;
+	}
+	if(param != "")
+	{
+		os<<L"-!- Usage: /lag [dump|clear]";
+		return;
+	}
+
+	std::ostringstream lag_os;
+	TimeHistogram h;
+	if(g_profiler->getHistogram("Server: step", h))
+	{
+		lag_os<<"-!- Server step: p50="<<(h.percentile(0.5) / 1000.0)
+				<<"ms p99="<<(h.percentile(0.99) / 1000.0)
+				<<"ms max="<<(h.getMax() / 1000.0)
+				<<"ms over "<<h.getCount()<<" steps";
+	}
+	else
+	{
+		lag_os<<"-!- No server steps timed yet";
+	}
+	std::ostringstream slow_os;
+	g_profiler->printSlowSteps(slow_os, 5, 3);
+	if(slow_os.str() != "")
+		lag_os<<"\nSlowest sections of the latest slow steps:\n"
+				<<trim(slow_os.str());
+	os<<narrow_to_wide(lag_os.str());
+}
 
 std::wstring processServerCommand(ServerCommandContext *ctx)
 {
@@ -206,6 +269,8 @@ std::wstring processServerCommand(ServerCommandContext *ctx)
 		cmd_me(os, ctx);
 	else if(ctx->parms[0] == L"clearobjects")
 		cmd_clearobjects(os, ctx);
+	else if(ctx->parms[0] == L"lag")
+		cmd_lag(os, ctx);
 	else
 		os<<L"-!- Invalid command: " + ctx->parms[0];
 	
@@ -20,12 +20,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serverobject.h"
 #include <fstream>
 #include "inventory.h"
+#include "environment.h"
 
 ServerActiveObject::ServerActiveObject(ServerEnvironment *env, v3f pos):
 	ActiveObject(0),
 	m_known_by_count(0),
 	m_removed(false),
 	m_pending_deactivation(false),
+	m_sleeping(false),
+	m_sleeping_block(0,0,0),
+	m_rest_time(0),
 	m_static_exists(false),
 	m_static_block(1337,1337,1337),
 	m_env(env),
@@ -66,6 +70,13 @@ void ServerActiveObject::registerType(u16 type, Factory f)
 	m_types.insert(type, f);
 }
 
+void ServerActiveObject::wake()
+{
+	m_rest_time = 0;
+	if(m_sleeping)
+		m_env->wakeObject(this);
+}
+
 ItemStack ServerActiveObject::getWieldedItem() const
 {
 	const Inventory *inv = getInventory();
@@ -103,6 +103,13 @@ public:
 
 	virtual std::string getDescription(){return "SAO";}
 	
+	/*
+		Move object in time. This is called for all objects before
+		step(), from many threads at once: it may only read the map and
+		change the object itself, and must not call scripts.
+	*/
+	virtual void stepPhysics(float dtime){}
+
 	/*
 		Step object in time.
 		Messages added to messages are sent to client over network.
@@ -114,6 +121,20 @@ public:
 			packet.
 	*/
 	virtual void step(float dtime, bool send_recommended){}
+
+	/*
+		Whether the last step left the object lying still with nothing
+		to do until something else changes it. The environment stops
+		stepping objects that stay so for a while; see m_sleeping.
+	*/
+	virtual bool isResting(){return false;}
+
+	/*
+		Makes a sleeping object be stepped again. Called by the object
+		itself when it is changed from outside, and by the environment
+		when the nodes around it change.
+	*/
+	void wake();
 	
 	/*
 		The return value of this is passed to the client-side object
@@ -210,6 +231,16 @@ public:
 		list.
 	*/
 	bool m_pending_deactivation;
+
+	/*
+		Whether the object is not stepped because it has been resting
+		for a while. m_sleeping_block is the block in which it fell
+		asleep, and m_rest_time the time it has been resting for.
+		These are managed by the environment.
+	*/
+	bool m_sleeping;
+	v3s16 m_sleeping_block;
+	float m_rest_time;
 	
 	/*
 		Whether the object's static data has been stored to a block
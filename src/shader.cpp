@@ -0,0 +1,162 @@
+/*
+Minetest-c55
+Copyright (C) 2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "shader.h"
+#include <IGPUProgrammingServices.h>
+#include <IMaterialRendererServices.h>
+#include "main.h" // for g_settings
+#include "settings.h"
+#include "log.h"
+
+/*
+	The vertex shader is a copy of finalColorBlend() in mapblock_mesh.cpp;
+	keep them in sync.
+*/
+static const char *daynight_vertex_shader =
+	"uniform float dayNightRatio;\n"
+	"\n"
+	"float emphaseBlueWhenDark(float b)\n"
+	"{\n"
+	"	float i = floor(b / 8.0);\n"
+	"	if(i < 0.5) return 1.0;\n"
+	"	if(i < 1.5) return 4.0;\n"
+	"	if(i < 4.5) return 6.0;\n"
+	"	if(i < 9.5) return 10.0 - i;\n"
+	"	return 0.0;\n"
+	"}\n"
+	"\n"
+	"float emphaseYellowWhenArtificial(float night)\n"
+	"{\n"
+	"	float i = floor(night / 16.0);\n"
+	"	if(i < 10.5) return 0.0;\n"
+	"	if(i < 12.5) return (i - 10.0) * 5.0;\n"
+	"	return 15.0;\n"
+	"}\n"
+	"\n"
+	"void main()\n"
+	"{\n"
+	"	gl_Position = ftransform();\n"
+	"	gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+	"	vec4 eye_pos = gl_ModelViewMatrix * gl_Vertex;\n"
+	"	gl_FogFragCoord = abs(eye_pos.z);\n"
+	"\n"
+	"	float day = floor(gl_Color.r * 255.0 + 0.5);\n"
+	"	float night = floor(gl_Color.g * 255.0 + 0.5);\n"
+	"	float rg = floor(day * dayNightRatio + night * (1.0 - dayNightRatio));\n"
+	"	float b = rg;\n"
+	"	// Moonlight is blue; rounded towards zero like integers\n"
+	"	float diff = day - night;\n"
+	"	b += sign(diff) * floor(abs(diff) / 13.0);\n"
+	"	rg -= sign(diff) * floor(abs(diff) / 23.0);\n"
+	"	b = clamp(b, 0.0, 255.0);\n"
+	"	b += emphaseBlueWhenDark(b);\n"
+	"	// Artificial light is yellow-ish\n"
+	"	rg += emphaseYellowWhenArtificial(night);\n"
+	"	rg = clamp(rg, 0.0, 255.0);\n"
+	"	gl_FrontColor = vec4(rg / 255.0, rg / 255.0, min(b, 255.0) / 255.0,\n"
+	"			gl_Color.a);\n"
+	"}\n";
+
+static const char *daynight_pixel_shader =
+	"uniform sampler2D baseTexture;\n"
+	"\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 col = texture2D(baseTexture, gl_TexCoord[0].st) * gl_Color;\n"
+	"	float fog = clamp((gl_Fog.end - gl_FogFragCoord) * gl_Fog.scale,\n"
+	"			0.0, 1.0);\n"
+	"	gl_FragColor = vec4(mix(gl_Fog.color.rgb, col.rgb, fog), col.a);\n"
+	"}\n";
+
+DayNightShader::DayNightShader(IrrlichtDevice *device):
+	m_enabled(false),
+	m_daynight_ratio(1000)
+{
+	if(!g_settings->getBool("enable_shaders"))
+		return;
+
+	video::IVideoDriver *driver = device->getVideoDriver();
+	// The shaders are written in GLSL
+	if(driver->getDriverType() != video::EDT_OPENGL
+			|| !driver->queryFeature(video::EVDF_ARB_GLSL))
+	{
+		infostream<<"DayNightShader: GLSL not supported, blending "
+				<<"day and night light on the CPU"<<std::endl;
+		return;
+	}
+	video::IGPUProgrammingServices *gpu = driver->getGPUProgrammingServices();
+	if(gpu == NULL)
+		return;
+
+	// The material types used by MapBlockMesh and TileSpec
+	const video::E_MATERIAL_TYPE base_materials[] = {
+		video::EMT_SOLID,
+		video::EMT_TRANSPARENT_ALPHA_CHANNEL_REF,
+		video::EMT_TRANSPARENT_ALPHA_CHANNEL,
+		video::EMT_TRANSPARENT_VERTEX_ALPHA,
+	};
+	const u32 base_material_count =
+			sizeof(base_materials) / sizeof(base_materials[0]);
+	for(u32 i=0; i<base_material_count; i++)
+	{
+		s32 id = gpu->addHighLevelShaderMaterial(
+				daynight_vertex_shader, "main", video::EVST_VS_1_1,
+				daynight_pixel_shader, "main", video::EPST_PS_1_1,
+				this, base_materials[i]);
+		if(id < 0)
+		{
+			errorstream<<"DayNightShader: Failed to create shader "
+					<<"material, blending day and night light on the CPU"
+					<<std::endl;
+			m_materials.clear();
+			return;
+		}
+		m_materials[base_materials[i]] = (video::E_MATERIAL_TYPE)id;
+	}
+
+	infostream<<"DayNightShader: Blending day and night light on the GPU"
+			<<std::endl;
+	m_enabled = true;
+}
+
+DayNightShader::~DayNightShader()
+{
+}
+
+video::E_MATERIAL_TYPE DayNightShader::getMaterialType(
+		video::E_MATERIAL_TYPE base_material) const
+{
+	std::map<video::E_MATERIAL_TYPE, video::E_MATERIAL_TYPE>::const_iterator
+			i = m_materials.find(base_material);
+	if(i == m_materials.end())
+		return base_material;
+	return i->second;
+}
+
+void DayNightShader::OnSetConstants(video::IMaterialRendererServices *services,
+		s32 userData)
+{
+	f32 ratio = (f32)m_daynight_ratio / 1000.0;
+	services->setVertexShaderConstant("dayNightRatio", &ratio, 1);
+	s32 texture_layer = 0;
+	// Irrlicht passes the value of samplers on as integers
+	services->setPixelShaderConstant("baseTexture",
+			(const f32*)&texture_layer, 1);
+}
+
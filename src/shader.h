@@ -0,0 +1,70 @@
+/*
+Minetest-c55
+Copyright (C) 2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef SHADER_HEADER
+#define SHADER_HEADER
+
+#include "common_irrlicht.h"
+#include <IShaderConstantSetCallBack.h>
+#include <map>
+
+/*
+	Blends the day and night light of map block meshes on the GPU.
+
+	The vertices of the meshes keep the day light in the red and the
+	night light in the green channel of their color (see
+	MapBlock_LightColor), and the shader does what finalColorBlend()
+	does on the CPU with the day/night ratio as a uniform. This way
+	day/night transitions don't touch the meshes at all.
+
+	If the driver doesn't support GLSL or shaders are disabled,
+	isEnabled() returns false and the meshes are blended on the CPU.
+*/
+class DayNightShader : public video::IShaderConstantSetCallBack
+{
+public:
+	// Creates the shader materials; must be called from the main thread
+	DayNightShader(IrrlichtDevice *device);
+	~DayNightShader();
+
+	bool isEnabled()
+	{ return m_enabled; }
+
+	/*
+		Returns the shader material to use in place of base_material.
+		Can be called from any thread after construction.
+	*/
+	video::E_MATERIAL_TYPE getMaterialType(
+			video::E_MATERIAL_TYPE base_material) const;
+
+	// 0...1000, like Environment::getDayNightRatio()
+	void setDayNightRatio(u32 daynight_ratio)
+	{ m_daynight_ratio = daynight_ratio; }
+
+	virtual void OnSetConstants(video::IMaterialRendererServices *services,
+			s32 userData);
+
+private:
+	bool m_enabled;
+	u32 m_daynight_ratio;
+	std::map<video::E_MATERIAL_TYPE, video::E_MATERIAL_TYPE> m_materials;
+};
+
+#endif
+
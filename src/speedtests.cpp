@@ -27,6 +27,29 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common_irrlicht.h"
 #include "utility.h"
 #include "log.h"
+#include "porting.h"
+#include "filesys.h"
+#include "script.h"
+#include "server.h"
+#include "environment.h"
+#include "map.h"
+#include "serverobject.h"
+#include "content_sao.h"
+#include "collision.h"
+#include "nodedef.h"
+#include "subgame.h"
+#ifndef SERVER
+#include "mapblock.h"
+#include "mapblock_mesh.h"
+#include "client.h"
+#include "tile.h"
+#include "settings.h"
+#include "main.h" // g_settings
+#endif
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
 
 void SpeedTest::SpeedTests()
 {
@@ -115,4 +138,360 @@ void SpeedTest::SpeedTests()
 		infostream<<"Done. "<<dtime<<"ms, "
 				<<per_ms<<"/ms"<<std::endl;
 	}
+
+	std::string luabench_path = porting::path_share + DIR_DELIM + "util"
+			+ DIR_DELIM + "luabench";
+	if(fs::PathExists(luabench_path))
+		LuaSpeedTests(luabench_path);
+	else
+		infostream<<"Lua speed tests not found at "<<luabench_path
+				<<", skipping"<<std::endl;
+}
+
+void SpeedTest::LuaSpeedTests(const std::string &path)
+{
+	infostream<<"Running Lua speed tests ("<<script_interpreter_name()
+			<<")"<<std::endl;
+
+	lua_State *L = script_init();
+	lua_pushstring(L, path.c_str());
+	lua_setglobal(L, "luabench_path");
+	lua_pushboolean(L, true);
+	lua_setglobal(L, "luabench_engine");
+
+	std::string init_path = path + DIR_DELIM + "init.lua";
+	if(!script_load(L, init_path.c_str())){
+		errorstream<<"Lua speed tests failed to run"<<std::endl;
+		script_deinit(L);
+		return;
+	}
+
+	lua_getglobal(L, "luabench");
+	if(lua_istable(L, -1)){
+		lua_getfield(L, -1, "results");
+		if(lua_istable(L, -1)){
+			int table = lua_gettop(L);
+			lua_pushnil(L);
+			while(lua_next(L, table) != 0){
+				// key at index -2 and value at index -1
+				lua_getfield(L, -1, "name");
+				lua_getfield(L, -2, "ops");
+				const char *name = lua_tostring(L, -2);
+				double ops = lua_tonumber(L, -1);
+				infostream<<"Lua: "<<(name ? name : "?")<<": "
+						<<(u32)ops<<" ops/s"<<std::endl;
+				lua_pop(L, 3);
+			}
+		}
+		lua_pop(L, 1);
+		lua_getfield(L, -1, "interpreter");
+		if(lua_isstring(L, -1))
+			infostream<<"Lua: interpreter: "<<lua_tostring(L, -1)
+					<<std::endl;
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	script_deinit(L);
+}
+
+void SpeedTest::ObjectSpeedTests(const std::string &world_path,
+		const SubgameSpec &gamespec)
+{
+	infostream<<"Running object speed tests on world ["<<world_path<<"]"
+			<<std::endl;
+
+	Server *server = new Server(world_path, "", gamespec, false);
+	ServerEnvironment &env = server->getEnv();
+
+	// Load or generate the blocks the items fall into
+	const s16 radius = 3;
+	ServerMap &map = env.getServerMap();
+	for(s16 z=-radius; z<=radius; z++)
+	for(s16 y=-radius; y<=radius; y++)
+	for(s16 x=-radius; x<=radius; x++)
+		map.emergeBlock(v3s16(x,y,z), true);
+
+	/*
+		Collision of single objects standing on the ground, walking
+		along it and falling through the air, for around 100ms each
+	*/
+	{
+		INodeDefManager *ndef = server->getNodeDefManager();
+		std::vector<v3f> ground;
+		mysrand(2);
+		for(u32 i=0; i<10000 && ground.size()<1000; i++)
+		{
+			v3s16 p(myrand_range(-40, 40), 0, myrand_range(-40, 40));
+			for(p.Y=40; p.Y>-40; p.Y--)
+			{
+				if(ndef->get(map.getNodeNoEx(p)).walkable)
+				{
+					ground.push_back(v3f(p.X, p.Y+0.5, p.Z)*BS);
+					break;
+				}
+			}
+		}
+		core::aabbox3d<f32> box(-BS*0.3,0.0,-BS*0.3, BS*0.3,BS*1.7,BS*0.3);
+		const char *names[3] = {"standing", "walking", "falling"};
+		v3f speeds[3] = {v3f(0,-0.5*BS,0), v3f(2*BS,-0.5*BS,BS),
+				v3f(0,-10*BS,0)};
+		v3f offsets[3] = {v3f(0,0,0), v3f(0,0,0), v3f(0,20*BS,0)};
+		for(u32 j=0; j<3 && ground.size() > 0; j++)
+		{
+			u32 count = 0;
+			u32 t0 = porting::getTimeMs();
+			do{
+				for(u32 i=0; i<ground.size(); i++)
+				{
+					v3f pos = ground[i] + offsets[j];
+					v3f speed = speeds[j];
+					collisionMovePrecise(&map, server, BS*0.25, box, 0.05,
+							pos, speed);
+				}
+				count += ground.size();
+			}
+			while(porting::getTimeMs() - t0 < 100);
+			u32 dtime = porting::getTimeMs() - t0;
+			dstream<<"Collision, "<<names[j]<<": "<<(count / dtime)
+					<<" moves/ms"<<std::endl;
+		}
+	}
+
+	/*
+		Drop the same items for every thread count and step them like
+		the environment does: first move all of them, then let each one
+		send its position. The final positions are summed up to check
+		that the threads don't change the result.
+	*/
+	const u32 item_count = 5000;
+	const u32 step_count = 20;
+	const float dtime = 0.2;
+	u32 max_threads = MYMAX(porting::getNumberOfProcessors(), 2);
+	v3f first_sum(0,0,0);
+	dstream<<"Object speed tests: "<<item_count<<" items, "<<step_count
+			<<" steps"<<std::endl;
+	for(u32 threads=1; threads<=max_threads; threads*=2)
+	{
+		mysrand(1);
+		std::vector<ServerActiveObject*> objects;
+		for(u32 i=0; i<item_count; i++)
+		{
+			v3f pos(myrand_range(-40, 40), myrand_range(-10, 30),
+					myrand_range(-40, 40));
+			objects.push_back(createItemSAO(&env, pos*BS,
+					"default:cobble"));
+		}
+
+		ObjectPhysicsManager manager;
+		manager.setThreadCount(threads);
+		u32 t_physics = 0;
+		u32 t0 = porting::getTimeMs();
+		for(u32 j=0; j<step_count; j++)
+		{
+			u32 t1 = porting::getTimeMs();
+			manager.step(dtime, objects);
+			t_physics += porting::getTimeMs() - t1;
+			for(u32 i=0; i<objects.size(); i++)
+				objects[i]->step(dtime, true);
+		}
+		u32 t_total = porting::getTimeMs() - t0;
+
+		v3f sum(0,0,0);
+		for(u32 i=0; i<objects.size(); i++)
+		{
+			sum += objects[i]->getBasePosition();
+			delete objects[i];
+		}
+		if(threads == 1)
+			first_sum = sum;
+
+		dstream<<"  "<<threads<<" threads: "<<(t_physics / step_count)
+				<<"ms physics, "<<(t_total / step_count)<<"ms total per step"
+				<<(sum == first_sum ? "" : ", RESULT DIFFERS")<<std::endl;
+	}
+
+	delete server;
+}
+
+#ifndef SERVER
+
+/*
+	Gives the mesh generator the node definitions of the server with
+	textures of the client side texture source
+*/
+class MeshSpeedTestGameDef : public IGameDef
+{
+public:
+	MeshSpeedTestGameDef(IGameDef *server, INodeDefManager *ndef,
+			ITextureSource *tsrc):
+		m_server(server),
+		m_ndef(ndef),
+		m_tsrc(tsrc)
+	{}
+	virtual IItemDefManager* getItemDefManager()
+		{ return m_server->getItemDefManager(); }
+	virtual INodeDefManager* getNodeDefManager()
+		{ return m_ndef; }
+	virtual ICraftDefManager* getCraftDefManager()
+		{ return m_server->getCraftDefManager(); }
+	virtual ITextureSource* getTextureSource()
+		{ return m_tsrc; }
+	virtual u16 allocateUnknownNodeId(const std::string &name)
+		{ return m_server->allocateUnknownNodeId(name); }
+	virtual ISoundManager* getSoundManager()
+		{ return m_server->getSoundManager(); }
+	virtual MtEventManager* getEventManager()
+		{ return m_server->getEventManager(); }
+private:
+	IGameDef *m_server;
+	INodeDefManager *m_ndef;
+	ITextureSource *m_tsrc;
+};
+
+void SpeedTest::MeshSpeedTests(IrrlichtDevice *device,
+		const std::string &world_path, const SubgameSpec &gamespec)
+{
+	infostream<<"Running mesh speed tests on world ["<<world_path<<"]"
+			<<std::endl;
+
+	Server *server = new Server(world_path, "", gamespec, false);
+	video::IVideoDriver *driver = device->getVideoDriver();
+	IWritableTextureSource *tsrc = createTextureSource(device);
+
+	// Load the textures of the mods like the client loads received media
+	const core::list<ModSpec> &mods = server->getModSpecs();
+	for(core::list<ModSpec>::ConstIterator i = mods.begin();
+			i != mods.end(); i++)
+	{
+		std::string texturepath = i->path + DIR_DELIM + "textures";
+		std::vector<fs::DirListNode> dirlist = fs::GetDirListing(texturepath);
+		for(u32 j=0; j<dirlist.size(); j++){
+			if(dirlist[j].dir)
+				continue;
+			std::string filepath = texturepath + DIR_DELIM + dirlist[j].name;
+			video::IImage *img = driver->createImageFromFile(filepath.c_str());
+			if(img == NULL)
+				continue;
+			tsrc->insertSourceImage(dirlist[j].name, img);
+			img->drop();
+		}
+	}
+
+	IWritableNodeDefManager *ndef = server->getWritableNodeDefManager()->clone();
+	ndef->updateTextures(tsrc);
+	MeshSpeedTestGameDef gamedef(server, ndef, tsrc);
+
+	// Load the blocks around the origin; the outermost layer is only
+	// loaded for the neighbor data of the meshed blocks
+	const s16 radius = 4;
+	ServerMap &map = server->getEnv().getServerMap();
+	core::list<v3s16> blocks;
+	for(s16 z=-radius-1; z<=radius+1; z++)
+	for(s16 y=-radius-1; y<=radius+1; y++)
+	for(s16 x=-radius-1; x<=radius+1; x++)
+	{
+		v3s16 p(x,y,z);
+		MapBlock *block = map.emergeBlock(p, false);
+		if(block == NULL)
+			continue;
+		if(p.X < -radius || p.X > radius || p.Y < -radius || p.Y > radius
+				|| p.Z < -radius || p.Z > radius)
+			continue;
+		blocks.push_back(p);
+	}
+	if(blocks.size() == 0){
+		errorstream<<"Mesh speed tests: No saved blocks within "<<radius
+				<<" blocks of the origin"<<std::endl;
+	}
+	bool smooth_lighting = g_settings->getBool("smooth_lighting");
+
+	/*
+		Single thread, without and with greedy meshing. The first,
+		untimed pass generates all the textures needed, so that the
+		threads do not have to wait for them.
+	*/
+	u32 t_single[2] = {0, 0};
+	u32 vertex_counts[2] = {0, 0};
+	u32 index_counts[2] = {0, 0};
+	for(s32 pass=-1; pass<2; pass++)
+	{
+		u32 t0 = porting::getTimeMs();
+		for(core::list<v3s16>::Iterator i = blocks.begin();
+				i != blocks.end(); i++)
+		{
+			MeshMakeData data(&gamedef);
+			data.fill(map.getBlockNoCreateNoEx(*i));
+			data.setSmoothLighting(smooth_lighting);
+			data.setGreedyMeshing(pass == 1);
+			MapBlockMesh *mesh = new MapBlockMesh(&data);
+			if(pass >= 0)
+			{
+				scene::SMesh *m = mesh->getMesh();
+				for(u32 j=0; j<m->getMeshBufferCount(); j++)
+				{
+					vertex_counts[pass] += m->getMeshBuffer(j)->getVertexCount();
+					index_counts[pass] += m->getMeshBuffer(j)->getIndexCount();
+				}
+			}
+			delete mesh;
+		}
+		if(pass >= 0)
+			t_single[pass] = porting::getTimeMs() - t0;
+	}
+
+	/*
+		Thread pool
+	*/
+	u32 t_pool = 0;
+	u32 thread_count = 0;
+	{
+		MeshUpdateManager manager;
+		u32 t0 = porting::getTimeMs();
+		for(core::list<v3s16>::Iterator i = blocks.begin();
+				i != blocks.end(); i++)
+		{
+			MeshMakeData *data = new MeshMakeData(&gamedef);
+			data->fill(map.getBlockNoCreateNoEx(*i));
+			data->setSmoothLighting(smooth_lighting);
+			data->setGreedyMeshing(g_settings->getBool("greedy_meshing"));
+			manager.m_queue_in.addBlock(*i, data, false, false);
+		}
+		manager.start(g_settings->getU16("mesh_generation_threads"));
+		thread_count = manager.getThreadCount();
+		u32 done_count = 0;
+		while(done_count < blocks.size())
+		{
+			// Texture requests of the threads are served here
+			tsrc->processQueue();
+			while(manager.m_queue_out.size() > 0)
+			{
+				MeshUpdateResult r = manager.m_queue_out.pop_front();
+				delete r.mesh;
+				done_count++;
+			}
+			sleep_ms(1);
+		}
+		t_pool = porting::getTimeMs() - t0;
+		manager.stop();
+	}
+
+	u32 count = blocks.size();
+	dstream<<"Mesh speed tests: "<<count<<" blocks"<<std::endl;
+	const char *pass_names[2] = {"rows", "greedy"};
+	for(u32 pass=0; pass<2; pass++)
+	{
+		dstream<<"  1 thread, "<<pass_names[pass]<<": "<<t_single[pass]<<"ms, "
+				<<(t_single[pass] ? count * 1000 / t_single[pass] : 0)
+				<<" meshes/s, "<<vertex_counts[pass]<<" vertices, "
+				<<index_counts[pass]<<" indices"<<std::endl;
+	}
+	dstream<<"  "<<thread_count<<" threads: "<<t_pool<<"ms, "
+			<<(t_pool ? count * 1000 / t_pool : 0)<<" meshes/s"<<std::endl;
+
+	delete ndef;
+	delete tsrc;
+	delete server;
 }
+
+#endif
@@ -29,6 +29,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string>
 #include "common_irrlicht.h"
 
+struct SubgameSpec;
+
 class SpeedTest
 {
 	private:
@@ -43,6 +45,18 @@ class SpeedTest
 
 	public:
 	void SpeedTests();
+	// Runs the Lua microbenchmarks in util/luabench
+	void LuaSpeedTests(const std::string &path);
+	// Moves thousands of dropped items in a world with different
+	// numbers of object physics threads
+	void ObjectSpeedTests(const std::string &world_path,
+			const SubgameSpec &gamespec);
+#ifndef SERVER
+	// Meshes a region of a saved world, first in the calling thread
+	// and then with the mesh update thread pool
+	void MeshSpeedTests(IrrlichtDevice *device, const std::string &world_path,
+			const SubgameSpec &gamespec);
+#endif
 };
 
 #endif
@@ -33,10 +33,22 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_mapnode.h"
 #include "nodedef.h"
 #include "mapsector.h"
+#include "mapblock.h"
 #include "settings.h"
 #include "log.h"
 #include "utility_string.h"
 #include "voxelalgorithms.h"
+#include "nodetimer.h"
+#include "environment.h"
+#include "script.h"
+#include "profiler.h"
+#include "collision.h"
+#include "gamedef.h"
+#include "filesys.h"
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
 
 /*
 	Asserts that the exception occurs
@@ -124,6 +136,25 @@ void define_some_nodes(IWritableItemDefManager *idef, IWritableNodeDefManager *n
 	ndef->set(i, f);
 }
 
+/*
+	A game definition with only the node definitions, for tests that
+	need a map
+*/
+class TestGameDef : public IGameDef
+{
+public:
+	TestGameDef(INodeDefManager *ndef): m_ndef(ndef) {}
+	IItemDefManager* getItemDefManager(){ return NULL; }
+	INodeDefManager* getNodeDefManager(){ return m_ndef; }
+	ICraftDefManager* getCraftDefManager(){ return NULL; }
+	ITextureSource* getTextureSource(){ return NULL; }
+	u16 allocateUnknownNodeId(const std::string &name){ return 0; }
+	ISoundManager* getSoundManager(){ return NULL; }
+	MtEventManager* getEventManager(){ return NULL; }
+private:
+	INodeDefManager *m_ndef;
+};
+
 struct TestUtilities
 {
 	void Run()
@@ -1416,6 +1447,587 @@ struct TestConnection
 	}
 };
 
+struct TestNodeTimerList
+{
+	void Run()
+	{
+		NodeTimerList timers;
+		std::vector<std::pair<v3s16, NodeTimer> > expired;
+
+		timers.set(v3s16(1,2,3), NodeTimer(2.0, 0));
+		timers.set(v3s16(4,5,6), NodeTimer(5.0, 1.0));
+		assert(timers.size() == 2);
+		assert(timers.get(v3s16(4,5,6)).isStarted());
+		assert(!timers.get(v3s16(0,0,0)).isStarted());
+
+		// Nothing is due yet
+		timers.step(1.0, expired);
+		assert(expired.empty());
+		assert(fabs(timers.get(v3s16(4,5,6)).elapsed - 2.0) < 0.001);
+
+		// Only the first one is due
+		timers.step(1.5, expired);
+		assert(expired.size() == 1);
+		assert(expired[0].first == v3s16(1,2,3));
+		assert(fabs(expired[0].second.elapsed - 2.5) < 0.001);
+		assert(timers.size() == 1);
+
+		// Serialization keeps the remaining time
+		std::ostringstream os(std::ios_base::binary);
+		timers.serialize(os);
+		NodeTimerList timers2;
+		std::istringstream is(os.str(), std::ios_base::binary);
+		timers2.deSerialize(is);
+		assert(timers2.size() == 1);
+		expired.clear();
+		timers2.step(1.0, expired);
+		assert(expired.empty());
+		timers2.step(0.5, expired);
+		assert(expired.size() == 1);
+		assert(expired[0].first == v3s16(4,5,6));
+		assert(fabs(expired[0].second.elapsed - 5.0) < 0.001);
+
+		// Setting replaces and removing stops
+		timers.set(v3s16(4,5,6), NodeTimer(10.0, 0));
+		timers.remove(v3s16(4,5,6));
+		assert(timers.size() == 0);
+		expired.clear();
+		timers.step(100.0, expired);
+		assert(expired.empty());
+	}
+};
+
+struct TestMapBlockCompression
+{
+	void Run()
+	{
+		MapBlock block(NULL, v3s16(0,0,0), NULL);
+		const u32 fullsize = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+				* sizeof(MapNode);
+
+		// A block of one kind of node only needs the palette
+		block.compressNodes();
+		assert(block.isCompressed());
+		assert(!block.isDummy());
+		assert(block.getNodeDataSize() < 100);
+		assert(block.getNode(v3s16(1,2,3)).getContent() == CONTENT_IGNORE);
+		assert(!block.isCompressed());
+		assert(block.getNodeDataSize() == fullsize);
+
+		// Palettes of 3 and of 300 nodes
+		for(u32 count=3; count<=300; count+=297)
+		{
+			for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+			{
+				u32 k = ((z*MAP_BLOCKSIZE + y)*MAP_BLOCKSIZE + x) % count;
+				MapNode n(k % 100, k / 100, k % 7);
+				block.setNode(x, y, z, n);
+			}
+			block.compressNodes();
+			assert(block.isCompressed());
+			assert(block.getNodeDataSize() < fullsize);
+			for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+			{
+				u32 k = ((z*MAP_BLOCKSIZE + y)*MAP_BLOCKSIZE + x) % count;
+				MapNode n = block.getNode(v3s16(x,y,z));
+				assert(n.getContent() == k % 100);
+				assert(n.getParam1() == k / 100);
+				assert(n.getParam2() == k % 7);
+			}
+		}
+	}
+};
+
+struct TestCollision
+{
+	static bool near(f32 a, f32 b)
+	{
+		return fabs(a - b) < 0.01*BS;
+	}
+
+	void Run(INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(ndef);
+		Map map(infostream, &gamedef);
+		/*
+			Only block (0,0,0) is loaded. It has a floor at y=0, a wall
+			at x=10 for z<=8, a wall at z=12 for x<=8, a ceiling node
+			at (3,6,3) and a hole in the floor at (7,0,7).
+		*/
+		ServerMapSector *sector = new ServerMapSector(&map, v2s16(0,0),
+				&gamedef);
+		map.getSectorsPtr()->insert(v2s16(0,0), sector);
+		MapBlock *block = sector->createBlankBlock(0);
+		MapNode air(CONTENT_AIR);
+		MapNode stone(CONTENT_STONE);
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			bool walkable = (y == 0)
+					|| (x == 10 && y <= 3 && z <= 8)
+					|| (z == 12 && y <= 3 && x <= 8)
+					|| (x == 3 && y == 6 && z == 3);
+			if(x == 7 && y == 0 && z == 7)
+				walkable = false;
+			block->setNode(v3s16(x,y,z), walkable ? stone : air);
+		}
+
+		core::aabbox3d<f32> box(-0.4*BS,-0.4*BS,-0.4*BS,
+				0.4*BS,0.4*BS,0.4*BS);
+		f32 pos_max_d = 0.25*BS;
+		collisionMoveResult r;
+		v3f pos;
+		v3f speed;
+
+		// Hit on the X axis
+		pos = v3f(5*BS, 2*BS, 5*BS);
+		speed = v3f(10*BS, 0, 0);
+		r = collisionMoveSimple(&map, &gamedef, pos_max_d, box, 1.0,
+				pos, speed);
+		assert(r.collides);
+		assert(!r.touching_ground);
+		assert(near(pos.X, 9.1*BS) && near(pos.Y, 2*BS) && near(pos.Z, 5*BS));
+		assert(speed.X == 0);
+
+		// Hit on the Z axis
+		pos = v3f(5*BS, 2*BS, 5*BS);
+		speed = v3f(0, 0, 10*BS);
+		r = collisionMoveSimple(&map, &gamedef, pos_max_d, box, 1.0,
+				pos, speed);
+		assert(r.collides);
+		assert(near(pos.X, 5*BS) && near(pos.Z, 11.1*BS));
+		assert(speed.Z == 0);
+
+		// Hit on the Y axis, falling onto the floor
+		pos = v3f(5*BS, 3*BS, 5*BS);
+		speed = v3f(0, -10*BS, 0);
+		r = collisionMoveSimple(&map, &gamedef, pos_max_d, box, 1.0,
+				pos, speed);
+		assert(r.collides);
+		assert(r.touching_ground);
+		assert(near(pos.Y, 0.9*BS));
+		assert(speed.Y == 0);
+
+		// Hit on the Y axis, jumping against the ceiling
+		pos = v3f(3*BS, 3*BS, 3*BS);
+		speed = v3f(0, 10*BS, 0);
+		r = collisionMoveSimple(&map, &gamedef, pos_max_d, box, 1.0,
+				pos, speed);
+		assert(r.collides);
+		assert(near(pos.Y, 5.1*BS));
+		assert(speed.Y == 0);
+
+		// Sliding along the wall for the rest of the time
+		pos = v3f(5*BS, 2*BS, 5*BS);
+		speed = v3f(10*BS, 0, 2*BS);
+		r = collisionMoveSimple(&map, &gamedef, pos_max_d, box, 1.0,
+				pos, speed);
+		assert(r.collides);
+		assert(near(pos.X, 9.1*BS) && near(pos.Z, 7*BS));
+		assert(speed.X == 0 && speed.Z == 2*BS);
+
+		// Resting on the floor only looks at the nodes under the object
+		pos = v3f(5*BS, 0.9*BS, 5*BS);
+		speed = v3f(0, -1*BS, 0);
+		r = collisionMoveSimple(&map, &gamedef, pos_max_d, box, 0.1,
+				pos, speed);
+		assert(r.collides);
+		assert(r.touching_ground);
+		assert(pos == v3f(5*BS, 0.9*BS, 5*BS));
+		assert(speed.Y == 0);
+
+		// Resting over the hole in the floor falls into it
+		pos = v3f(7*BS, 0.9*BS, 7*BS);
+		speed = v3f(0, -1*BS, 0);
+		r = collisionMoveSimple(&map, &gamedef, pos_max_d, box, 0.1,
+				pos, speed);
+		assert(!r.collides);
+		assert(!r.touching_ground);
+		assert(near(pos.Y, 0.8*BS));
+		assert(speed.Y == -1*BS);
+
+		// Starting inside a node, the object moves out of it freely
+		pos = v3f(10*BS, 2*BS, 5*BS);
+		speed = v3f(-10*BS, 0, 0);
+		r = collisionMoveSimple(&map, &gamedef, pos_max_d, box, 0.5,
+				pos, speed);
+		assert(!r.collides);
+		assert(near(pos.X, 5*BS));
+		assert(speed.X == -10*BS);
+
+		// Nodes of blocks that are not loaded are walkable
+		pos = v3f(5*BS, 2*BS, 5*BS);
+		speed = v3f(0, 0, -10*BS);
+		r = collisionMoveSimple(&map, &gamedef, pos_max_d, box, 1.0,
+				pos, speed);
+		assert(r.collides);
+		assert(near(pos.Z, -0.1*BS));
+		assert(speed.Z == 0);
+
+		/*
+			Moves longer than 4 nodes are split into parts
+		*/
+
+		// Nothing is skipped over: 12 nodes, the wall is in the 2nd part
+		pos = v3f(3*BS, 2*BS, 3*BS);
+		speed = v3f(60*BS, 0, 0);
+		r = collisionMovePrecise(&map, &gamedef, pos_max_d, box, 0.2,
+				pos, speed);
+		assert(r.collides);
+		assert(near(pos.X, 9.1*BS));
+		assert(speed.X == 0);
+
+		// A free move covers all of its length
+		pos = v3f(2*BS, 2*BS, 14*BS);
+		speed = v3f(10*BS, 0, 0);
+		r = collisionMovePrecise(&map, &gamedef, pos_max_d, box, 0.9,
+				pos, speed);
+		assert(!r.collides);
+		assert(near(pos.X, 11*BS));
+		assert(speed.X == 10*BS);
+
+		// Until it reaches the border of the loaded blocks
+		r = collisionMovePrecise(&map, &gamedef, pos_max_d, box, 0.9,
+				pos, speed);
+		assert(r.collides);
+		assert(near(pos.X, 15.1*BS));
+		assert(speed.X == 0);
+	}
+};
+
+struct TestPlayerDatabase
+{
+	void Run(INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(ndef);
+		std::string savedir = porting::path_user + DIR_DELIM
+				+ "test_player_database";
+		fs::RecursiveDelete(savedir);
+
+		// Player data is binary
+		std::string data1("first\0player", 12);
+		std::string data2 = "second player";
+		std::string data;
+		{
+			ServerMap map(savedir, &gamedef);
+			assert(map.loadPlayer("player1", data) == false);
+			map.beginSave();
+			assert(map.savePlayer("player1", data1));
+			assert(map.savePlayer("player2", data2));
+			map.endSave();
+			assert(map.loadPlayer("player1", data));
+			assert(data == data1);
+			// Saving again replaces the data
+			assert(map.savePlayer("player1", data2));
+			assert(map.loadPlayer("player1", data));
+			assert(data == data2);
+			assert(map.savePlayer("player1", data1));
+		}
+		// The players are kept when the map is opened again
+		{
+			ServerMap map(savedir, &gamedef);
+			assert(map.loadPlayer("player1", data));
+			assert(data == data1);
+			assert(map.loadPlayer("player2", data));
+			assert(data == data2);
+			assert(map.loadPlayer("player3", data) == false);
+		}
+
+		fs::RecursiveDelete(savedir);
+	}
+};
+
+struct TestScriptBudget
+{
+	// Loads code as if it was a file of the mod "testmod"
+	void load(lua_State *L, const char *code)
+	{
+		int ret = luaL_loadbuffer(L, code, strlen(code),
+				"@mods/testmod/init.lua");
+		assert(ret == 0);
+	}
+
+	void Run()
+	{
+		lua_State *L = script_init();
+		script_budget_configure(L, 50, 0, 100, 2, 60);
+
+		// Callbacks within the budget return normally
+		load(L, "return 42");
+		assert(script_pcall_budget(L, 0, 1, "test", true) == 0);
+		assert(lua_tonumber(L, -1) == 42);
+		lua_pop(L, 1);
+
+		// Runaway callbacks are aborted and return nil
+		load(L, "while true do pcall(function() while true do end end) end");
+		u32 t0 = porting::getTimeMs();
+		assert(script_pcall_budget(L, 0, 1, "test", true) == 0);
+		assert(porting::getTimeMs() - t0 < 5000);
+		assert(lua_isnil(L, -1));
+		lua_pop(L, 1);
+
+		// Normal errors are still returned to the caller
+		load(L, "error('foo')");
+		assert(script_pcall_budget(L, 0, 0, "test", false) != 0);
+		lua_pop(L, 1);
+
+		// The second abort makes the mod deferred
+		load(L, "while true do end");
+		assert(script_pcall_budget(L, 0, 0, "test", true) == 0);
+		load(L, "return 42");
+		assert(script_pcall_budget(L, 0, 1, "test", true) == 0);
+		assert(lua_isnil(L, -1));
+		lua_pop(L, 1);
+		// ...but only its deferrable callbacks
+		load(L, "return 42");
+		assert(script_pcall_budget(L, 0, 1, "test", false) == 0);
+		assert(lua_tonumber(L, -1) == 42);
+		lua_pop(L, 1);
+
+		assert(lua_gettop(L) == 0);
+		script_deinit(L);
+	}
+};
+
+struct TestActiveBlockList
+{
+	bool inRange(core::list<v3s16> &positions, s16 radius, v3s16 p)
+	{
+		for(core::list<v3s16>::Iterator i = positions.begin();
+				i != positions.end(); i++)
+		{
+			v3s16 d = p - *i;
+			if(abs(d.X) <= radius && abs(d.Y) <= radius &&
+					abs(d.Z) <= radius)
+				return true;
+		}
+		return false;
+	}
+
+	void Run()
+	{
+		ActiveBlockList list;
+		core::map<v3s16, bool> removed;
+		core::map<v3s16, bool> added;
+		core::map<v3s16, bool> old_list;
+		s16 radius = 2;
+		v3s16 pos[3] = {v3s16(0,0,0), v3s16(1,0,0), v3s16(10,0,-3)};
+		mysrand(5);
+		for(u32 step=0; step<40; step++)
+		{
+			// Wander around, sometimes onto each other, and change the
+			// radius once
+			for(u32 i=0; i<3; i++)
+				pos[i] += v3s16(myrand_range(-1,1), myrand_range(-1,1),
+						myrand_range(-2,2));
+			if(step % 7 == 3)
+				pos[1] = pos[0];
+			if(step == 20)
+				radius = 3;
+			core::list<v3s16> positions;
+			for(u32 i=0; i<(step == 30 ? 2 : 3); i++)
+				positions.push_back(pos[i]);
+
+			removed.clear();
+			added.clear();
+			list.update(positions, radius, removed, added);
+
+			// The list has the blocks in range of any position...
+			VoxelArea area;
+			for(core::list<v3s16>::Iterator i = positions.begin();
+					i != positions.end(); i++)
+				area.addPoint(*i);
+			area.pad(v3s16(1,1,1)*(radius+1));
+			u32 count = 0;
+			u32 added_count = 0;
+			v3s16 p;
+			for(p.X=area.MinEdge.X; p.X<=area.MaxEdge.X; p.X++)
+			for(p.Y=area.MinEdge.Y; p.Y<=area.MaxEdge.Y; p.Y++)
+			for(p.Z=area.MinEdge.Z; p.Z<=area.MaxEdge.Z; p.Z++)
+			{
+				bool in_range = inRange(positions, radius, p);
+				assert(list.contains(p) == in_range);
+				if(in_range)
+					count++;
+				// ...and the changes are the difference to the last one
+				bool was = (old_list.find(p) != NULL);
+				assert((added.find(p) != NULL) == (in_range && !was));
+				if(in_range && !was)
+					added_count++;
+			}
+			assert(list.m_list.size() == count);
+			assert(added.size() == added_count);
+			u32 removed_count = 0;
+			for(core::map<v3s16, bool>::Iterator
+					i = old_list.getIterator();
+					i.atEnd()==false; i++)
+			{
+				if(inRange(positions, radius, i.getNode()->getKey()))
+					continue;
+				assert(removed.find(i.getNode()->getKey()) != NULL);
+				removed_count++;
+			}
+			assert(removed.size() == removed_count);
+
+			old_list.clear();
+			for(core::map<v3s16, bool>::Iterator
+					i = list.m_list.getIterator();
+					i.atEnd()==false; i++)
+				old_list.insert(i.getNode()->getKey(), true);
+		}
+
+		// A block that couldn't be activated is added again
+		core::list<v3s16> positions;
+		positions.push_back(v3s16(100,0,0));
+		list.update(positions, 0, removed, added);
+		list.retryLater(v3s16(100,0,0));
+		assert(!list.contains(v3s16(100,0,0)));
+		added.clear();
+		list.update(positions, 0, removed, added);
+		assert(list.contains(v3s16(100,0,0)));
+		assert(added.size() == 1);
+		// ...unless it has gone out of range
+		list.retryLater(v3s16(100,0,0));
+		positions.clear();
+		added.clear();
+		removed.clear();
+		list.update(positions, 0, removed, added);
+		assert(list.m_list.size() == 0);
+		assert(added.size() == 0 && removed.size() == 0);
+	}
+};
+
+struct TestABMTimer
+{
+	class TestABM : public ActiveBlockModifier
+	{
+	public:
+		std::set<std::string> getTriggerContents()
+		{ return std::set<std::string>(); }
+		float getTriggerInterval()
+		{ return 2.0; }
+		u32 getTriggerChance()
+		{ return 10; }
+	};
+
+	void Run()
+	{
+		TestABM abm;
+		ABMWithState state(&abm);
+		state.timer = 0;
+
+		// Rounds shorter than the interval add up
+		assert(state.step(1.5) == 0);
+		assert(state.step(1.0) == 2.0);
+		assert(fabs(state.timer - 0.5) < 0.001);
+
+		// A round several times the interval applies all of them at
+		// once, and the timer doesn't fall behind
+		float applied = 2.0;
+		for(u32 i=0; i<100; i++)
+		{
+			float elapsed = state.step(7.0);
+			assert(elapsed == 6.0 || elapsed == 8.0);
+			applied += elapsed;
+			assert(state.timer >= -0.001 && state.timer < 2.0);
+		}
+		assert(fabs(applied + state.timer - 702.5) < 0.01);
+	}
+};
+
+struct TestTimeHistogram
+{
+	void Run()
+	{
+		TimeHistogram h;
+		assert(h.percentile(0.5) == 0);
+
+		// Small values are exact
+		for(u32 i=1; i<=10; i++)
+			h.add(i);
+		assert(h.percentile(0.5) == 5);
+		assert(h.percentile(1.0) == 10);
+		assert(h.getMax() == 10);
+
+		// Larger ones are within the bucket precision
+		h.clear();
+		for(u32 i=1; i<=100000; i++)
+			h.add(i);
+		assert(h.getCount() == 100000);
+		assert(fabs(h.percentile(0.5) - 50000.0) < 50000 * 0.07);
+		assert(fabs(h.percentile(0.99) - 99000.0) < 99000 * 0.07);
+		assert(h.percentile(0.999) <= 100000);
+		assert(h.getMax() == 100000);
+		assert(fabs(h.getAverage() - 50000.5) < 1);
+
+		// The full range fits
+		h.add(0xffffffff);
+		assert(h.percentile(1.0) == 0xffffffff);
+	}
+};
+
+struct TestProfiler
+{
+	class AddThread : public SimpleThread
+	{
+	public:
+		AddThread(Profiler *profiler): m_profiler(profiler) {}
+		void * Thread()
+		{
+			ThreadStarted();
+			ProfilerHandle h = m_profiler->getHandle("test: sum");
+			for(u32 i=0; i<1000; i++)
+				m_profiler->add(h, 1);
+			for(u32 i=0; i<100; i++)
+				m_profiler->avg("test: avg", 4);
+			m_profiler->record(h, 1000);
+			return NULL;
+		}
+	private:
+		Profiler *m_profiler;
+	};
+
+	void Run()
+	{
+		Profiler profiler;
+		ProfilerHandle h = profiler.getHandle("test: sum");
+		assert(profiler.getHandle("test: sum") == h);
+		assert(profiler.getHandle("test: other") != h);
+
+		// The counters of the threads are summed up when read
+		AddThread thread(&profiler);
+		thread.Start();
+		for(u32 i=0; i<1000; i++)
+			profiler.add("test: sum", 2);
+		for(u32 i=0; i<300; i++)
+			profiler.avg("test: avg", 2);
+		profiler.record(h, 3000);
+		while(thread.IsRunning())
+			sleep_ms(1);
+
+		std::ostringstream os;
+		profiler.print(os);
+		assert(os.str().find("test: sum: ") != std::string::npos);
+		assert(os.str().find(" 3000\n") != std::string::npos);
+		assert(os.str().find(" 2.5\n") != std::string::npos);
+		TimeHistogram hist;
+		assert(profiler.getHistogram("test: sum", hist));
+		assert(hist.getCount() == 2 && hist.getMax() == 3000);
+
+		// Clearing keeps the names but resets the values
+		profiler.clear();
+		std::ostringstream os2;
+		profiler.print(os2);
+		assert(os2.str().find("test: sum: ") != std::string::npos);
+		assert(os2.str().find(" 3000\n") == std::string::npos);
+	}
+};
+
 #define TEST(X)\
 {\
 	X x;\
@@ -1447,6 +2059,15 @@ void run_tests()
 	TESTPARAMS(TestMapNode, ndef);
 	TESTPARAMS(TestVoxelManipulator, ndef);
 	TESTPARAMS(TestVoxelAlgorithms, ndef);
+	TEST(TestNodeTimerList);
+	TEST(TestMapBlockCompression);
+	TESTPARAMS(TestCollision, ndef);
+	TESTPARAMS(TestPlayerDatabase, ndef);
+	TEST(TestScriptBudget);
+	TEST(TestActiveBlockList);
+	TEST(TestABMTimer);
+	TEST(TestTimeHistogram);
+	TEST(TestProfiler);
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
 	if(INTERNET_SIMULATOR == false){
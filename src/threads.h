@@ -32,6 +32,14 @@ typedef pthread_t threadid_t;
 #define __FUNCTION_NAME __PRETTY_FUNCTION__
 #endif
 
+// Storage class of a variable that each thread has a copy of;
+// only for plain data
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 inline threadid_t get_current_thread_id()
 {
 #if (defined(WIN32) || defined(_WIN32_WCE))
@@ -30,6 +30,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodedef.h" // For texture atlas making
 #include "gamedef.h"
 #include "utility_string.h"
+#include "profiler.h"
+#include "constants.h" // CRACK_ANIMATION_LENGTH
 
 /*
 	A cache from texture name to texture path
@@ -386,8 +388,28 @@ public:
 	// Build the main texture atlas which contains most of the
 	// textures.
 	void buildMainAtlas(class IGameDef *gamedef);
+
+	/*
+		Gets the id of the texture of base_id with a crack of the
+		given level. The ids are cached by base id, so this doesn't
+		build texture names like getTextureId() does after the first
+		call. crack -1 returns base_id.
+	*/
+	u32 getCrackTextureId(u32 base_id, bool overlay, int crack);
+
+	/*
+		Generates the textures the node definitions use while drawing,
+		that would otherwise be generated on demand during the game:
+		the separate textures of the tiles and all their cracks.
+		Shall be called from the main thread after the textures of the
+		node definitions have been updated.
+	*/
+	void prebakeNodeTextures(class IGameDef *gamedef);
 	
 private:
+
+	// Updates the statistics of textures generated after loading
+	void reportGeneration(const std::string &name, u32 time_ms);
 	
 	// The id of the thread that is allowed to use irrlicht directly
 	threadid_t m_main_thread;
@@ -412,6 +434,14 @@ private:
 
 	// Queued texture fetches (to be processed by the main thread)
 	RequestQueue<std::string, u32, u8, u8> m_get_texture_queue;
+
+	// Maps (base id, overlay, crack level) to crack texture ids.
+	// Behind m_atlaspointer_cache_mutex.
+	core::map<u32, u32> m_crack_ids;
+
+	// Whether prebakeNodeTextures() has been called; textures
+	// generated after it cause hitches in the game
+	bool m_prebaked;
 };
 
 IWritableTextureSource* createTextureSource(IrrlichtDevice *device)
@@ -422,7 +452,8 @@ IWritableTextureSource* createTextureSource(IrrlichtDevice *device)
 TextureSource::TextureSource(IrrlichtDevice *device):
 		m_device(device),
 		m_main_atlas_image(NULL),
-		m_main_atlas_texture(NULL)
+		m_main_atlas_texture(NULL),
+		m_prebaked(false)
 {
 	assert(m_device);
 	
@@ -461,7 +492,10 @@ u32 TextureSource::getTextureId(const std::string &name)
 	*/
 	if(get_current_thread_id() == m_main_thread)
 	{
-		return getTextureIdDirect(name);
+		u32 time1 = porting::getTimeMs();
+		u32 id = getTextureIdDirect(name);
+		reportGeneration(name, porting::getTimeMs() - time1);
+		return id;
 	}
 	else
 	{
@@ -746,8 +780,13 @@ void TextureSource::processQueue()
 {
 	/*
 		Fetch textures
+
+		Other threads wait for their requests, so handle as many as
+		fit in a few milliseconds instead of one per frame.
 	*/
-	if(m_get_texture_queue.size() > 0)
+	u32 time_start = porting::getTimeMs();
+	while(m_get_texture_queue.size() > 0
+			&& porting::getTimeMs() - time_start < 5)
 	{
 		GetRequest<std::string, u32, u8, u8>
 				request = m_get_texture_queue.pop();
@@ -761,12 +800,95 @@ void TextureSource::processQueue()
 				result;
 		result.key = request.key;
 		result.callers = request.callers;
+		u32 time1 = porting::getTimeMs();
 		result.item = getTextureIdDirect(request.key);
+		reportGeneration(request.key, porting::getTimeMs() - time1);
 
 		request.dest->push_back(result);
 	}
 }
 
+void TextureSource::reportGeneration(const std::string &name, u32 time_ms)
+{
+	if(!m_prebaked)
+		return;
+	g_profiler->add("Tsrc: textures generated in game", 1);
+	g_profiler->avg("Tsrc: texture generation time (ms)", time_ms);
+	if(time_ms >= 5)
+	{
+		infostream<<"TextureSource: Hitch: generating \""<<name
+				<<"\" took "<<time_ms<<"ms"<<std::endl;
+	}
+}
+
+u32 TextureSource::getCrackTextureId(u32 base_id, bool overlay, int crack)
+{
+	if(crack < 0)
+		return base_id;
+	if(crack > CRACK_ANIMATION_LENGTH - 1)
+		crack = CRACK_ANIMATION_LENGTH - 1;
+
+	u32 key = (base_id * 2 + (overlay ? 1 : 0)) * CRACK_ANIMATION_LENGTH
+			+ crack;
+	{
+		JMutexAutoLock lock(m_atlaspointer_cache_mutex);
+		core::map<u32, u32>::Node *n = m_crack_ids.find(key);
+		if(n != NULL)
+			return n->getValue();
+	}
+
+	std::ostringstream os(std::ios::binary);
+	os<<getTextureName(base_id)<<(overlay ? "^[cracko" : "^[crack")<<crack;
+	u32 id = getTextureId(os.str());
+
+	// 0 is returned if another thread timed out waiting for it
+	if(id != 0)
+	{
+		JMutexAutoLock lock(m_atlaspointer_cache_mutex);
+		m_crack_ids.set(key, id);
+	}
+	return id;
+}
+
+void TextureSource::prebakeNodeTextures(class IGameDef *gamedef)
+{
+	assert(gamedef->tsrc() == this);
+	assert(get_current_thread_id() == m_main_thread);
+	INodeDefManager *ndef = gamedef->ndef();
+
+	u32 time1 = porting::getTimeMs();
+	u32 count_before = m_atlaspointer_cache.size();
+
+	for(u16 j=0; j<MAX_CONTENT+1; j++)
+	{
+		if(j == CONTENT_IGNORE || j == CONTENT_AIR)
+			continue;
+		const ContentFeatures &f = ndef->get(j);
+		if(f.name == "")
+			continue;
+		// The drawtypes of content_mapblock.cpp that draw the crack
+		// only on the opaque pixels of the texture
+		bool overlay = (f.drawtype == NDT_TORCHLIKE
+				|| f.drawtype == NDT_SIGNLIKE
+				|| f.drawtype == NDT_PLANTLIKE
+				|| f.drawtype == NDT_RAILLIKE);
+		for(u32 i=0; i<6; i++)
+		{
+			// The crack is drawn on a separate texture of the tile;
+			// see getNodeTileN()
+			AtlasPointer ap = getTextureRawAP(f.tiles[i].texture);
+			for(s32 crack=0; crack<CRACK_ANIMATION_LENGTH; crack++)
+				getCrackTextureId(ap.id, overlay, crack);
+		}
+	}
+
+	m_prebaked = true;
+
+	infostream<<"TextureSource::prebakeNodeTextures(): Generated "
+			<<(m_atlaspointer_cache.size() - count_before)<<" textures in "
+			<<(porting::getTimeMs() - time1)<<"ms"<<std::endl;
+}
+
 void TextureSource::insertSourceImage(const std::string &name, video::IImage *img)
 {
 	//infostream<<"TextureSource::insertSourceImage(): name="<<name<<std::endl;
@@ -120,6 +120,8 @@ public:
 	virtual IrrlichtDevice* getDevice()
 		{return NULL;}
 	virtual void updateAP(AtlasPointer &ap){};
+	virtual u32 getCrackTextureId(u32 base_id, bool overlay, int crack)
+		{return 0;}
 };
 
 class IWritableTextureSource : public ITextureSource
@@ -138,11 +140,14 @@ public:
 	virtual IrrlichtDevice* getDevice()
 		{return NULL;}
 	virtual void updateAP(AtlasPointer &ap){};
+	virtual u32 getCrackTextureId(u32 base_id, bool overlay, int crack)
+		{return 0;}
 
 	virtual void processQueue()=0;
 	virtual void insertSourceImage(const std::string &name, video::IImage *img)=0;
 	virtual void rebuildImagesAndTextures()=0;
 	virtual void buildMainAtlas(class IGameDef *gamedef)=0;
+	virtual void prebakeNodeTextures(class IGameDef *gamedef)=0;
 };
 
 IWritableTextureSource* createTextureSource(IrrlichtDevice *device);
@@ -0,0 +1,108 @@
+-- ABM actions, taken from default/leafdecay.lua, obsidian and fire
+
+local positions = {}
+for i = 1, 64 do
+	positions[i] = {x=(i*5)%32, y=(i*3)%32, z=(i*11)%32}
+end
+
+-- default/leafdecay.lua
+local leafdecay_trunk_cache = {}
+local function leafdecay_action(p0, node, _, _)
+	local do_preserve = false
+	local d = minetest.registered_nodes[node.name].groups.leafdecay
+	if not d or d == 0 then
+		return
+	end
+	local n0 = minetest.env:get_node(p0)
+	if n0.param2 ~= 0 then
+		return
+	end
+	local p0_hash = minetest.hash_node_position(p0)
+	local trunkp = leafdecay_trunk_cache[p0_hash]
+	if trunkp then
+		local n = minetest.env:get_node(trunkp)
+		local reg = minetest.registered_nodes[n.name]
+		if n.name == "ignore" or (reg.groups.tree and reg.groups.tree ~= 0) then
+			return
+		end
+		leafdecay_trunk_cache[p0_hash] = nil
+	end
+	local p1 = minetest.env:find_node_near(p0, d, {"ignore", "group:tree"})
+	if p1 then
+		do_preserve = true
+		leafdecay_trunk_cache[p0_hash] = p1
+	end
+	if not do_preserve then
+		local itemstacks = minetest.get_node_drops(n0.name)
+		for _, itemname in ipairs(itemstacks) do
+			if itemname ~= n0.name or
+					minetest.get_item_group(itemname, "leafdecay") == 2 then
+				local p_drop = {
+					x = p0.x - 0.5 + math.random(),
+					y = p0.y - 0.5 + math.random(),
+					z = p0.z - 0.5 + math.random(),
+				}
+				minetest.env:add_item(p_drop, itemname)
+			end
+		end
+	end
+end
+
+luabench.register("abm: leafdecay", function()
+	return function(i)
+		local p = positions[i % #positions + 1]
+		leafdecay_action(p, {name="default:leaves", param1=0, param2=0}, 0, 0)
+		-- The trunk cache would normally be invalidated by map changes
+		if i % 16 == 0 then
+			leafdecay_trunk_cache = {}
+		end
+	end
+end)
+
+-- obsidian/init.lua
+local function lava_cooling_action(pos, node, _, _)
+	for i=-1,1 do
+		for j=-1,1 do
+			for k=-1,1 do
+				local p = {x=pos.x+i, y=pos.y+j, z=pos.z+k}
+				local n = minetest.env:get_node(p)
+				if (n.name == "default:water_flowing") or (n.name == "default:water_source") then
+					if not (((p.x > pos.x) and (p.z > pos.z)) or ((p.x < pos.x) and (p.z < pos.z)) or ((p.x < pos.x) and (p.z > pos.z)) or ((p.x > pos.x) and (p.z < pos.z))) then
+						-- Would turn the lava into obsidian; leave the
+						-- world unchanged between iterations
+						n.name = "obsidian:obsidian_block"
+					end
+				end
+			end
+		end
+	end
+end
+
+luabench.register("abm: lava cooling", function()
+	return function(i)
+		local p = positions[i % #positions + 1]
+		lava_cooling_action(p, {name="default:lava_source", param1=0, param2=0}, 0, 0)
+	end
+end)
+
+-- fire/init.lua
+local function flame_should_extinguish(pos)
+	local p0 = {x=pos.x-2, y=pos.y, z=pos.z-2}
+	local p1 = {x=pos.x+2, y=pos.y, z=pos.z+2}
+	local ps = minetest.env:find_nodes_in_area(p0, p1, {"group:puts_out_fire"})
+	return (#ps ~= 0)
+end
+
+local function fire_ignite_action(p0, node, _, _)
+	if flame_should_extinguish(p0) then
+		return
+	end
+	return minetest.env:find_node_near(p0, 1, {"air"})
+end
+
+luabench.register("abm: fire ignite", function()
+	return function(i)
+		local p = positions[i % #positions + 1]
+		fire_ignite_action(p, {name="default:tree", param1=0, param2=0}, 0, 0)
+	end
+end)
@@ -0,0 +1,80 @@
+-- Craft registration, taken from minetest.register_craft
+-- (builtin/misc_register.lua) and recipes of the default mod
+
+local function register_craft(craftdef)
+	local tempcraftdef = craftdef
+	if craftdef.recipe ~= nil and craftdef.output ~= nil then
+		if craftdef.type == "cooking" then
+			if minetest.registered_clones[craftdef.recipe] ~= nil then
+				for i,v in ipairs(minetest.registered_clones[craftdef.recipe]) do
+					tempcraftdef.recipe = v
+					minetest.registered_smeltables[v] = craftdef.output
+					minetest.register_craft_raw(tempcraftdef)
+				end
+			else
+				minetest.registered_smeltables[craftdef.recipe] = craftdef.burntime
+				minetest.register_craft_raw(craftdef)
+			end
+		elseif craftdef.type == "fuel" then
+			if minetest.registered_clones[craftdef.recipe] ~= nil then
+				for i,v in ipairs(minetest.registered_clones[craftdef.recipe]) do
+					tempcraftdef.recipe = v
+					minetest.registered_fuels[v] = craftdef.burntime
+					minetest.register_craft_raw(tempcraftdef)
+				end
+			else
+				minetest.registered_fuels[craftdef.recipe] = craftdef.burntime
+				minetest.register_craft_raw(craftdef)
+			end
+		else
+			for i,v in ipairs(craftdef.recipe) do
+				for x,y in ipairs(v) do
+					if minetest.registered_clones[y] ~= nil then
+						for z,a in ipairs(minetest.registered_clones[y]) do
+							minetest.registered_crafts[tempcraftdef.recipe] = craftdef.output
+							minetest.register_craft_raw(tempcraftdef)
+						end
+					else
+						minetest.registered_crafts[craftdef.recipe] = craftdef.output
+						minetest.register_craft_raw(craftdef)
+					end
+				end
+			end
+		end
+	end
+end
+
+minetest.registered_clones["default:wood"] = {"default:wood", "default:junglewood"}
+
+luabench.register("craft: register_craft", function()
+	return function(i)
+		register_craft({
+			output = 'default:pick_stone',
+			recipe = {
+				{'default:cobble', 'default:cobble', 'default:cobble'},
+				{'', 'default:stick', ''},
+				{'', 'default:stick', ''},
+			}
+		})
+		register_craft({
+			output = 'default:stick 4',
+			recipe = {
+				{'default:wood'},
+			}
+		})
+		register_craft({
+			type = "cooking",
+			output = "default:glass",
+			recipe = "default:sand",
+		})
+		register_craft({
+			type = "fuel",
+			recipe = "default:wood",
+			burntime = 7,
+		})
+		-- Registration tables only grow at startup; don't let them here
+		if i % 64 == 0 then
+			minetest.registered_crafts = {}
+		end
+	end
+end)
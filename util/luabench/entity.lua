@@ -0,0 +1,107 @@
+-- Entity steps, taken from the on_step of __builtin:item
+-- (builtin/item_entity.lua)
+
+local item_entity = {
+	itemstring = 'default:dirt',
+	physical_state = true,
+	dontbugme = true,
+	outercircle = 2.0,
+	innercircle = 0.5,
+	gravity = true,
+	whocaresaboutnodes = false,
+	lastplayer = false,
+	timer = 0,
+
+	on_step = function(self, dtime)
+		self.timer = self.timer + dtime
+		local p = self.object:getpos()
+		p.y = p.y - 0.3
+		local nn = minetest.env:get_node(p).name
+		if minetest.registered_nodes[nn].walkable and self.whocaresaboutnodes == false then
+			if self.physical_state then
+				self.object:setvelocity({x=0, y=0, z=0})
+				self.object:setacceleration({x=0, y=0, z=0})
+				self.physical_state = false
+				self.object:set_properties({
+					physical = false
+				})
+				self.dontbugme = false
+			end
+		else
+			if not self.physical_state and self.gravity == true then
+				self.object:setvelocity({x=0, y=0, z=0})
+				self.object:setacceleration({x=0, y=-10, z=0})
+				self.physical_state = true
+				self.object:set_properties({
+					physical = true
+				})
+				self.dontbugme = true
+			end
+		end
+		local pos = p
+		local objs = minetest.env:get_objects_inside_radius(pos, self.innercircle)
+		local objs2 = minetest.env:get_objects_inside_radius(pos, self.outercircle)
+		for k, obj in pairs(objs) do
+			local objpos=obj:getpos()
+			if objpos.y >= pos.y-1.5 and objpos.y <= pos.y+.5 then
+				if obj:get_player_name() ~= nil then
+					-- Would be picked up here; keep it around for
+					-- the next iteration instead
+				end
+			end
+		end
+		local playerfound = false
+		for k, obj in pairs(objs2) do
+			local objpos=obj:getpos()
+			if obj:get_player_name() ~= nil and objpos.y >= pos.y-1.25 and objpos.y <= pos.y+.25 then
+				playerfound = true
+				if self.dontbugme == false then
+					self.lastplayer = true
+					local fx = objpos.x - pos.x
+					local fy = objpos.y - pos.y
+					local fz = objpos.z - pos.z
+					self.gravity = false
+					self.physical_state = false
+					self.object:set_properties({
+						physical = false
+					})
+					self.object:setvelocity({x=fx * 5, y=fy * 5, z=fz * 5})
+					self.dontbugme = true
+					self.whocaresaboutnodes = true
+				end
+			end
+		end
+		if playerfound == false then
+			if self.lastplayer == true then
+				self.lastplayer = false
+				self.object:setvelocity({x=0, y=0, z=0})
+				self.object:setacceleration({x=0, y=-10, z=0})
+			end
+			self.gravity = true
+			self.physical_state = true
+			self.object:set_properties({
+				physical = true
+			})
+			self.whocaresaboutnodes = false
+		end
+	end,
+}
+item_entity.__index = item_entity
+
+luabench.register("entity: item on_step", function()
+	-- Some items lying around and some next to the player
+	local entities = {}
+	for i = 1, 32 do
+		local pos = {x=(i*3)%32 + 0.3, y=4.5, z=(i*7)%32 + 0.2}
+		if i % 8 == 0 then
+			pos = {x=3.5, y=4.2, z=3.5}
+		end
+		local e = setmetatable({}, item_entity)
+		e.object = luabench.new_object(pos)
+		entities[i] = e
+	end
+	return function(i)
+		local e = entities[i % #entities + 1]
+		e:on_step(0.05)
+	end
+end)
@@ -0,0 +1,76 @@
+-- Lua microbenchmarks built from mod workloads
+--
+-- Compares the throughput of Lua interpreters on the kind of code the
+-- server runs: ABM actions, entity steps and craft registration.
+--
+-- Run standalone with any Lua 5.1 compatible interpreter:
+--   lua util/luabench/init.lua
+--   luajit util/luabench/init.lua
+-- or through the interpreter the engine is linked with:
+--   minetest --speedtests
+--
+-- The engine API is replaced by a small in-memory mock (mock.lua), so
+-- the results measure Lua execution and not map access.
+
+luabench = {}
+luabench.results = {}
+
+-- Directory of this file; set by the engine when run from it
+if not luabench_path then
+	luabench_path = string.match(arg and arg[0] or "", "^(.*)[/\\]") or "."
+end
+
+local benchmarks = {}
+
+-- Registers a benchmark. setup() is called once and returns the function
+-- to time; that function is called repeatedly with an iteration counter.
+function luabench.register(name, setup)
+	benchmarks[#benchmarks+1] = {name=name, setup=setup}
+end
+
+local function run(bench, min_time)
+	local f = bench.setup()
+	-- Warm up (gives a JIT the chance to compile the hot paths)
+	for i = 1, 100 do
+		f(i)
+	end
+	local ops = 0
+	local batch = 100
+	local t0 = os.clock()
+	local t = 0
+	while t < min_time do
+		for i = 1, batch do
+			f(ops + i)
+		end
+		ops = ops + batch
+		t = os.clock() - t0
+		if t < min_time / 10 then
+			batch = batch * 2
+		end
+	end
+	return ops / t
+end
+
+dofile(luabench_path .. "/mock.lua")
+dofile(luabench_path .. "/abm.lua")
+dofile(luabench_path .. "/entity.lua")
+dofile(luabench_path .. "/craft.lua")
+
+local interpreter = _VERSION
+if jit then
+	interpreter = jit.version .. " (JIT " .. (jit.status() and "on" or "off") .. ")"
+end
+luabench.interpreter = interpreter
+
+local min_time = tonumber(luabench_min_time) or 0.5
+for _, bench in ipairs(benchmarks) do
+	collectgarbage("collect")
+	local ops = run(bench, min_time)
+	luabench.results[#luabench.results+1] = {name=bench.name, ops=ops}
+	if not luabench_engine then
+		print(string.format("%-32s %12.0f ops/s", bench.name, ops))
+	end
+end
+if not luabench_engine then
+	print("Interpreter: " .. interpreter)
+end
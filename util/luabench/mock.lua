@@ -0,0 +1,181 @@
+-- Minimal stand-in for the parts of the minetest API the benchmarks use.
+-- Like the engine, it hands out a new table for every node and position
+-- crossing the API, so allocation behaviour is comparable.
+
+minetest = {}
+minetest.registered_nodes = {}
+minetest.registered_items = {}
+minetest.registered_clones = {}
+minetest.registered_crafts = {}
+minetest.registered_smeltables = {}
+minetest.registered_fuels = {}
+
+local function register_node(name, groups, walkable)
+	local def = {name=name, groups=groups or {}, walkable=walkable ~= false,
+			type="node", inventory_image=name..".png"}
+	minetest.registered_nodes[name] = def
+	minetest.registered_items[name] = def
+end
+
+register_node("air", {}, false)
+register_node("ignore", {}, false)
+register_node("default:stone", {cracky=3})
+register_node("default:dirt_with_grass", {crumbly=3})
+register_node("default:tree", {tree=1, snappy=2, flammable=2})
+register_node("default:leaves", {snappy=3, leafdecay=3, flammable=2})
+register_node("default:water_source", {liquid=3}, false)
+register_node("default:water_flowing", {liquid=3}, false)
+register_node("default:lava_source", {liquid=2, igniter=2}, false)
+register_node("default:lava_flowing", {liquid=2, igniter=2}, false)
+register_node("fire:basic_flame", {igniter=2, dig_immediate=3}, false)
+register_node("obsidian:obsidian_block", {oddly_breakable_by_hand=1})
+
+-- A 32x32x32 world; names repeat in a pattern that gives the ABMs
+-- something to find
+local SIZE = 32
+local names = {"air", "default:stone", "default:leaves", "default:tree",
+		"default:water_source", "air", "default:leaves", "default:lava_source"}
+local world = {}
+for i = 0, SIZE*SIZE*SIZE - 1 do
+	world[i] = names[(i * 7 + math.floor(i / 5)) % #names + 1]
+end
+
+local function index(p)
+	local x = math.floor(p.x + 0.5) % SIZE
+	local y = math.floor(p.y + 0.5) % SIZE
+	local z = math.floor(p.z + 0.5) % SIZE
+	return (z * SIZE + y) * SIZE + x
+end
+
+local function matches(name, filter)
+	for _, f in ipairs(filter) do
+		if f == name then
+			return true
+		end
+		if string.sub(f, 1, 6) == "group:" then
+			local g = minetest.registered_nodes[name].groups[string.sub(f, 7)]
+			if g and g ~= 0 then
+				return true
+			end
+		end
+	end
+	return false
+end
+
+local env = {}
+minetest.env = env
+
+function env:get_node(p)
+	return {name=world[index(p)], param1=0, param2=0}
+end
+function env:set_node(p, node)
+	world[index(p)] = node.name
+end
+env.add_node = env.set_node
+function env:remove_node(p)
+	world[index(p)] = "air"
+end
+function env:find_node_near(p, radius, nodenames)
+	for d = 0, radius do
+		for x = -d, d do
+		for y = -d, d do
+		for z = -d, d do
+			local p2 = {x=p.x+x, y=p.y+y, z=p.z+z}
+			if matches(world[index(p2)], nodenames) then
+				return p2
+			end
+		end
+		end
+		end
+	end
+	return nil
+end
+
+function env:find_nodes_in_area(minp, maxp, nodenames)
+	local result = {}
+	for x = minp.x, maxp.x do
+	for y = minp.y, maxp.y do
+	for z = minp.z, maxp.z do
+		local p = {x=x, y=y, z=z}
+		if matches(world[index(p)], nodenames) then
+			result[#result+1] = p
+		end
+	end
+	end
+	end
+	return result
+end
+function env:add_item(p, item)
+end
+
+function minetest.sound_play(spec, params)
+	return 1
+end
+function minetest.sound_stop(handle)
+end
+
+-- Objects
+local ObjectRef = {}
+ObjectRef.__index = ObjectRef
+function ObjectRef:getpos()
+	return {x=self.pos.x, y=self.pos.y, z=self.pos.z}
+end
+function ObjectRef:setvelocity(v)
+	self.velocity = v
+end
+function ObjectRef:setacceleration(a)
+	self.acceleration = a
+end
+function ObjectRef:set_properties(prop)
+	for k, v in pairs(prop) do
+		self.properties[k] = v
+	end
+end
+function ObjectRef:get_player_name()
+	return self.player_name
+end
+function ObjectRef:remove()
+end
+
+function luabench.new_object(pos, player_name)
+	return setmetatable({pos=pos, player_name=player_name, properties={}},
+			ObjectRef)
+end
+
+local objects = {
+	luabench.new_object({x=3, y=4, z=3}, "singleplayer"),
+	luabench.new_object({x=10, y=4, z=10}),
+	luabench.new_object({x=3.2, y=4, z=3.1}),
+}
+function env:get_objects_inside_radius(p, radius)
+	local result = {}
+	for _, obj in ipairs(objects) do
+		local op = obj.pos
+		local dx, dy, dz = op.x - p.x, op.y - p.y, op.z - p.z
+		if dx*dx + dy*dy + dz*dz <= radius*radius then
+			result[#result+1] = obj
+		end
+	end
+	return result
+end
+
+function minetest.hash_node_position(pos)
+	return (pos.z+32768)*65536*65536 + (pos.y+32768)*65536 + pos.x+32768
+end
+
+function minetest.get_item_group(name, group)
+	if not minetest.registered_items[name] or not
+			minetest.registered_items[name].groups[group] then
+		return 0
+	end
+	return minetest.registered_items[name].groups[group]
+end
+
+function minetest.get_node_drops(nodename)
+	return {nodename}
+end
+
+minetest.register_craft_raw_count = 0
+function minetest.register_craft_raw(craftdef)
+	minetest.register_craft_raw_count = minetest.register_craft_raw_count + 1
+end